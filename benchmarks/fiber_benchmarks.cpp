@@ -0,0 +1,446 @@
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../boys_surface.h"
+#include "../colormap.h"
+#include "../density_bricks.h"
+#include "../density_texture.h"
+#include "../density_voxelizer.h"
+#include "../mapped_file.h"
+#include "../parallel.h"
+#include "../tractogram.h"
+#include "../tractogram_reader.h"
+#include "../volume_tools.h"
+#include "../znzlib.h"
+
+/*
+	Command line tool running the benchmarks of the fiber viewer modules. The benchmarks are only
+	compiled with FIBER_BENCHMARKS, which this project defines, so the viewer does not contain them.
+*/
+
+namespace {
+
+	typedef cgv::render::render_types::mat4 mat4;
+	typedef cgv::render::render_types::box3 box3;
+
+	void print_usage() {
+
+		std::cout << "usage: fiber_benchmarks <benchmark> [arguments]\n"
+			"  reader <file>             read a tractography file with its reader backend\n"
+			"  synthetic <dir> [GB]      write a synthetic tractogram of the given size in every format and read them\n"
+			"  colormap [name]           map values with the per-value and the batch path\n"
+			"  boys                      map directions to Boy's surface colors, fails above the tolerance\n"
+			"  permutation               permute the axes of a volume\n"
+			"  gzip <file>               read a compressed file through BGZF and zlib\n"
+			"  density <file> [radius]   voxelize a tractography file and build its density volumes" << std::endl;
+	}
+
+	/*
+		Random walk tracts of 50 to 250 points with one scalar per point, stored as interleaved xyz and
+		scalar like in a .trk record. The same seed always gives the same tracts.
+	*/
+	class synthetic_tracts {
+	public:
+		/// the points of the current tract
+		std::vector<float> points;
+
+		synthetic_tracts(unsigned seed = 1u) : rng(seed) {}
+
+		size_t get_point_count() const { return points.size() / 4; }
+
+		/// generate the next tract into points
+		void next() {
+
+			std::uniform_int_distribution<int> length(50, 250);
+			std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+
+			const size_t n = (size_t)length(rng);
+			points.resize(4 * n);
+
+			// Start anywhere in a 150 mm cube and take 1 mm steps that only change direction slowly
+			float p[3] = { 75.0f + 75.0f * uniform(rng), 75.0f + 75.0f * uniform(rng), 75.0f + 75.0f * uniform(rng) };
+			float d[3] = { uniform(rng), uniform(rng), uniform(rng) };
+
+			for(size_t i = 0; i < n; ++i) {
+				for(int c = 0; c < 3; ++c)
+					d[c] += 0.2f * uniform(rng);
+
+				float norm = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) + 1e-6f;
+				for(int c = 0; c < 3; ++c) {
+					d[c] /= norm;
+					p[c] += d[c];
+					points[4 * i + c] = p[c];
+				}
+				points[4 * i + 3] = 0.5f + 0.5f * uniform(rng);
+			}
+		}
+
+	private:
+		std::mt19937 rng;
+	};
+
+	/*
+		Writes a .trk file of at least the given size filled with synthetic tracts and returns the number
+		of tracts in n_count. The records are written through a buffer, so the file can be larger than the
+		memory.
+	*/
+	bool write_synthetic_trk(const std::string& file_name, uint64_t size, int32_t& n_count) {
+
+		std::ofstream out(file_name, std::ios::binary);
+		if(!out) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+
+		char header[1000] = {};
+		const short int dim[3] = { 150, 150, 150 };
+		const float voxel_size[3] = { 1.0f, 1.0f, 1.0f };
+		const short int n_scalars = 1;
+		const int32_t version = 2;
+		const int32_t hdr_size = 1000;
+
+		std::memcpy(header, "TRACK", 6);
+		std::memcpy(header + 6, dim, sizeof(dim));
+		std::memcpy(header + 12, voxel_size, sizeof(voxel_size));
+		std::memcpy(header + 36, &n_scalars, sizeof(n_scalars));
+		std::memcpy(header + 38, "scalar", 6);
+		std::memcpy(header + 948, "LPS", 3);
+		std::memcpy(header + 992, &version, sizeof(version));
+		std::memcpy(header + 996, &hdr_size, sizeof(hdr_size));
+		out.write(header, sizeof(header));
+
+		synthetic_tracts tracts;
+		std::vector<char> buffer;
+		uint64_t written = sizeof(header);
+		n_count = 0;
+
+		while(written < size) {
+			tracts.next();
+
+			const int32_t count = (int32_t)tracts.get_point_count();
+			const size_t offset = buffer.size();
+			buffer.resize(offset + sizeof(count) + tracts.points.size() * sizeof(float));
+			std::memcpy(buffer.data() + offset, &count, sizeof(count));
+			std::memcpy(buffer.data() + offset + sizeof(count), tracts.points.data(), tracts.points.size() * sizeof(float));
+
+			written += buffer.size() - offset;
+			++n_count;
+
+			if(buffer.size() >= (64u << 20) || written >= size) {
+				out.write(buffer.data(), buffer.size());
+				buffer.clear();
+			}
+		}
+
+		// The number of tracks is only known at the end
+		out.seekp(988);
+		out.write(reinterpret_cast<const char*>(&n_count), sizeof(n_count));
+		out.close();
+
+		if(!out) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+
+		std::cout << "wrote " << n_count << " tracts, " << written / (1024.0 * 1024.0 * 1024.0) << " GB to " << file_name << std::endl;
+		return true;
+	}
+
+	/*
+		Writes the first tract_count synthetic tracts to a .tck file, which are the tracts of the .trk
+		file written with the same count.
+	*/
+	bool write_synthetic_tck(const std::string& file_name, int32_t tract_count) {
+
+		std::ofstream out(file_name, std::ios::binary);
+		if(!out) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+
+		// The data offset is part of the header, so its length depends on the number of digits
+		std::string header = "mrtrix tracks\ndatatype: Float32LE\ncount: " + std::to_string(tract_count) + "\nfile: . ";
+		size_t offset = header.size();
+		while(header.size() + std::to_string(offset).size() + 5 != offset)
+			offset = header.size() + std::to_string(offset).size() + 5;
+		header += std::to_string(offset) + "\nEND\n";
+		out.write(header.data(), header.size());
+
+		synthetic_tracts tracts;
+		std::vector<float> buffer;
+		const float delimiter = std::nanf("");
+		const float end = std::numeric_limits<float>::infinity();
+
+		for(int32_t i = 0; i < tract_count; ++i) {
+			tracts.next();
+
+			for(size_t j = 0; j < tracts.get_point_count(); ++j)
+				buffer.insert(buffer.end(), tracts.points.data() + 4 * j, tracts.points.data() + 4 * j + 3);
+			buffer.insert(buffer.end(), 3, delimiter);
+
+			if(buffer.size() * sizeof(float) >= (64u << 20) || i + 1 == tract_count) {
+				if(i + 1 == tract_count)
+					buffer.insert(buffer.end(), 3, end);
+				out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(float));
+				buffer.clear();
+			}
+		}
+
+		out.close();
+		if(!out) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	/*
+		Compresses a file with bgzip's format: independent gzip members of at most 64 KB that store their
+		size in a BC extra field, followed by an empty end of file member. Batches of blocks are deflated
+		in parallel and written in order.
+	*/
+	bool write_bgzf(const std::string& source, const std::string& file_name) {
+
+		mapped_file in;
+		if(!in.open(source)) {
+			std::cout << "Error: could not open " << source << "!" << std::endl;
+			return false;
+		}
+
+		std::ofstream out(file_name, std::ios::binary);
+		if(!out) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+
+		// bgzip takes 0xff00 bytes per block, so even incompressible data fits into a member of 64 KB
+		const size_t block_size = 0xff00;
+		const size_t block_count = (in.size() + block_size - 1) / block_size;
+		const size_t batch_size = 1024;
+
+		std::vector<std::vector<unsigned char>> blocks(batch_size);
+		bool failed = false;
+
+		for(size_t first = 0; first < block_count && !failed; first += batch_size) {
+			const size_t count = std::min(batch_size, block_count - first);
+			std::atomic<bool> error(false);
+
+			util::parallel_for(count, 1, [&](size_t begin, size_t end) {
+				for(size_t b = begin; b < end; ++b) {
+					const size_t offset = (first + b) * block_size;
+					const uInt length = (uInt)std::min(block_size, in.size() - offset);
+					const Bytef* src = reinterpret_cast<const Bytef*>(in.data() + offset);
+
+					std::vector<unsigned char>& block = blocks[b];
+					block.resize(18 + compressBound(length) + 8);
+
+					z_stream stream = {};
+					stream.next_in = const_cast<Bytef*>(src);
+					stream.avail_in = length;
+					stream.next_out = block.data() + 18;
+					stream.avail_out = (uInt)(block.size() - 26);
+
+					if(deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+						error = true;
+						continue;
+					}
+					const bool done = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+					const size_t member_size = 18 + stream.total_out + 8;
+					deflateEnd(&stream);
+
+					if(!done || member_size > 65536) {
+						error = true;
+						continue;
+					}
+
+					const unsigned char header[18] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+						(unsigned char)((member_size - 1) & 0xff), (unsigned char)((member_size - 1) >> 8) };
+					std::memcpy(block.data(), header, sizeof(header));
+
+					const uint32_t trailer[2] = { (uint32_t)crc32(0L, src, length), (uint32_t)length };
+					std::memcpy(block.data() + member_size - 8, trailer, sizeof(trailer));
+					block.resize(member_size);
+				}
+			});
+
+			failed = error;
+			for(size_t b = 0; b < count && !failed; ++b)
+				out.write(reinterpret_cast<const char*>(blocks[b].data()), blocks[b].size());
+		}
+
+		const unsigned char eof[28] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+		out.write(reinterpret_cast<const char*>(eof), sizeof(eof));
+		out.close();
+
+		if(failed || !out) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	/*
+		Compresses a file into a single gzip stream, which can only be inflated sequentially.
+	*/
+	bool write_gzip(const std::string& source, const std::string& file_name) {
+
+		mapped_file in;
+		if(!in.open(source)) {
+			std::cout << "Error: could not open " << source << "!" << std::endl;
+			return false;
+		}
+
+		gzFile out = gzopen(file_name.c_str(), "wb1");
+		if(!out) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+
+		bool failed = false;
+		for(size_t offset = 0; offset < in.size() && !failed; offset += (64u << 20)) {
+			const unsigned length = (unsigned)std::min((size_t)(64u << 20), in.size() - offset);
+			failed = gzwrite(out, in.data() + offset, length) != (int)length;
+		}
+
+		if(gzclose(out) != Z_OK || failed) {
+			std::cout << "Error: could not write " << file_name << "!" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	/*
+		Writes the same synthetic tracts of the given size as .trk, .tck, BGZF compressed .trk.gz and plain
+		gzip compressed .trk.gz into the directory and benchmarks every reader backend on them.
+	*/
+	int benchmark_synthetic(const std::string& directory, double gigabytes) {
+
+		const uint64_t size = (uint64_t)(gigabytes * 1024.0 * 1024.0 * 1024.0);
+		const std::string trk = directory + "/synthetic.trk";
+		const std::string tck = directory + "/synthetic.tck";
+		const std::string bgzf = directory + "/synthetic.trk.gz";
+		const std::string gzip = directory + "/synthetic_plain.trk.gz";
+
+		int32_t tract_count = 0;
+		if(!write_synthetic_trk(trk, size, tract_count) || !write_synthetic_tck(tck, tract_count) || !write_bgzf(trk, bgzf) || !write_gzip(trk, gzip))
+			return 1;
+
+		const std::string files[] = { trk, tck, bgzf, gzip };
+		for(const std::string& file_name : files)
+			tractogram_reader::benchmark(file_name, 3u);
+
+		// All backends need to return the same tracts, one file is held in memory at a time
+		mat4 identity;
+		identity.identity();
+
+		double reference = 0.0;
+		for(const std::string& file_name : files) {
+			tractogram tg;
+			if(!tractogram_reader::read_file(file_name, identity, tg))
+				return 1;
+			std::cout << std::endl;
+
+			double sum = (double)tg.tract_count();
+			for(size_t i = 0; i < tg.point_count(); ++i)
+				sum += tg.x[i] + 2.0 * tg.y[i] + 3.0 * tg.z[i];
+
+			if(file_name == trk) {
+				reference = sum;
+			} else if(sum != reference) {
+				std::cout << "Error: " << file_name << " does not match " << trk << "!" << std::endl;
+				return 1;
+			}
+		}
+
+		// Inflation alone through the parallel BGZF path and through zlib
+		return znz_benchmark_read(bgzf.c_str(), 3) == 0 ? 0 : 1;
+	}
+
+	/*
+		Reads the tractogram and runs the voxelization, brick and mipmap benchmarks on it. The first
+		scalar is used as opacity and the radius defaults to the tube radius of the viewer.
+	*/
+	int benchmark_density(const std::string& file_name, float radius) {
+
+		mat4 identity;
+		identity.identity();
+
+		tractogram tg;
+		if(!tractogram_reader::read_file(file_name, identity, tg))
+			return 1;
+		std::cout << std::endl;
+
+		box3 bbox = tg.compute_bounding_box();
+		bbox.add_point(bbox.get_min_pnt() - (radius + 0.01f));
+		bbox.add_point(bbox.get_max_pnt() + (radius + 0.01f));
+
+		util::density_input input;
+		input.tracts = tg.tracts;
+		input.x = tg.x_span();
+		input.y = tg.y_span();
+		input.z = tg.z_span();
+		if(tg.has_radii())
+			input.radii = tg.radius_span();
+		if(!tg.scalars.empty())
+			input.opacities = tg.scalar_span(0);
+
+		util::density_parameters parameters;
+		parameters.radius = radius;
+
+		util::benchmark_density_traversal(input, parameters, bbox);
+		util::benchmark_density_voxelization(input, bbox);
+
+		util::density_sums sums;
+		if(!util::voxelize_density(input, util::density_grid::from_box(bbox, 256u), sums))
+			return 1;
+
+		util::benchmark_density_bricks(sums, parameters);
+		util::benchmark_density_mipmaps(sums, parameters);
+		return 0;
+	}
+}
+
+int main(int argc, char** argv) {
+
+	if(argc < 2) {
+		print_usage();
+		return 1;
+	}
+
+	const std::string name = argv[1];
+
+	if(name == "reader" && argc > 2) {
+		tractogram_reader::benchmark(argv[2]);
+	} else if(name == "synthetic" && argc > 2) {
+		return benchmark_synthetic(argv[2], argc > 3 ? std::atof(argv[3]) : 2.0);
+	} else if(name == "colormap") {
+		const util::colormap* cm = util::colormap_registry::instance().get(argc > 2 ? argv[2] : "coolwarm");
+		if(!cm) {
+			std::cout << "Unknown color map" << std::endl;
+			return 1;
+		}
+		util::benchmark_colormap(*cm);
+	} else if(name == "boys") {
+		return util::benchmark_boys_surface() ? 0 : 1;
+	} else if(name == "permutation") {
+		util::benchmark_axis_permutation();
+	} else if(name == "gzip" && argc > 2) {
+		return znz_benchmark_read(argv[2], 5) == 0 ? 0 : 1;
+	} else if(name == "density" && argc > 2) {
+		return benchmark_density(argv[2], argc > 3 ? (float)std::atof(argv[3]) : 0.015f);
+	} else {
+		print_usage();
+		return 1;
+	}
+
+	return 0;
+}
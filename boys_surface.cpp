@@ -0,0 +1,381 @@
+#include "boys_surface.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BOYS_SURFACE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BOYS_SURFACE_SSE
+#endif
+
+//Alaleh's
+void rp2ColorMapping(float startP[3], float endP[3], float rgb[3])
+{
+	float v[3];
+
+	for (int k = 0; k <= 2; k++)
+		v[k] = endP[k] - startP[k];
+
+	//do a normalization, just in case
+	float l = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+
+	v[0] = v[0] / l;
+	v[1] = v[1] / l;
+	v[2] = v[2] / l;
+
+	float x = v[0];
+	float y = v[1];
+	float z = v[2];
+
+	float xx2 = v[0] * v[0];
+	float xx3 = v[0] * v[0] * v[0];
+	float yy2 = v[1] * v[1];
+	float yy3 = v[1] * v[1] * v[1];
+	float zz2 = v[2] * v[2];
+	float zz3 = v[2] * v[2] * v[2];
+	float zz4 = v[2] * v[2] * v[2] * v[2];
+	float xy = v[0] * v[1];
+	float xz = v[0] * v[2];
+	float yz = v[1] * v[2];
+
+	float hh1 = .5 * (3 * zz2 - 1) / 1.58;
+	float hh2 = 3 * xz / 2.745;
+	float hh3 = 3 * yz / 2.745;
+	float hh4 = 1.5 * (xx2 - yy2) / 2.745;
+	float hh5 = 6 * xy / 5.5;
+	float hh6 = (1 / 1.176) * .125 * (35 * zz4 - 30 * zz2 + 3);
+	float hh7 = 2.5 * x * (7 * zz3 - 3 * z) / 3.737;
+	float hh8 = 2.5 * y * (7 * zz3 - 3 * z) / 3.737;
+	float hh9 = ((xx2 - yy2) * 7.5 * (7 * zz2 - 1)) / 15.85;
+	float hh10 = ((2 * xy) * (7.5 * (7 * zz2 - 1))) / 15.85;
+	float hh11 = 105 * (4 * xx3 * z - 3 * xz * (1 - zz2)) / 59.32;
+	float hh12 = 105 * (-4 * yy3 * z + 3 * yz * (1 - zz2)) / 59.32;
+
+	float s0 = -23.0;
+	float s1 = 227.9;
+	float s2 = 251.0;
+	float s3 = 125.0;
+
+	auto SS = [](float NA, float ND) -> float
+	{
+		return NA * sin(ND * 3.141592 / 180);
+	};
+
+	auto CC = [](float NA, float ND) -> float
+	{
+		return NA * cos(ND * 3.141592 / 180);
+	};
+
+	float ss23 = SS(2.71, s0);
+	float cc23 = CC(2.71, s0);
+	float ss45 = SS(2.12, s1);
+	float cc45 = CC(2.12, s1);
+	float ss67 = SS(.972, s2);
+	float cc67 = CC(.972, s2);
+	float ss89 = SS(.868, s3);
+	float cc89 = CC(.868, s3);
+
+	float X = 0.0;
+	X = X + hh2 * cc23;
+	X = X + hh3 * ss23;
+
+	X = X + hh5 * cc45;
+	X = X + hh4 * ss45;
+
+	X = X + hh7 * cc67;
+	X = X + hh8 * ss67;
+
+	X = X + hh10 * cc89;
+	X = X + hh9 * ss89;
+
+	float Y = 0.0;
+	Y = Y + hh2 * -ss23;
+	Y = Y + hh3 * cc23;
+
+	Y = Y + hh5 * -ss45;
+	Y = Y + hh4 * cc45;
+
+	Y = Y + hh7 * -ss67;
+	Y = Y + hh8 * cc67;
+
+	Y = Y + hh10 * -ss89;
+	Y = Y + hh9 * cc89;
+
+
+	float Z = 0.0;
+	Z = Z + hh1 * -2.8;
+	Z = Z + hh6 * -0.5;
+	Z = Z + hh11 * 0.3;
+	Z = Z + hh12 * -2.5;
+
+	// scale and normalize to fit in the rgb space
+	float w_x = 4.1925;
+	float trl_x = -2.0425;
+
+	float w_y = 4.0217;
+	float trl_y = -1.8541;
+
+	float w_z = 4.0694;
+	float trl_z = -2.1899;
+
+
+	rgb[0] = 0.9 * std::abs(((X - trl_x) / w_x)) + 0.05;
+	rgb[1] = 0.9 * std::abs(((Y - trl_y) / w_y)) + 0.05;
+	rgb[2] = 0.9 * std::abs(((Z - trl_z) / w_z)) + 0.05;
+}//Alaleh's
+
+
+namespace util {
+
+	namespace {
+
+		// Lane types the batch kernel is instantiated with. Every type offers the same arithmetic, so the
+		// vector paths and the scalar remainder evaluate exactly the same expression.
+		struct scalar_lanes {
+			static const int width = 1;
+			float v;
+
+			scalar_lanes() {}
+			scalar_lanes(float s) : v(s) {}
+
+			static scalar_lanes load(const float* p) { return scalar_lanes(*p); }
+			void store(float* p) const { *p = v; }
+
+			friend scalar_lanes operator+(scalar_lanes a, scalar_lanes b) { return a.v + b.v; }
+			friend scalar_lanes operator-(scalar_lanes a, scalar_lanes b) { return a.v - b.v; }
+			friend scalar_lanes operator*(scalar_lanes a, scalar_lanes b) { return a.v * b.v; }
+			friend scalar_lanes operator/(scalar_lanes a, scalar_lanes b) { return a.v / b.v; }
+			friend scalar_lanes sqrt(scalar_lanes a) { return std::sqrt(a.v); }
+			friend scalar_lanes abs(scalar_lanes a) { return std::fabs(a.v); }
+		};
+
+#if defined(BOYS_SURFACE_AVX2)
+		struct simd_lanes {
+			static const int width = 8;
+			__m256 v;
+
+			simd_lanes() {}
+			simd_lanes(__m256 s) : v(s) {}
+			simd_lanes(float s) : v(_mm256_set1_ps(s)) {}
+
+			static simd_lanes load(const float* p) { return _mm256_loadu_ps(p); }
+			void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+			friend simd_lanes operator+(simd_lanes a, simd_lanes b) { return _mm256_add_ps(a.v, b.v); }
+			friend simd_lanes operator-(simd_lanes a, simd_lanes b) { return _mm256_sub_ps(a.v, b.v); }
+			friend simd_lanes operator*(simd_lanes a, simd_lanes b) { return _mm256_mul_ps(a.v, b.v); }
+			friend simd_lanes operator/(simd_lanes a, simd_lanes b) { return _mm256_div_ps(a.v, b.v); }
+			friend simd_lanes sqrt(simd_lanes a) { return _mm256_sqrt_ps(a.v); }
+			friend simd_lanes abs(simd_lanes a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+		};
+#elif defined(BOYS_SURFACE_SSE)
+		struct simd_lanes {
+			static const int width = 4;
+			__m128 v;
+
+			simd_lanes() {}
+			simd_lanes(__m128 s) : v(s) {}
+			simd_lanes(float s) : v(_mm_set1_ps(s)) {}
+
+			static simd_lanes load(const float* p) { return _mm_loadu_ps(p); }
+			void store(float* p) const { _mm_storeu_ps(p, v); }
+
+			friend simd_lanes operator+(simd_lanes a, simd_lanes b) { return _mm_add_ps(a.v, b.v); }
+			friend simd_lanes operator-(simd_lanes a, simd_lanes b) { return _mm_sub_ps(a.v, b.v); }
+			friend simd_lanes operator*(simd_lanes a, simd_lanes b) { return _mm_mul_ps(a.v, b.v); }
+			friend simd_lanes operator/(simd_lanes a, simd_lanes b) { return _mm_div_ps(a.v, b.v); }
+			friend simd_lanes sqrt(simd_lanes a) { return _mm_sqrt_ps(a.v); }
+			friend simd_lanes abs(simd_lanes a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+		};
+#else
+		typedef scalar_lanes simd_lanes;
+#endif
+
+		/*
+			Coefficients of rp2ColorMapping with the constant rotations and the normalizations of the spherical
+			harmonics folded in. They are computed once with the same double precision expressions.
+		*/
+		struct rp2_coefficients {
+			float ss23, cc23, ss45, cc45, ss67, cc67, ss89, cc89;
+
+			rp2_coefficients() {
+
+				auto SS = [](float NA, float ND) -> float { return NA * sin(ND * 3.141592 / 180); };
+				auto CC = [](float NA, float ND) -> float { return NA * cos(ND * 3.141592 / 180); };
+
+				ss23 = SS(2.71f, -23.0f);
+				cc23 = CC(2.71f, -23.0f);
+				ss45 = SS(2.12f, 227.9f);
+				cc45 = CC(2.12f, 227.9f);
+				ss67 = SS(.972f, 251.0f);
+				cc67 = CC(.972f, 251.0f);
+				ss89 = SS(.868f, 125.0f);
+				cc89 = CC(.868f, 125.0f);
+			}
+		};
+
+		const rp2_coefficients& get_rp2_coefficients() {
+
+			static const rp2_coefficients coefficients;
+			return coefficients;
+		}
+
+		/*
+			Evaluates the Boy's surface color for V::width directions starting at i.
+		*/
+		template<typename V>
+		void rp2_kernel(const rp2_coefficients& k, const float* dx, const float* dy, const float* dz, size_t i, float* r, float* g, float* b) {
+
+			V x = V::load(dx + i);
+			V y = V::load(dy + i);
+			V z = V::load(dz + i);
+
+			V l = sqrt(x * x + y * y + z * z);
+			x = x / l;
+			y = y / l;
+			z = z / l;
+
+			V xx2 = x * x;
+			V yy2 = y * y;
+			V zz2 = z * z;
+			V xy = x * y;
+			V xz = x * z;
+			V yz = y * z;
+			V t = V(7.0f) * zz2 * z - V(3.0f) * z;
+			V u = V(7.0f) * zz2 - V(1.0f);
+			V q = V(1.0f) - zz2;
+
+			V hh1 = (V(1.5f) * zz2 - V(0.5f)) * V(float(1.0 / 1.58));
+			V hh2 = xz * V(float(3.0 / 2.745));
+			V hh3 = yz * V(float(3.0 / 2.745));
+			V hh4 = (xx2 - yy2) * V(float(1.5 / 2.745));
+			V hh5 = xy * V(float(6.0 / 5.5));
+			V hh6 = ((V(35.0f) * zz2 - V(30.0f)) * zz2 + V(3.0f)) * V(float(0.125 / 1.176));
+			V hh7 = x * t * V(float(2.5 / 3.737));
+			V hh8 = y * t * V(float(2.5 / 3.737));
+			V hh9 = (xx2 - yy2) * u * V(float(7.5 / 15.85));
+			V hh10 = V(2.0f) * xy * u * V(float(7.5 / 15.85));
+			V hh11 = (V(4.0f) * xx2 * xz - V(3.0f) * xz * q) * V(float(105.0 / 59.32));
+			V hh12 = (V(3.0f) * yz * q - V(4.0f) * yy2 * yz) * V(float(105.0 / 59.32));
+
+			V X = hh2 * V(k.cc23) + hh3 * V(k.ss23) + hh5 * V(k.cc45) + hh4 * V(k.ss45) + hh7 * V(k.cc67) + hh8 * V(k.ss67) + hh10 * V(k.cc89) + hh9 * V(k.ss89);
+			V Y = hh3 * V(k.cc23) - hh2 * V(k.ss23) + hh4 * V(k.cc45) - hh5 * V(k.ss45) + hh8 * V(k.cc67) - hh7 * V(k.ss67) + hh9 * V(k.cc89) - hh10 * V(k.ss89);
+			V Z = hh11 * V(0.3f) - hh1 * V(2.8f) - hh6 * V(0.5f) - hh12 * V(2.5f);
+
+			// Scale and shift into the rgb cube like the reference
+			(abs(X + V(2.0425f)) * V(float(0.9 / 4.1925)) + V(0.05f)).store(r);
+			(abs(Y + V(1.8541f)) * V(float(0.9 / 4.0217)) + V(0.05f)).store(g);
+			(abs(Z + V(2.1899f)) * V(float(0.9 / 4.0694)) + V(0.05f)).store(b);
+		}
+	}
+
+	void boys_surface_colors(span<const float> dx, span<const float> dy, span<const float> dz, span<cgv::render::render_types::rgba> colors) {
+
+		typedef cgv::render::render_types::rgba rgba;
+
+		const rp2_coefficients& k = get_rp2_coefficients();
+		const size_t n = std::min(std::min(dx.size(), dy.size()), std::min(dz.size(), colors.size()));
+		const size_t w = simd_lanes::width;
+
+		float r[simd_lanes::width], g[simd_lanes::width], b[simd_lanes::width];
+
+		size_t i = 0;
+		for(; i + w <= n; i += w) {
+			rp2_kernel<simd_lanes>(k, dx.data(), dy.data(), dz.data(), i, r, g, b);
+			for(size_t j = 0; j < w; ++j)
+				colors[i + j] = rgba(r[j], g[j], b[j], 1.0f);
+		}
+
+		for(; i < n; ++i) {
+			rp2_kernel<scalar_lanes>(k, dx.data(), dy.data(), dz.data(), i, r, g, b);
+			colors[i] = rgba(r[0], g[0], b[0], 1.0f);
+		}
+	}
+
+#ifdef FIBER_BENCHMARKS
+	bool benchmark_boys_surface(size_t count, unsigned repetitions, float tolerance) {
+
+		typedef cgv::render::render_types::rgba rgba;
+
+		std::vector<float> dx(count), dy(count), dz(count);
+		std::vector<rgba> colors(count);
+		std::vector<float> reference(3 * count);
+
+		std::mt19937 rng(42u);
+		std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+		for(size_t i = 0; i < count; ++i) {
+			do {
+				dx[i] = distribution(rng);
+				dy[i] = distribution(rng);
+				dz[i] = distribution(rng);
+			} while(dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i] < 1e-6f);
+		}
+
+#if defined(BOYS_SURFACE_AVX2)
+		const char* path = "AVX2";
+#elif defined(BOYS_SURFACE_SSE)
+		const char* path = "SSE";
+#else
+		const char* path = "scalar";
+#endif
+
+		std::cout << "=====\nBenchmarking Boy's surface colors on " << count << " directions" << std::endl;
+
+		double best_reference = 0.0;
+		double best_batch = 0.0;
+		for(unsigned i = 0; i < repetitions; ++i) {
+			auto start = std::chrono::steady_clock::now();
+			for(size_t j = 0; j < count; ++j) {
+				float start_point[3] = { 0.0f, 0.0f, 0.0f };
+				float end_point[3] = { dx[j], dy[j], dz[j] };
+				rp2ColorMapping(start_point, end_point, &reference[3 * j]);
+			}
+			double single = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			start = std::chrono::steady_clock::now();
+			boys_surface_colors(span<const float>(dx), span<const float>(dy), span<const float>(dz), span<rgba>(colors));
+			double batch = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			double reference_rate = static_cast<double>(count) / single * 1e-6;
+			double batch_rate = static_cast<double>(count) / batch * 1e-6;
+
+			std::cout << "run " << i << ": reference " << reference_rate << " Mdirections/s, batch (" << path << ") " << batch_rate << " Mdirections/s" << std::endl;
+
+			best_reference = std::max(best_reference, reference_rate);
+			best_batch = std::max(best_batch, batch_rate);
+		}
+
+		// A NaN would not raise the maximum, so it is counted separately
+		float max_error = 0.0f;
+		size_t invalid_count = 0;
+		for(size_t j = 0; j < count; ++j) {
+			for(int c = 0; c < 3; ++c) {
+				const float error = std::fabs(colors[j][c] - reference[3 * j + c]);
+				if(std::isfinite(error))
+					max_error = std::max(max_error, error);
+				else
+					++invalid_count;
+			}
+		}
+
+		std::cout << "best: reference " << best_reference << " Mdirections/s, batch " << best_batch << " Mdirections/s" << std::endl;
+		std::cout << "largest deviation from reference: " << max_error << " (tolerance " << tolerance << ")" << std::endl;
+
+		const bool passed = invalid_count == 0 && max_error <= tolerance;
+		if(invalid_count > 0)
+			std::cout << "Error: " << invalid_count << " color components are not finite" << std::endl;
+		else if(!passed)
+			std::cout << "Error: the batch colors deviate from the reference by more than the tolerance" << std::endl;
+
+		std::cout << "=====" << std::endl;
+		return passed;
+	}
+#endif
+}
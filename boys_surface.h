@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cgv/render/render_types.h>
+
+#include "span.h"
+
+//Alaleh
+/// reference implementation of the Boy's surface (RP2) orientation color of the segment from startP to endP
+void rp2ColorMapping(float[3], float[3], float[3]);
+
+namespace util {
+
+	/// writes the Boy's surface color of every direction given by its components dx, dy and dz to colors,
+	/// the directions need not be normalized and colors must hold at least as many elements as dx
+	void boys_surface_colors(span<const float> dx, span<const float> dy, span<const float> dz, span<cgv::render::render_types::rgba> colors);
+
+#ifdef FIBER_BENCHMARKS
+	/// map count random directions with rp2ColorMapping and boys_surface_colors repeatedly, print the directions
+	/// mapped per second and the largest deviation of the batch colors from the reference, returns false if the
+	/// deviation exceeds the tolerance or a color is not finite
+	bool benchmark_boys_surface(size_t count = 1u << 22, unsigned repetitions = 5u, float tolerance = 1e-5f);
+#endif
+}
@@ -0,0 +1,280 @@
+#include "colormap.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define COLORMAP_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define COLORMAP_SSE
+#endif
+
+namespace util {
+
+	colormap::colormap(const std::vector<rgba>& control_points, unsigned resolution) : resolution(0u) {
+
+		bake(control_points, resolution);
+	}
+
+	void colormap::bake(const std::vector<rgba>& points, unsigned res) {
+
+		control_points = points;
+		resolution = points.empty() ? 0u : std::max(res, 2u);
+		table.assign(4 * (size_t)resolution, 0.0f);
+
+		for(unsigned i = 0; i < resolution; ++i) {
+			rgba color = interpolate(static_cast<float>(i) / static_cast<float>(resolution - 1u));
+			for(unsigned c = 0; c < 4; ++c)
+				table[4 * i + c] = color[c];
+		}
+	}
+
+	colormap::rgba colormap::interpolate(float value) const {
+
+		size_t count = control_points.size();
+
+		if(count == 0)
+			return rgba(0.0f);
+		else if(count == 1)
+			return control_points[0];
+
+		value = value > 0.0f ? value : 0.0f;
+		value = value < 1.0f ? value : 1.0f;
+
+		float fidx = value * (float)(count - 1);
+		size_t idx = std::min((size_t)fidx, count - 1);
+		float a = std::min(std::max(fidx - (float)idx, 0.0f), 1.0f);
+
+		if(idx == count - 1)
+			return control_points[idx];
+
+		return (1.0f - a) * control_points[idx] + a * control_points[idx + 1];
+	}
+
+	colormap::rgba colormap::map(float value) const {
+
+		if(resolution == 0u)
+			return rgba(0.0f);
+
+		// The comparisons are written so NaN ends up at 0 like in the batch version
+		value = value > 0.0f ? value : 0.0f;
+		value = value < 1.0f ? value : 1.0f;
+
+		const float* entry = table.data() + 4 * static_cast<size_t>(value * (float)(resolution - 1u) + 0.5f);
+		return rgba(entry[0], entry[1], entry[2], entry[3]);
+	}
+
+	/*
+		The table indices are computed for a whole register of values at once, then every entry is copied with a
+		single 16 byte load and store. rgba consists of four floats, so the colors are written in place.
+	*/
+	void colormap::map(span<const float> values, span<rgba> colors) const {
+
+		static_assert(sizeof(rgba) == 4 * sizeof(float), "rgba must consist of four floats");
+
+		const size_t n = std::min(values.size(), colors.size());
+
+		if(resolution == 0u) {
+			for(size_t i = 0; i < n; ++i)
+				colors[i] = rgba(0.0f);
+			return;
+		}
+
+		const float* v = values.data();
+		float* out = reinterpret_cast<float*>(colors.data());
+		const float* t = table.data();
+		const float scale = (float)(resolution - 1u);
+
+		size_t i = 0;
+
+#if defined(COLORMAP_AVX2)
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 s = _mm256_set1_ps(scale);
+		const __m256 half = _mm256_set1_ps(0.5f);
+		alignas(32) int idx[8];
+
+		for(; i + 8 <= n; i += 8) {
+			__m256 x = _mm256_loadu_ps(v + i);
+			// max returns the second operand for NaN, which maps NaN to 0
+			x = _mm256_min_ps(_mm256_max_ps(x, zero), one);
+			_mm256_store_si256((__m256i*)idx, _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, s), half)));
+
+			for(int k = 0; k < 8; ++k)
+				_mm_storeu_ps(out + 4 * (i + k), _mm_load_ps(t + 4 * idx[k]));
+		}
+#elif defined(COLORMAP_SSE)
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 s = _mm_set1_ps(scale);
+		const __m128 half = _mm_set1_ps(0.5f);
+		alignas(16) int idx[4];
+
+		for(; i + 4 <= n; i += 4) {
+			__m128 x = _mm_loadu_ps(v + i);
+			// max returns the second operand for NaN, which maps NaN to 0
+			x = _mm_min_ps(_mm_max_ps(x, zero), one);
+			_mm_store_si128((__m128i*)idx, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, s), half)));
+
+			for(int k = 0; k < 4; ++k)
+				_mm_storeu_ps(out + 4 * (i + k), _mm_load_ps(t + 4 * idx[k]));
+		}
+#endif
+
+		// Scalar fallback and remainder
+		for(; i < n; ++i) {
+			float x = v[i] > 0.0f ? v[i] : 0.0f;
+			x = x < 1.0f ? x : 1.0f;
+			std::memcpy(out + 4 * i, t + 4 * static_cast<size_t>(x * scale + 0.5f), 4 * sizeof(float));
+		}
+	}
+
+	/*
+		Registers the color maps used by the scalar and attribute color sources.
+	*/
+	colormap_registry::colormap_registry() {
+
+		typedef cgv::render::render_types::rgba rgba;
+
+		add("coolwarm", {
+			rgba(0.3f, 0.3f, 0.8f, 1.0f),
+			rgba(0.5f, 0.5f, 0.9f, 1.0f),
+			rgba(0.6f, 0.7f, 1.0f, 1.0f),
+			rgba(0.8f, 0.8f, 0.9f, 1.0f),
+			rgba(0.9f, 0.8f, 0.8f, 1.0f),
+			rgba(0.9f, 0.7f, 0.5f, 1.0f),
+			rgba(0.9f, 0.4f, 0.3f, 1.0f),
+			rgba(0.7f, 0.0f, 0.2f, 1.0f)
+		});
+
+		add("extended_kindlmann", {
+			rgba(0.0f, 0.0f, 0.0f, 1.0f),
+			rgba(0.2f, 0.0f, 0.5f, 1.0f),
+			rgba(0.0f, 0.3f, 0.2f, 1.0f),
+			rgba(0.2f, 0.5f, 0.0f, 1.0f),
+			rgba(0.9f, 0.4f, 0.0f, 1.0f),
+			rgba(1.0f, 0.5f, 0.8f, 1.0f),
+			rgba(0.9f, 0.8f, 1.0f, 1.0f),
+			rgba(1.0f, 1.0f, 1.0f, 1.0f)
+		});
+
+		add("extended_blackbody", {
+			rgba(0.0f, 0.0f, 0.0f, 1.0f),
+			rgba(0.2f, 0.0f, 0.3f, 1.0f),
+			rgba(0.4f, 0.1f, 0.4f, 1.0f),
+			rgba(0.6f, 0.2f, 0.4f, 1.0f),
+			rgba(0.8f, 0.3f, 0.3f, 1.0f),
+			rgba(0.9f, 0.5f, 0.1f, 1.0f),
+			rgba(0.9f, 0.8f, 0.1f, 1.0f),
+			rgba(1.0f, 1.0f, 0.6f, 1.0f)
+		});
+
+		add("blackbody", {
+			rgba(0.0f, 0.0f, 0.0f, 1.0f),
+			rgba(0.2f, 0.1f, 0.0f, 1.0f),
+			rgba(0.5f, 0.1f, 0.1f, 1.0f),
+			rgba(0.7f, 0.2f, 0.1f, 1.0f),
+			rgba(0.9f, 0.4f, 0.0f, 1.0f),
+			rgba(0.9f, 0.6f, 0.0f, 1.0f),
+			rgba(0.9f, 0.8f, 0.2f, 1.0f),
+			rgba(1.0f, 1.0f, 1.0f, 1.0f)
+		});
+
+		add("isorainbow", {
+			rgba(1.0f, 0.0f, 0.0f, 1.0f),
+			rgba(1.0f, 0.5f, 0.0f, 1.0f),
+			rgba(1.0f, 1.0f, 1.0f, 1.0f),
+			rgba(0.0f, 1.0f, 0.0f, 1.0f),
+			rgba(0.0f, 0.0f, 1.0f, 1.0f),
+			rgba(0.2f, 0.2f, 0.4f, 1.0f),
+			rgba(0.5f, 0.0f, 1.0f, 1.0f)
+		});
+
+		// Attribute color map, the opacity grows with the attribute value
+		add("attribute", {
+			rgba(0.0f, 1.0f, 0.0f, 0.0f),
+			rgba(0.0f, 0.0f, 1.0f, 0.5f),
+			rgba(1.0f, 0.0f, 0.0f, 1.0f)
+		});
+	}
+
+	colormap_registry& colormap_registry::instance() {
+
+		static colormap_registry registry;
+		return registry;
+	}
+
+	const colormap& colormap_registry::add(const std::string& name, const std::vector<cgv::render::render_types::rgba>& control_points) {
+
+		colormap& cm = colormaps[name];
+		cm.bake(control_points);
+		return cm;
+	}
+
+	const colormap* colormap_registry::get(const std::string& name) const {
+
+		auto it = colormaps.find(name);
+		return it != colormaps.end() ? &it->second : nullptr;
+	}
+
+	std::vector<std::string> colormap_registry::get_names() const {
+
+		std::vector<std::string> names;
+		for(const auto& entry : colormaps)
+			names.push_back(entry.first);
+		return names;
+	}
+
+#ifdef FIBER_BENCHMARKS
+	void benchmark_colormap(const colormap& cm, size_t count, unsigned repetitions) {
+
+		typedef cgv::render::render_types::rgba rgba;
+
+		std::vector<float> values(count);
+		std::vector<rgba> colors(count);
+
+		std::mt19937 rng(42u);
+		std::uniform_real_distribution<float> distribution(-0.1f, 1.1f);
+		for(float& v : values)
+			v = distribution(rng);
+
+#if defined(COLORMAP_AVX2)
+		const char* path = "AVX2";
+#elif defined(COLORMAP_SSE)
+		const char* path = "SSE";
+#else
+		const char* path = "scalar";
+#endif
+
+		std::cout << "=====\nBenchmarking color map with " << cm.get_resolution() << " entries on " << count << " values" << std::endl;
+
+		double best_single = 0.0;
+		double best_batch = 0.0;
+		for(unsigned i = 0; i < repetitions; ++i) {
+			auto start = std::chrono::steady_clock::now();
+			for(size_t j = 0; j < count; ++j)
+				colors[j] = cm.map(values[j]);
+			double single = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			start = std::chrono::steady_clock::now();
+			cm.map(span<const float>(values), span<rgba>(colors));
+			double batch = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			double single_rate = static_cast<double>(count) / single * 1e-6;
+			double batch_rate = static_cast<double>(count) / batch * 1e-6;
+
+			std::cout << "run " << i << ": per value " << single_rate << " Mpoints/s, batch (" << path << ") " << batch_rate << " Mpoints/s" << std::endl;
+
+			best_single = std::max(best_single, single_rate);
+			best_batch = std::max(best_batch, batch_rate);
+		}
+
+		std::cout << "best: per value " << best_single << " Mpoints/s, batch " << best_batch << " Mpoints/s\n=====" << std::endl;
+	}
+#endif
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cgv/render/render_types.h>
+
+#include "span.h"
+#include "tractogram.h"
+
+namespace util {
+
+	/*
+		Color map given by equidistant control points over [0,1] and baked into a table of fixed resolution.
+		Mapping a value clamps it, rounds it to the nearest table entry and copies the color, so no per-value
+		interpolation is needed. The batch version processes whole arrays with SSE or AVX2 when available.
+	*/
+	class colormap : public cgv::render::render_types {
+	public:
+		static const unsigned default_resolution = 1024u;
+
+		colormap() : resolution(0u) {}
+		colormap(const std::vector<rgba>& control_points, unsigned resolution = default_resolution);
+
+		/// bake the given control points into a table with the given number of entries
+		void bake(const std::vector<rgba>& control_points, unsigned resolution = default_resolution);
+
+		bool empty() const { return resolution == 0u; }
+		unsigned get_resolution() const { return resolution; }
+		const std::vector<rgba>& get_control_points() const { return control_points; }
+
+		/// returns the color linearly interpolated between the control points, used for baking
+		rgba interpolate(float value) const;
+		/// returns the color of the table entry nearest to the clamped value, NaN maps to 0
+		rgba map(float value) const;
+		/// maps every value to a color, colors must hold at least as many elements as values
+		void map(span<const float> values, span<rgba> colors) const;
+
+	private:
+		std::vector<rgba> control_points;
+		unsigned resolution;
+		/// resolution entries of four floats, aligned so every entry is a single aligned 16 byte load
+		aligned_floats table;
+	};
+
+	/*
+		Registry of named color maps. The built-in maps are registered on first use, further maps can be added
+		at startup. Returned pointers stay valid for the lifetime of the program.
+	*/
+	class colormap_registry {
+	public:
+		static colormap_registry& instance();
+
+		/// bake and register the control points under the given name, replacing a map of the same name
+		const colormap& add(const std::string& name, const std::vector<cgv::render::render_types::rgba>& control_points);
+		/// returns the color map of the given name or nullptr if there is none
+		const colormap* get(const std::string& name) const;
+		std::vector<std::string> get_names() const;
+
+	private:
+		colormap_registry();
+
+		std::map<std::string, colormap> colormaps;
+	};
+
+#ifdef FIBER_BENCHMARKS
+	/// map count random values with the per-value and the batch path repeatedly and print the points mapped per second
+	void benchmark_colormap(const colormap& cm, size_t count = 1u << 24, unsigned repetitions = 5u);
+#endif
+}
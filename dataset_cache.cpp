@@ -0,0 +1,207 @@
+#include "dataset_cache.h"
+
+#include <cstdio>
+#include <fstream>
+
+
+static const char cache_magic[8] = { 'F', 'V', 'C', 'A', 'C', 'H', 'E', '\0' };
+
+// Section data is aligned to cache lines, so arrays used in place from the mapping are aligned like owned ones
+static const uint64_t section_alignment = 64u;
+
+uint64_t dataset_cache::hash_combine(uint64_t a, uint64_t b) {
+
+	a ^= b + 0x9e3779b97f4a7c15ull + (a << 6) + (a >> 2);
+	a ^= a >> 33;
+	a *= 0xff51afd7ed558ccdull;
+	a ^= a >> 33;
+	return a;
+}
+
+uint64_t dataset_cache::hash_bytes(const void* data, size_t size, uint64_t seed) {
+
+	const uint64_t prime = 0x100000001b3ull;
+	const char* bytes = static_cast<const char*>(data);
+
+	// Four independent lanes of 64 bit words keep the multipliers busy
+	uint64_t h[4] = {
+		seed ^ 0xcbf29ce484222325ull,
+		seed ^ 0x84222325cbf29ce4ull,
+		seed ^ 0x9e3779b97f4a7c15ull,
+		seed ^ 0xc2b2ae3d27d4eb4full
+	};
+
+	size_t i = 0;
+	for(; i + 32 <= size; i += 32) {
+		uint64_t w[4];
+		std::memcpy(w, bytes + i, 32);
+		for(int k = 0; k < 4; ++k) {
+			h[k] = (h[k] ^ w[k]) * prime;
+			h[k] ^= h[k] >> 29;
+		}
+	}
+
+	uint64_t tail = 0u;
+	std::memcpy(&tail, bytes + i, size - i < 8 ? size - i : 8);
+	h[0] = (h[0] ^ tail) * prime;
+	for(i += 8; i < size; i += 8) {
+		tail = 0u;
+		std::memcpy(&tail, bytes + i, size - i < 8 ? size - i : 8);
+		h[1] = (h[1] ^ tail) * prime;
+	}
+
+	uint64_t result = hash_combine(h[0], h[1]);
+	result = hash_combine(result, h[2]);
+	result = hash_combine(result, h[3]);
+	return hash_combine(result, static_cast<uint64_t>(size));
+}
+
+/*
+	Hashing a multi-GB source file completely would take longer than reading the cache it identifies, so
+	only its size, its modification time and blocks sampled evenly over the file including the first and
+	the last one are hashed. The first block holds the header of every supported format. Small files
+	are hashed completely.
+*/
+uint64_t dataset_cache::hash_file(const std::string& file_name) {
+
+	mapped_file f;
+	if(!f.open(file_name))
+		return 0u;
+
+	const size_t block_size = 64u * 1024u;
+	const size_t sample_count = 64u;
+
+	uint64_t result = hash_combine(static_cast<uint64_t>(f.size()), f.modification_time());
+
+	if(f.size() <= block_size * sample_count) {
+		result = hash_combine(result, hash_bytes(f.data(), f.size()));
+	} else {
+		for(size_t i = 0; i < sample_count; ++i) {
+			size_t offset = (f.size() - block_size) / (sample_count - 1) * i;
+			if(i == sample_count - 1)
+				offset = f.size() - block_size;
+			result = hash_combine(result, hash_bytes(f.data() + offset, block_size, static_cast<uint64_t>(i)));
+		}
+	}
+
+	// Never return the value reserved for failure
+	return result != 0u ? result : 1u;
+}
+
+bool dataset_cache::open(const std::string& file_name, uint64_t key) {
+
+	close();
+
+	if(!file.open(file_name))
+		return false;
+
+	header hdr;
+	if(file.size() < sizeof(header)) {
+		close();
+		return false;
+	}
+
+	std::memcpy(&hdr, file.data(), sizeof(header));
+
+	if(std::memcmp(hdr.magic, cache_magic, sizeof(cache_magic)) != 0 || hdr.version != version || hdr.key != key) {
+		close();
+		return false;
+	}
+
+	size_t table_end = sizeof(header) + (size_t)hdr.section_count * sizeof(section);
+	if(table_end > file.size()) {
+		close();
+		return false;
+	}
+
+	for(uint32_t i = 0; i < hdr.section_count; ++i) {
+		section s;
+		std::memcpy(&s, file.data() + sizeof(header) + i * sizeof(section), sizeof(section));
+		s.name[sizeof(s.name) - 1] = '\0';
+
+		if(s.offset + s.size > file.size()) {
+			close();
+			return false;
+		}
+
+		sections[std::string(s.name)] = s;
+	}
+
+	return true;
+}
+
+void dataset_cache::close() {
+
+	sections.clear();
+	file.close();
+}
+
+bool dataset_cache::find(const std::string& name, const char*& data, size_t& size) const {
+
+	auto it = sections.find(name);
+	if(it == sections.end())
+		return false;
+
+	data = file.data() + it->second.offset;
+	size = static_cast<size_t>(it->second.size);
+	return true;
+}
+
+bool dataset_cache::write(const std::string& file_name, uint64_t key) {
+
+	std::string tmp_file_name = file_name + ".tmp";
+	std::ofstream out(tmp_file_name, std::ios::binary | std::ios::trunc);
+
+	if(!out.is_open()) {
+		pending.clear();
+		return false;
+	}
+
+	header hdr;
+	std::memcpy(hdr.magic, cache_magic, sizeof(cache_magic));
+	hdr.version = version;
+	hdr.section_count = static_cast<uint32_t>(pending.size());
+	hdr.key = key;
+
+	std::vector<section> table(pending.size());
+	uint64_t offset = sizeof(header) + pending.size() * sizeof(section);
+
+	for(size_t i = 0; i < pending.size(); ++i) {
+		offset = (offset + section_alignment - 1) / section_alignment * section_alignment;
+
+		std::memset(table[i].name, 0, sizeof(table[i].name));
+		std::strncpy(table[i].name, pending[i].name.c_str(), sizeof(table[i].name) - 1);
+		table[i].offset = offset;
+		table[i].size = pending[i].size;
+
+		offset += pending[i].size;
+	}
+
+	out.write(reinterpret_cast<const char*>(&hdr), sizeof(header));
+	out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(section));
+
+	uint64_t position = sizeof(header) + table.size() * sizeof(section);
+	const char padding[section_alignment] = { 0 };
+
+	for(size_t i = 0; i < pending.size(); ++i) {
+		out.write(padding, table[i].offset - position);
+		out.write(static_cast<const char*>(pending[i].data), pending[i].size);
+		position = table[i].offset + table[i].size;
+	}
+
+	pending.clear();
+
+	bool success = out.good();
+	out.close();
+
+	// Replace an existing cache file only once the new one was written completely
+	if(success) {
+		std::remove(file_name.c_str());
+		success = std::rename(tmp_file_name.c_str(), file_name.c_str()) == 0;
+	}
+
+	if(!success)
+		std::remove(tmp_file_name.c_str());
+
+	return success;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "span.h"
+
+/*
+	Binary cache for preprocessed datasets. A cache file consists of a small header holding a magic
+	string, the format version and a 64 bit key, followed by a table of named sections and the
+	section data. The key identifies the source file content and all parameters the cached data
+	depends on, so a cache file is only used if it was produced from exactly the same input.
+	Cache files are read through a memory mapping. Large sections are used in place from the
+	mapping as long as the cache stays open, small ones are copied into their destination.
+*/
+class dataset_cache {
+public:
+	/// increment whenever the layout or meaning of any section changes
+	static const uint32_t version = 9u;
+
+private:
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t section_count;
+		uint64_t key;
+	};
+
+	struct section {
+		char name[24];
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct pending_section {
+		std::string name;
+		const void* data;
+		size_t size;
+	};
+
+	mapped_file file;
+	std::map<std::string, section> sections;
+	std::vector<pending_section> pending;
+
+	bool find(const std::string& name, const char*& data, size_t& size) const;
+
+public:
+	/// returns a hash identifying the file by its size, modification time and sampled blocks of its content
+	/// or 0 if the file could not be read
+	static uint64_t hash_file(const std::string& file_name);
+	/// returns a hash of the given bytes
+	static uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0u);
+	/// combines two hash values into one
+	static uint64_t hash_combine(uint64_t a, uint64_t b);
+
+	/// map a cache file and return whether it exists and matches the given key and the current version
+	bool open(const std::string& file_name, uint64_t key);
+	/// release the mapping of the cache file
+	void close();
+
+	/// copy the named section into the given array and return whether the section exists
+	template<typename T, typename A>
+	bool get(const std::string& name, std::vector<T, A>& values) const {
+
+		const char* data;
+		size_t size;
+		if(!find(name, data, size) || size % sizeof(T) != 0)
+			return false;
+
+		values.resize(size / sizeof(T));
+		if(size > 0)
+			std::memcpy(values.data(), data, size);
+		return true;
+	}
+
+	/// return the named section in place from the mapping, which stays valid until the cache is closed
+	template<typename T>
+	bool get_span(const std::string& name, util::span<const T>& values) const {
+
+		const char* data;
+		size_t size;
+		if(!find(name, data, size) || size % sizeof(T) != 0)
+			return false;
+
+		values = util::span<const T>(reinterpret_cast<const T*>(data), size / sizeof(T));
+		return true;
+	}
+
+	/// copy the named single value section into the given value and return whether the section exists
+	template<typename T>
+	bool get_value(const std::string& name, T& value) const {
+
+		const char* data;
+		size_t size;
+		if(!find(name, data, size) || size != sizeof(T))
+			return false;
+
+		std::memcpy(&value, data, sizeof(T));
+		return true;
+	}
+
+	/// add an array as a named section to be written, the array must stay alive until write is called
+	template<typename T, typename A>
+	void add(const std::string& name, const std::vector<T, A>& values) {
+
+		pending.push_back({ name, values.data(), values.size() * sizeof(T) });
+	}
+
+	/// add the viewed values as a named section to be written, they must stay alive until write is called
+	template<typename T>
+	void add(const std::string& name, util::span<const T> values) {
+
+		pending.push_back({ name, values.data(), values.size() * sizeof(T) });
+	}
+
+	/// add a single value as a named section to be written, the value must stay alive until write is called
+	template<typename T>
+	void add_value(const std::string& name, const T& value) {
+
+		pending.push_back({ name, &value, sizeof(T) });
+	}
+
+	/// write all added sections to a cache file with the given key and return whether this was successful
+	bool write(const std::string& file_name, uint64_t key);
+};
@@ -0,0 +1,458 @@
+#include "density_bricks.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+
+#include "parallel.h"
+
+namespace {
+
+	typedef util::uvec3 uvec3;
+	typedef util::vec3 vec3;
+	typedef util::density_bricks density_bricks;
+
+	const int brick_size = (int)density_bricks::brick_size;
+	const int stored_size = (int)density_bricks::stored_size;
+	const size_t brick_voxels = (size_t)stored_size * stored_size * stored_size;
+
+	static_assert(density_bricks::brick_size == util::density_sums::brick_size, "the first level reads the bricks of the sums it overlaps");
+
+	/*
+		Read access to a level while the bricks are built, which are stored one after another in the order of their
+		slots. Voxels outside of the level and in empty bricks are 0. The vectors are referenced because they grow
+		while the next level is added.
+	*/
+	struct level_reader {
+		density_bricks::level level;
+		const std::vector<uint32_t>& table;
+		const std::vector<float>& bricks;
+
+		/// copy the cube of extent^3 voxels from origin on to region brick by brick, returns false without copying
+		/// anything if all bricks it overlaps are empty
+		bool gather(const int origin[3], int extent, std::vector<float>& region) const {
+
+			// Bricks that own a voxel of the cube, brick c owns the voxels from 8 * c - 1 to 8 * c + 6
+			int first[3], last[3];
+			for(int i = 0; i < 3; ++i) {
+				int begin = std::max(origin[i], 0);
+				int end = std::min(origin[i] + extent, (int)level.resolution[i]);
+				if(begin >= end)
+					return false;
+				first[i] = (begin + 1) / brick_size;
+				last[i] = end / brick_size;
+			}
+
+			for(int cz = first[2]; cz <= last[2]; ++cz) {
+				for(int cy = first[1]; cy <= last[1]; ++cy) {
+					for(int cx = first[0]; cx <= last[0]; ++cx) {
+						uint32_t entry = table[level.table_offset + ((size_t)cz * level.bricks[1] + cy) * level.bricks[0] + cx];
+						if(entry == 0u)
+							continue;
+
+						if(region.empty())
+							region.assign((size_t)extent * extent * extent, 0.0f);
+
+						const int c[3] = { cx, cy, cz };
+						int begin[3], end[3];
+						for(int i = 0; i < 3; ++i) {
+							begin[i] = std::max(c[i] * brick_size - 1, origin[i]);
+							end[i] = std::min(c[i] * brick_size - 1 + brick_size, origin[i] + extent);
+						}
+
+						const float* brick = bricks.data() + (size_t)(entry - 1u) * brick_voxels;
+						for(int z = begin[2]; z < end[2]; ++z) {
+							for(int y = begin[1]; y < end[1]; ++y) {
+								const float* src = brick + ((z + 1 - cz * brick_size) * stored_size + y + 1 - cy * brick_size) * stored_size + begin[0] + 1 - cx * brick_size;
+								float* dst = region.data() + ((size_t)(z - origin[2]) * extent + y - origin[1]) * extent + begin[0] - origin[0];
+								std::copy(src, src + (end[0] - begin[0]), dst);
+							}
+						}
+					}
+				}
+			}
+
+			return !region.empty();
+		}
+	};
+
+	/*
+		Adds a level of the given resolution. fill(bx, by, bz, values) computes the stored voxels of a brick and
+		returns whether one of them is not 0. Every brick is filled twice, first to find the occupied ones, which
+		then get their slots in table order, and again to write them to their slots. This keeps the result the same
+		for any number of threads without holding the empty bricks in memory.
+	*/
+	template<typename F>
+	void add_level(density_bricks& bricks, std::vector<float>& storage, const uvec3& resolution, const F& fill) {
+
+		density_bricks::level level;
+		level.resolution = resolution;
+		for(unsigned i = 0; i < 3; ++i)
+			level.bricks[i] = resolution[i] / brick_size + 1u;
+		level.table_offset = (uint32_t)bricks.table.size();
+
+		const size_t nx = level.bricks[0];
+		const size_t nxy = nx * level.bricks[1];
+		const size_t count = nxy * level.bricks[2];
+
+		std::vector<uint8_t> occupied(count);
+		util::parallel_for(count, [&](size_t begin, size_t end) {
+			std::vector<float> values(brick_voxels);
+			for(size_t i = begin; i < end; ++i)
+				occupied[i] = fill((int)(i % nx), (int)(i % nxy / nx), (int)(i / nxy), values.data()) ? 1u : 0u;
+		});
+
+		bricks.table.resize(level.table_offset + count);
+		uint32_t* entries = bricks.table.data() + level.table_offset;
+
+		size_t slot = bricks.brick_count;
+		for(size_t i = 0; i < count; ++i)
+			entries[i] = occupied[i] ? (uint32_t)(++slot) : 0u;
+
+		bricks.brick_count = slot;
+		storage.resize(slot * brick_voxels);
+
+		util::parallel_for(count, [&](size_t begin, size_t end) {
+			for(size_t i = begin; i < end; ++i) {
+				if(entries[i])
+					fill((int)(i % nx), (int)(i % nxy / nx), (int)(i / nxy), storage.data() + (entries[i] - 1u) * brick_voxels);
+			}
+		});
+
+		bricks.levels.push_back(level);
+	}
+
+	/*
+		Samples a level with trilinear filtering like the texture unit does in the pool texture. Both voxels a
+		position lies between are in its brick.
+	*/
+	float sample_level(const density_bricks& bricks, const util::density_texture_data& pool, const density_bricks::level& level, const vec3& position) {
+
+		float w[3];
+		int b[3];
+		for(int i = 0; i < 3; ++i) {
+			w[i] = position[i] * (float)level.resolution[i] + 0.5f;
+			if(!(w[i] >= 0.0f))
+				return 0.0f;
+			b[i] = (int)w[i] / brick_size;
+			if(b[i] >= (int)level.bricks[i])
+				return 0.0f;
+		}
+
+		uint32_t entry = bricks.table[level.table_offset + ((size_t)b[2] * level.bricks[1] + b[1]) * level.bricks[0] + b[0]];
+		if(entry == 0u)
+			return 0.0f;
+
+		const size_t slot = entry - 1u;
+		const size_t slots[3] = { slot % bricks.pool_slots[0], slot / bricks.pool_slots[0] % bricks.pool_slots[1], slot / ((size_t)bricks.pool_slots[0] * bricks.pool_slots[1]) };
+		const uvec3 pool_resolution = bricks.get_pool_resolution();
+
+		int j[3];
+		float t[3];
+		for(int i = 0; i < 3; ++i) {
+			float local = w[i] - (float)(b[i] * brick_size);
+			j[i] = std::min((int)local, brick_size - 1);
+			t[i] = local - (float)j[i];
+		}
+
+		const size_t sy = pool_resolution[0];
+		const size_t sz = sy * pool_resolution[1];
+		const size_t i = (slots[2] * stored_size + j[2]) * sz + (slots[1] * stored_size + j[1]) * sy + slots[0] * stored_size + j[0];
+		const uint8_t* data = pool.levels[0].data();
+
+		float p[8];
+		for(int d = 0; d < 8; ++d)
+			p[d] = util::get_density(data, i + (d & 1) + ((d >> 1) & 1) * sy + (d >> 2) * sz, pool.format);
+
+		float c00 = p[0] + t[0] * (p[1] - p[0]);
+		float c10 = p[2] + t[0] * (p[3] - p[2]);
+		float c01 = p[4] + t[0] * (p[5] - p[4]);
+		float c11 = p[6] + t[0] * (p[7] - p[6]);
+		float c0 = c00 + t[1] * (c10 - c00);
+		float c1 = c01 + t[1] * (c11 - c01);
+		return c0 + t[2] * (c1 - c0);
+	}
+
+#ifdef FIBER_BENCHMARKS
+	/*
+		Sampler of the float mipmaps of the dense density texture with a zero border, which is what the texture unit
+		does with it.
+	*/
+	struct dense_reference {
+		const util::density_texture_data& data;
+
+		float voxel(unsigned l, int x, int y, int z) const {
+
+			const uvec3& r = data.resolutions[l];
+			if(x < 0 || y < 0 || z < 0 || x >= (int)r[0] || y >= (int)r[1] || z >= (int)r[2])
+				return 0.0f;
+			return util::get_density(data.levels[l].data(), ((size_t)z * r[1] + y) * r[0] + x, data.format);
+		}
+
+		float sample_level(unsigned l, const vec3& position) const {
+
+			float v[3];
+			int v0[3];
+			for(int i = 0; i < 3; ++i) {
+				v[i] = position[i] * (float)data.resolutions[l][i] - 0.5f;
+				v0[i] = (int)std::floor(v[i]);
+				v[i] -= (float)v0[i];
+			}
+
+			float c00 = voxel(l, v0[0], v0[1], v0[2]) + v[0] * (voxel(l, v0[0] + 1, v0[1], v0[2]) - voxel(l, v0[0], v0[1], v0[2]));
+			float c10 = voxel(l, v0[0], v0[1] + 1, v0[2]) + v[0] * (voxel(l, v0[0] + 1, v0[1] + 1, v0[2]) - voxel(l, v0[0], v0[1] + 1, v0[2]));
+			float c01 = voxel(l, v0[0], v0[1], v0[2] + 1) + v[0] * (voxel(l, v0[0] + 1, v0[1], v0[2] + 1) - voxel(l, v0[0], v0[1], v0[2] + 1));
+			float c11 = voxel(l, v0[0], v0[1] + 1, v0[2] + 1) + v[0] * (voxel(l, v0[0] + 1, v0[1] + 1, v0[2] + 1) - voxel(l, v0[0], v0[1] + 1, v0[2] + 1));
+			float c0 = c00 + v[1] * (c10 - c00);
+			float c1 = c01 + v[1] * (c11 - c01);
+			return c0 + v[2] * (c1 - c0);
+		}
+
+		float sample(const vec3& position, float level) const {
+
+			level = std::min(std::max(level, 0.0f), (float)(data.levels.size() - 1));
+			unsigned l0 = (unsigned)level;
+			unsigned l1 = std::min(l0 + 1u, (unsigned)data.levels.size() - 1u);
+			float a = level - (float)l0;
+
+			float d0 = sample_level(l0, position);
+			return a > 0.0f ? d0 + a * (sample_level(l1, position) - d0) : d0;
+		}
+	};
+#endif
+}
+
+namespace util {
+
+	void density_bricks::clear() {
+
+		levels.clear();
+		std::vector<uint32_t>().swap(table);
+		pool_slots = uvec3(0u);
+		brick_count = 0;
+	}
+
+	size_t density_bricks::get_memory_size(density_format format) const {
+
+		uvec3 r = get_pool_resolution();
+		return table.size() * sizeof(uint32_t) + (size_t)r[0] * r[1] * r[2] * get_texel_size(format);
+	}
+
+	/*
+		Mirrors sample_density in density_volume.glsl, which mixes the two levels around the fractional level like
+		trilinear mipmap filtering.
+	*/
+	float density_bricks::sample(const density_texture_data& pool, const vec3& position, float level) const {
+
+		if(levels.empty())
+			return 0.0f;
+
+		level = std::min(std::max(level, 0.0f), (float)(levels.size() - 1));
+		unsigned l0 = (unsigned)level;
+		unsigned l1 = std::min(l0 + 1u, (unsigned)levels.size() - 1u);
+		float a = level - (float)l0;
+
+		float d0 = sample_level(*this, pool, levels[l0], position);
+		return a > 0.0f ? d0 + a * (sample_level(*this, pool, levels[l1], position) - d0) : d0;
+	}
+
+	/*
+		The first level resolves the rows of the sums a brick covers and skips bricks whose voxels all lie in empty
+		bricks of the sums, the following ones average the voxels of the previous level. The bricks are collected one after another in float precision and converted into their
+		slots of the pool texture at the end, when the number of slots is known.
+	*/
+	bool build_density_bricks(const density_sums& sums, const density_parameters& parameters, density_format format, density_bricks& bricks, density_texture_data& pool, unsigned max_texture_size) {
+
+		bricks.clear();
+		pool.clear();
+		pool.format = format;
+
+		const uvec3 resolution = sums.grid.resolution;
+		if(sums.empty())
+			return false;
+
+		std::vector<float> storage;
+		const uvec3 sums_bricks = sums.get_brick_resolution();
+
+		add_level(bricks, storage, resolution, [&](int bx, int by, int bz, float* values) {
+			// The stored voxels from 8 * b - 1 on lie in the bricks b - 1 and b of the sums
+			bool allocated = false;
+			for(int cz = std::max(bz - 1, 0); cz <= std::min(bz, (int)sums_bricks[2] - 1); ++cz) {
+				for(int cy = std::max(by - 1, 0); cy <= std::min(by, (int)sums_bricks[1] - 1); ++cy) {
+					for(int cx = std::max(bx - 1, 0); cx <= std::min(bx, (int)sums_bricks[0] - 1); ++cx)
+						allocated |= sums.table[((size_t)cz * sums_bricks[1] + cy) * sums_bricks[0] + cx] != 0u;
+				}
+			}
+			if(!allocated)
+				return false;
+
+			const int x0 = bx * brick_size - 1;
+			const int y0 = by * brick_size - 1;
+			const int z0 = bz * brick_size - 1;
+			const int x_begin = std::max(x0, 0);
+			const int x_end = std::min(x0 + stored_size, (int)resolution[0]);
+
+			bool occupied = false;
+			for(int k = 0; k < stored_size; ++k) {
+				for(int j = 0; j < stored_size; ++j) {
+					float* row = values + (k * stored_size + j) * stored_size;
+					std::fill(row, row + stored_size, 0.0f);
+
+					const int y = y0 + j;
+					const int z = z0 + k;
+					if(y < 0 || z < 0 || y >= (int)resolution[1] || z >= (int)resolution[2] || x_begin >= x_end)
+						continue;
+
+					sums.resolve_row(parameters, (unsigned)y, (unsigned)z, (unsigned)x_begin, (unsigned)x_end, row + x_begin - x0);
+
+					for(int i = 0; i < stored_size; ++i)
+						occupied |= row[i] != 0.0f;
+				}
+			}
+			return occupied;
+		});
+
+		const unsigned level_count = util::get_mipmap_level_count(resolution, density_bricks::max_levels);
+		while(bricks.levels.size() < level_count) {
+			const level_reader source = { bricks.levels.back(), bricks.table, storage };
+			const uvec3 next = util::get_mipmap_resolution(source.level.resolution);
+
+			add_level(bricks, storage, next, [&](int bx, int by, int bz, float* values) {
+				// The voxels of the brick average the source voxels from 2 * (8 * b - 1) on, 18 along each axis
+				const int extent = 2 * stored_size;
+				int origin[3] = { 2 * (bx * brick_size - 1), 2 * (by * brick_size - 1), 2 * (bz * brick_size - 1) };
+				std::vector<float> region;
+				if(!source.gather(origin, extent, region))
+					return false;
+
+				const int max_x = (int)source.level.resolution[0] - 1 - origin[0];
+				const int max_y = (int)source.level.resolution[1] - 1 - origin[1];
+				const int max_z = (int)source.level.resolution[2] - 1 - origin[2];
+
+				bool occupied = false;
+				for(int k = 0; k < stored_size; ++k) {
+					for(int j = 0; j < stored_size; ++j) {
+						for(int i = 0; i < stored_size; ++i) {
+							const int x = bx * brick_size - 1 + i;
+							const int y = by * brick_size - 1 + j;
+							const int z = bz * brick_size - 1 + k;
+
+							float value = 0.0f;
+							if(x >= 0 && y >= 0 && z >= 0 && x < (int)next[0] && y < (int)next[1] && z < (int)next[2]) {
+								// Odd resolutions drop the last voxel, a single voxel is kept
+								for(int d = 0; d < 8; ++d) {
+									int rx = std::min(2 * i + (d & 1), max_x);
+									int ry = std::min(2 * j + ((d >> 1) & 1), max_y);
+									int rz = std::min(2 * k + (d >> 2), max_z);
+									value += region[((size_t)rz * extent + ry) * extent + rx];
+								}
+								value *= 0.125f;
+							}
+
+							values[(k * stored_size + j) * stored_size + i] = value;
+							occupied |= value != 0.0f;
+						}
+					}
+				}
+				return occupied;
+			});
+		}
+
+		// Roughly cubic pool, an empty volume still gets one slot for a valid texture
+		unsigned s = 1u;
+		while((size_t)s * s * s < bricks.brick_count)
+			++s;
+		bricks.pool_slots = uvec3(s, s, (unsigned)std::max<size_t>((bricks.brick_count + (size_t)s * s - 1) / ((size_t)s * s), 1));
+
+		if(s * stored_size > max_texture_size || bricks.pool_slots[2] * stored_size > max_texture_size) {
+			bricks.clear();
+			return false;
+		}
+
+		const uvec3 pool_resolution = bricks.get_pool_resolution();
+		const size_t sy = pool_resolution[0];
+		const size_t sz = sy * pool_resolution[1];
+		const size_t texel_size = get_texel_size(format);
+		pool.resolutions.push_back(pool_resolution);
+		pool.levels.emplace_back(sz * pool_resolution[2] * texel_size, (uint8_t)0u);
+		uint8_t* dst = pool.levels.back().data();
+
+		parallel_for(bricks.brick_count, [&](size_t begin, size_t end) {
+			for(size_t slot = begin; slot < end; ++slot) {
+				const size_t x = slot % s * stored_size;
+				const size_t y = slot / s % s * stored_size;
+				const size_t z = slot / ((size_t)s * s) * stored_size;
+
+				const float* src = storage.data() + slot * brick_voxels;
+				for(size_t k = 0; k < (size_t)stored_size; ++k) {
+					for(size_t j = 0; j < (size_t)stored_size; ++j)
+						quantize_densities(src + (k * stored_size + j) * stored_size, stored_size, format, dst + ((z + k) * sz + (y + j) * sy + x) * texel_size);
+				}
+			}
+		});
+
+		return true;
+	}
+
+#ifdef FIBER_BENCHMARKS
+	void benchmark_density_bricks(const density_sums& sums, const density_parameters& parameters, unsigned sample_count) {
+
+		if(sums.empty())
+			return;
+
+		const uvec3 resolution = sums.grid.resolution;
+		std::cout << "=====\nBenchmarking sparse density bricks of " << resolution[0] << "x" << resolution[1] << "x" << resolution[2] << " voxels" << std::endl;
+
+		density_bricks bricks;
+		density_texture_data pool;
+
+		auto start = std::chrono::steady_clock::now();
+		if(!build_density_bricks(sums, parameters, DF_FLOAT32, bricks, pool)) {
+			std::cout << "the brick pool exceeds the maximum texture size\n=====" << std::endl;
+			return;
+		}
+		double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		density_texture_data mipmaps;
+		start = std::chrono::steady_clock::now();
+		build_density_mipmaps(sums, parameters, DF_FLOAT32, mipmaps, density_bricks::max_levels);
+		double mipmap_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		const dense_reference reference = { mipmaps };
+		const size_t dense_size = mipmaps.get_size();
+
+		const density_bricks::level& first = bricks.levels.front();
+		size_t first_count = (size_t)first.bricks[0] * first.bricks[1] * first.bricks[2];
+		size_t first_occupied = 0;
+		for(size_t i = 0; i < first_count; ++i)
+			first_occupied += bricks.table[i] != 0u ? 1u : 0u;
+
+		std::cout << "built " << bricks.levels.size() << " levels with " << bricks.brick_count << " bricks in " << build_time * 1e3 << " ms (dense mipmaps " << mipmap_time * 1e3 << " ms), "
+			<< first_occupied << " of " << first_count << " bricks of the first level occupied" << std::endl;
+		std::cout << "memory: dense " << dense_size / (1024.0 * 1024.0) << " MB, sparse " << bricks.get_memory_size() / (1024.0 * 1024.0) << " MB ("
+			<< 100.0 * bricks.get_memory_size() / std::max<size_t>(dense_size, 1) << "%)" << std::endl;
+
+		// Positions slightly outside of the volume check the border
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> position_distr(-0.05f, 1.05f);
+		std::uniform_real_distribution<float> level_distr(0.0f, (float)bricks.levels.size());
+
+		float max_difference = 0.0f;
+		double sum = 0.0;
+		for(unsigned i = 0; i < sample_count; ++i) {
+			vec3 position(position_distr(rng), position_distr(rng), position_distr(rng));
+			float level = level_distr(rng);
+
+			float sparse = bricks.sample(pool, position, level);
+			float dense = reference.sample(position, level);
+			max_difference = std::max(max_difference, std::fabs(sparse - dense));
+			sum += dense;
+		}
+
+		std::cout << "largest difference to the dense mipmaps at " << sample_count << " samples: " << max_difference << " (mean density " << sum / std::max(sample_count, 1u) << ")\n=====" << std::endl;
+	}
+#endif
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "density_texture.h"
+#include "density_voxelizer.h"
+
+namespace util {
+
+	/*
+		Sparse mipmapped density volume made of bricks of 8^3 voxels. Every brick also stores the voxels one before
+		it along each axis, so the 9^3 stored voxels contain all neighbors needed for trilinear filtering inside the
+		brick and neighboring bricks overlap by one voxel. Only bricks with a non-zero voxel are stored.
+
+		The levels match the mipmaps of a dense texture: every level halves the resolution of the previous one,
+		rounded down, and a voxel is the mean of the 2^3 voxels it covers. The brick table holds the entries of
+		all levels, each level in x-fastest order starting at table_offset. An entry is 0 for an empty brick and
+		otherwise one more than the slot of the brick in the pool. The pool is a 3D texture of pool_slots bricks
+		of 9^3 voxels along each axis, in the same x-fastest order.
+
+		Voxel i of a level with resolution d lies at the texture coordinate (i + 0.5) / d like in a dense texture.
+		With w = coordinate * d + 0.5 it belongs to brick floor(w / 8) and is voxel w - 8 * brick of it.
+	*/
+	struct density_bricks {
+		static const unsigned brick_size = 8u;
+		static const unsigned stored_size = brick_size + 1u;
+		static const unsigned max_levels = 8u;
+
+		struct level {
+			uvec3 resolution = uvec3(0u);
+			uvec3 bricks = uvec3(0u);
+			uint32_t table_offset = 0u;
+		};
+
+		std::vector<level> levels;
+		std::vector<uint32_t> table;
+		uvec3 pool_slots = uvec3(0u);
+		size_t brick_count = 0;
+
+		void clear();
+		bool empty() const { return levels.empty(); }
+
+		/// resolution of the pool texture in voxels
+		uvec3 get_pool_resolution() const { return uvec3(pool_slots[0] * stored_size, pool_slots[1] * stored_size, pool_slots[2] * stored_size); }
+		/// bytes of the brick table and the pool in the format on the GPU
+		size_t get_memory_size(density_format format = DF_FLOAT32) const;
+
+		/// sample the volume at a texture coordinate of the dense volume and a fractional level, like the ambient
+		/// occlusion shaders do with the pool texture
+		float sample(const density_texture_data& pool, const vec3& position, float level) const;
+	};
+
+	/// resolve the density sums for the parameters into the bricks of all levels and write the pool texture in the
+	/// format as the only level of pool. The levels are built in parallel, one brick per task. Returns false if the
+	/// pool would exceed max_texture_size voxels along an axis.
+	bool build_density_bricks(const density_sums& sums, const density_parameters& parameters, density_format format, density_bricks& bricks, density_texture_data& pool, unsigned max_texture_size = 2048u);
+
+#ifdef FIBER_BENCHMARKS
+	/// build the bricks of the sums, print the build time and the memory against a dense volume with all mipmaps
+	/// and compare samples at random positions and levels with the filtered dense mipmaps
+	void benchmark_density_bricks(const density_sums& sums, const density_parameters& parameters, unsigned sample_count = 1000000u);
+#endif
+}
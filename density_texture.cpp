@@ -0,0 +1,284 @@
+#include "density_texture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "parallel.h"
+
+namespace {
+
+	typedef util::uvec3 uvec3;
+
+	/*
+		Computes the next mipmap level of a level with resolution src into dst. read_row(y, z, buffer) returns the
+		row of src[0] voxels at y and z of the previous level, either in buffer or directly from the level. The
+		rows of the new level are filled in parallel.
+	*/
+	template<typename R>
+	void downsample(const uvec3& src, const R& read_row, float* dst) {
+
+		const uvec3 res = util::get_mipmap_resolution(src);
+		const int max_x = (int)src[0] - 1;
+
+		util::parallel_for((size_t)res[1] * res[2], [&](size_t begin, size_t end) {
+			std::vector<float> buffers(4 * (size_t)src[0]);
+			const float* rows[4];
+
+			for(size_t row = begin; row < end; ++row) {
+				const unsigned y = (unsigned)(row % res[1]);
+				const unsigned z = (unsigned)(row / res[1]);
+
+				// Odd resolutions drop the last voxel, a single voxel is kept
+				for(unsigned r = 0; r < 4; ++r)
+					rows[r] = read_row(std::min(2 * y + (r & 1), src[1] - 1), std::min(2 * z + (r >> 1), src[2] - 1), buffers.data() + r * src[0]);
+
+				float* out = dst + row * res[0];
+				for(int x = 0; x < (int)res[0]; ++x) {
+					const int x0 = std::min(2 * x, max_x);
+					const int x1 = std::min(2 * x + 1, max_x);
+					float sum = 0.0f;
+					for(unsigned r = 0; r < 4; ++r)
+						sum += rows[r][x0] + rows[r][x1];
+					out[x] = 0.125f * sum;
+				}
+			}
+		});
+	}
+
+	/// append a level of the given resolution converted from the float voxels
+	void add_level(util::density_texture_data& data, const uvec3& resolution, const std::vector<float>& voxels) {
+
+		const size_t texel_size = util::get_texel_size(data.format);
+		data.resolutions.push_back(resolution);
+		data.levels.emplace_back(voxels.size() * texel_size);
+
+		uint8_t* dst = data.levels.back().data();
+		util::parallel_for(voxels.size(), [&](size_t begin, size_t end) {
+			util::quantize_densities(voxels.data() + begin, end - begin, data.format, dst + begin * texel_size);
+		});
+	}
+}
+
+namespace util {
+
+	size_t get_texel_size(density_format format) {
+
+		switch(format) {
+		case DF_FLOAT16: return 2;
+		case DF_UNORM8: return 1;
+		default: return 4;
+		}
+	}
+
+	uint16_t float_to_half(float value) {
+
+		uint32_t f;
+		std::memcpy(&f, &value, sizeof(f));
+
+		const uint16_t sign = (uint16_t)((f >> 16) & 0x8000u);
+		f &= 0x7fffffffu;
+
+		// Overflow to infinity, NaN stays NaN
+		if(f >= 0x47800000u)
+			return sign | (f > 0x7f800000u ? 0x7e00u : 0x7c00u);
+
+		// Below the smallest normal half the value is a multiple of 2^-24, which is the spacing of the floats in
+		// [0.5, 1), so adding 0.5 rounds it to even. This includes the empty voxels.
+		if(f < 0x38800000u) {
+			float a;
+			std::memcpy(&a, &f, sizeof(a));
+			a += 0.5f;
+			std::memcpy(&f, &a, sizeof(f));
+			return sign | (uint16_t)(f - 0x3f000000u);
+		}
+
+		// Rebias the exponent and round the 13 dropped mantissa bits to even, a carry correctly moves into the exponent
+		return sign | (uint16_t)((f - 0x38000000u + 0xfffu + ((f >> 13) & 1u)) >> 13);
+	}
+
+	float half_to_float(uint16_t value) {
+
+		const uint32_t sign = (uint32_t)(value & 0x8000u) << 16;
+		const uint32_t exponent = (value >> 10) & 0x1fu;
+		const uint32_t mantissa = value & 0x3ffu;
+
+		if(exponent == 0u) {
+			float a = (float)mantissa / 16777216.0f;
+			return sign ? -a : a;
+		}
+
+		uint32_t f = sign | (exponent == 31u ? 0x7f800000u | (mantissa << 13) : ((exponent + 112u) << 23) | (mantissa << 13));
+		float a;
+		std::memcpy(&a, &f, sizeof(a));
+		return a;
+	}
+
+	void quantize_densities(const float* src, size_t count, density_format format, uint8_t* dst) {
+
+		switch(format) {
+		case DF_FLOAT16:
+			for(size_t i = 0; i < count; ++i) {
+				uint16_t h = float_to_half(src[i]);
+				std::memcpy(dst + 2 * i, &h, sizeof(h));
+			}
+			break;
+		case DF_UNORM8:
+			for(size_t i = 0; i < count; ++i)
+				dst[i] = (uint8_t)(std::min(std::max(src[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+			break;
+		default:
+			std::memcpy(dst, src, count * sizeof(float));
+			break;
+		}
+	}
+
+	float get_density(const uint8_t* data, size_t i, density_format format) {
+
+		switch(format) {
+		case DF_FLOAT16: {
+			uint16_t h;
+			std::memcpy(&h, data + 2 * i, sizeof(h));
+			return half_to_float(h);
+		}
+		case DF_UNORM8:
+			return (float)data[i] / 255.0f;
+		default: {
+			float f;
+			std::memcpy(&f, data + 4 * i, sizeof(f));
+			return f;
+		}
+		}
+	}
+
+	uvec3 get_mipmap_resolution(const uvec3& resolution) {
+
+		return uvec3(std::max(resolution[0] / 2u, 1u), std::max(resolution[1] / 2u, 1u), std::max(resolution[2] / 2u, 1u));
+	}
+
+	unsigned get_mipmap_level_count(uvec3 resolution, unsigned max_levels) {
+
+		unsigned count = 1u;
+		while(count < max_levels && (resolution[0] > 1u || resolution[1] > 1u || resolution[2] > 1u)) {
+			resolution = get_mipmap_resolution(resolution);
+			++count;
+		}
+		return count;
+	}
+
+	void density_texture_data::clear() {
+
+		resolutions.clear();
+		std::vector<std::vector<uint8_t>>().swap(levels);
+	}
+
+	size_t density_texture_data::get_size() const {
+
+		size_t size = 0;
+		for(const std::vector<uint8_t>& level : levels)
+			size += level.size();
+		return size;
+	}
+
+	/*
+		The first level is resolved row by row into a buffer that stays in the cache and converted from there. The
+		second level is filtered from resolved rows as well, so the first level never exists in float precision.
+		Only the smaller levels after it are kept as floats to filter the next one.
+	*/
+	void build_density_mipmaps(const density_sums& sums, const density_parameters& parameters, density_format format, density_texture_data& data, unsigned max_levels) {
+
+		data.clear();
+		data.format = format;
+		if(sums.empty())
+			return;
+
+		const uvec3 res = sums.grid.resolution;
+		const size_t texel_size = get_texel_size(format);
+
+		data.resolutions.push_back(res);
+		data.levels.emplace_back(sums.grid.get_voxel_count() * texel_size);
+
+		uint8_t* first = data.levels.back().data();
+		parallel_for((size_t)res[1] * res[2], [&](size_t begin, size_t end) {
+			std::vector<float> row(res[0]);
+			for(size_t r = begin; r < end; ++r) {
+				sums.resolve_row(parameters, (unsigned)(r % res[1]), (unsigned)(r / res[1]), 0u, res[0], row.data());
+				quantize_densities(row.data(), res[0], format, first + r * res[0] * texel_size);
+			}
+		});
+
+		const unsigned level_count = get_mipmap_level_count(res, max_levels);
+		if(level_count < 2u)
+			return;
+
+		uvec3 level_res = get_mipmap_resolution(res);
+		std::vector<float> voxels((size_t)level_res[0] * level_res[1] * level_res[2]);
+		downsample(res, [&](unsigned y, unsigned z, float* buffer) -> const float* {
+			sums.resolve_row(parameters, y, z, 0u, res[0], buffer);
+			return buffer;
+		}, voxels.data());
+		add_level(data, level_res, voxels);
+
+		std::vector<float> next;
+		while(data.levels.size() < level_count) {
+			const uvec3 src = level_res;
+			level_res = get_mipmap_resolution(src);
+			next.resize((size_t)level_res[0] * level_res[1] * level_res[2]);
+
+			downsample(src, [&](unsigned y, unsigned z, float*) -> const float* {
+				return voxels.data() + ((size_t)z * src[1] + y) * src[0];
+			}, next.data());
+
+			voxels.swap(next);
+			add_level(data, level_res, voxels);
+		}
+	}
+
+#ifdef FIBER_BENCHMARKS
+	void benchmark_density_mipmaps(const density_sums& sums, const density_parameters& parameters, unsigned repetitions) {
+
+		if(sums.empty())
+			return;
+
+		const uvec3 res = sums.grid.resolution;
+		std::cout << "=====\nBenchmarking density mipmaps of " << res[0] << "x" << res[1] << "x" << res[2] << " voxels on " << thread_count() << " threads" << std::endl;
+
+		const char* names[] = { "R32F", "R16F", "R8" };
+		density_texture_data reference;
+
+		for(int f = DF_FLOAT32; f <= DF_UNORM8; ++f) {
+			density_texture_data data;
+			double best = 1e9;
+			for(unsigned r = 0; r < std::max(repetitions, 1u); ++r) {
+				auto start = std::chrono::steady_clock::now();
+				build_density_mipmaps(sums, parameters, (density_format)f, data);
+				best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			}
+
+			std::cout << names[f] << ": " << data.levels.size() << " levels in " << best * 1e3 << " ms, " << data.get_size() / (1024.0 * 1024.0) << " MB";
+
+			if(f == DF_FLOAT32) {
+				reference = std::move(data);
+				std::cout << std::endl;
+				continue;
+			}
+
+			// Largest error of any level against the float levels
+			float max_difference = 0.0f;
+			for(size_t l = 0; l < data.levels.size(); ++l) {
+				const size_t count = data.levels[l].size() / get_texel_size(data.format);
+				for(size_t i = 0; i < count; ++i) {
+					float a = get_density(data.levels[l].data(), i, data.format);
+					float b = get_density(reference.levels[l].data(), i, DF_FLOAT32);
+					max_difference = std::max(max_difference, std::fabs(a - b));
+				}
+			}
+			std::cout << ", largest difference to R32F " << max_difference << std::endl;
+		}
+
+		std::cout << "=====" << std::endl;
+	}
+#endif
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "density_voxelizer.h"
+
+namespace util {
+
+	/// storage format of the density texture, the densities are in [0, 1]
+	enum density_format {
+		DF_FLOAT32,
+		DF_FLOAT16,
+		DF_UNORM8
+	};
+
+	/// bytes per voxel of the format
+	size_t get_texel_size(density_format format);
+
+	/// IEEE half precision with rounding to nearest even, as stored in R16F textures
+	uint16_t float_to_half(float value);
+	float half_to_float(uint16_t value);
+
+	/// convert count densities to the format, dst has room for count texels
+	void quantize_densities(const float* src, size_t count, density_format format, uint8_t* dst);
+	/// read texel i of data in the format as float
+	float get_density(const uint8_t* data, size_t i, density_format format);
+
+	/// resolution of the next mipmap level, halved and rounded down like OpenGL mipmaps
+	uvec3 get_mipmap_resolution(const uvec3& resolution);
+	/// number of mipmap levels down to a single voxel, at most max_levels
+	unsigned get_mipmap_level_count(uvec3 resolution, unsigned max_levels);
+
+	/*
+		Texels of the levels of a density texture in one storage format, each level in x-fastest order. Every
+		mipmap voxel is the mean of the 2^3 voxels it covers in the previous level, an odd resolution drops the
+		last voxel. Sparse density volumes keep their brick pool as the only level.
+	*/
+	struct density_texture_data {
+		density_format format = DF_FLOAT32;
+		std::vector<uvec3> resolutions;
+		std::vector<std::vector<uint8_t>> levels;
+
+		void clear();
+		bool empty() const { return levels.empty(); }
+
+		/// bytes of all levels
+		size_t get_size() const;
+	};
+
+	/// resolve the density sums for the parameters into the first level in the format and build the mipmaps down to a
+	/// single voxel, at most max_levels levels. The densities are converted row by row while they are resolved, the mipmaps are filtered
+	/// in float precision and converted afterwards. All levels are computed in parallel.
+	void build_density_mipmaps(const density_sums& sums, const density_parameters& parameters, density_format format, density_texture_data& data, unsigned max_levels = 32u);
+
+#ifdef FIBER_BENCHMARKS
+	/// build the mipmaps of the sums in every format, print the time and memory and the largest difference of every
+	/// level to the float levels
+	void benchmark_density_mipmaps(const density_sums& sums, const density_parameters& parameters, unsigned repetitions = 3u);
+#endif
+}
@@ -0,0 +1,745 @@
+#include "density_voxelizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#include "parallel.h"
+
+namespace {
+
+	typedef cgv::render::render_types::ivec3 ivec3;
+	typedef util::vec3 vec3;
+
+	const float pi = 3.14159265358979f;
+
+	/// segments [begin, end) of one tract, given by the indices of their first points
+	struct segment_run {
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	/*
+		Grid constants of the traversal kernel, computed once per volume so the kernel needs no division.
+		Positions are converted to grid units in which every voxel is a unit cube.
+	*/
+	struct traversal_context {
+		static const int brick_size = (int)util::density_sums::brick_size;
+
+		vec3 box_min;
+		float inv_voxel_size;
+		int res[3];
+		size_t bricks[2];
+		/// factor from the radii in world units and the segment length in grid units to the truncated cone volume
+		/// relative to the voxel volume
+		float cone_scale;
+
+		traversal_context(const util::density_grid& grid) {
+
+			box_min = grid.box_min;
+			inv_voxel_size = 1.0f / grid.voxel_size;
+			for(int i = 0; i < 3; ++i)
+				res[i] = (int)grid.resolution[i];
+			bricks[0] = (size_t)(res[0] + brick_size - 1) / brick_size;
+			bricks[1] = (size_t)(res[1] + brick_size - 1) / brick_size;
+			cone_scale = (pi / 3.0f) * inv_voxel_size * inv_voxel_size;
+		}
+
+		float to_grid(float v, int axis) const { return (v - box_min[axis]) * inv_voxel_size; }
+
+		/// returns the cell containing the grid coordinate, positions on the upper boundary and outside belong to the
+		/// nearest cell and non-finite positions to the first one
+		int cell_of(float g, int axis) const {
+
+			float c = std::min(static_cast<float>(res[axis] - 1), std::max(0.0f, std::floor(g)));
+			return static_cast<int>(c);
+		}
+
+		/// returns the index of the table entry of the brick at brick coordinates x, y and z
+		size_t brick_of(int x, int y, int z) const { return ((size_t)z * bricks[1] + y) * bricks[0] + x; }
+
+		/// returns the index of a cell within its brick
+		static size_t voxel_in_brick(const int cell[3]) {
+
+			return ((size_t)(cell[2] % brick_size) * brick_size + cell[1] % brick_size) * brick_size + cell[0] % brick_size;
+		}
+	};
+
+	/*
+		Marks the bricks in the brick layers [brick_z_begin, brick_z_end) that deposit_run can write for the
+		consecutive segments [begin, end) of a tract with 1 in the table. These are the bricks of the cells between
+		the end points of every segment with a volume, which contain all cells the traversal visits. Segments only
+		cover a few voxels, so the bounding boxes add few bricks the traversal does not reach.
+	*/
+	void mark_run(const traversal_context& ctx, const util::density_input& input, uint64_t begin, uint64_t end,
+		uint32_t* table, int brick_z_begin, int brick_z_end) {
+
+		const int brick_size = traversal_context::brick_size;
+
+		float g1[3] = { ctx.to_grid(input.x[begin], 0), ctx.to_grid(input.y[begin], 1), ctx.to_grid(input.z[begin], 2) };
+
+		for(uint64_t j = begin; j < end; ++j) {
+			const float g0[3] = { g1[0], g1[1], g1[2] };
+
+			g1[0] = ctx.to_grid(input.x[j + 1], 0);
+			g1[1] = ctx.to_grid(input.y[j + 1], 1);
+			g1[2] = ctx.to_grid(input.z[j + 1], 2);
+
+			const float d[3] = { g1[0] - g0[0], g1[1] - g0[1], g1[2] - g0[2] };
+			const float length_sqr = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+			// deposit_run skips the same segments
+			if(!(length_sqr > 0.0f) || !std::isfinite(length_sqr))
+				continue;
+
+			int first[3], last[3];
+			for(int i = 0; i < 3; ++i) {
+				const int c0 = ctx.cell_of(g0[i], i);
+				const int c1 = ctx.cell_of(g1[i], i);
+				first[i] = std::min(c0, c1) / brick_size;
+				last[i] = std::max(c0, c1) / brick_size;
+			}
+			first[2] = std::max(first[2], brick_z_begin);
+			last[2] = std::min(last[2], brick_z_end - 1);
+
+			for(int bz = first[2]; bz <= last[2]; ++bz) {
+				for(int by = first[1]; by <= last[1]; ++by) {
+					for(int bx = first[0]; bx <= last[0]; ++bx)
+						table[ctx.brick_of(bx, by, bz)] = 1u;
+				}
+			}
+		}
+	}
+
+	/*
+		Fused Amanatides Woo traversal that deposits the density sums of the consecutive segments [begin, end) of a
+		tract into the voxels of the layers [z_begin, z_end), which are stored in the bricks of the table. Voxels in
+		empty bricks are skipped, mark_run allocates all bricks the segments reach. The end point of a segment is the start of the next one, so
+		every point is converted once. A segment is walked by its parameter s in [0, 1]: the cell boundaries of every
+		axis are 1 / |d| apart, the length in a cell is the difference of the parameters where the segment enters and
+		leaves it, and the opacity at the middle of the interval is linear in them. An interval [s0, s1] therefore adds
+		(s1 - s0) * base to the geometry and (s1 - s0) * (h0 + h1 * (s0 + s1) / 2) to the opacity sum, with constants per
+		segment, and the loop needs neither a square root nor a division. No step goes past the cell of the end point
+		along its axis, so the visited cells stay within the cells of the end points. opacity is null without opacities.
+	*/
+	void deposit_run(const traversal_context& ctx, const util::density_input& input, bool has_radii,
+		uint64_t begin, uint64_t end, const uint32_t* table, float* geometry, float* opacity, int z_begin, int z_end) {
+
+		float g1[3] = { ctx.to_grid(input.x[begin], 0), ctx.to_grid(input.y[begin], 1), ctx.to_grid(input.z[begin], 2) };
+		float r1 = has_radii ? input.radii[begin] : 1.0f;
+		float a1 = opacity ? input.opacities[begin] : 1.0f;
+
+		for(uint64_t j = begin; j < end; ++j) {
+			const float g0[3] = { g1[0], g1[1], g1[2] };
+			const float r0 = r1;
+			const float a0 = a1;
+
+			g1[0] = ctx.to_grid(input.x[j + 1], 0);
+			g1[1] = ctx.to_grid(input.y[j + 1], 1);
+			g1[2] = ctx.to_grid(input.z[j + 1], 2);
+			r1 = has_radii ? input.radii[j + 1] : 1.0f;
+			a1 = opacity ? input.opacities[j + 1] : 1.0f;
+
+			const float d[3] = { g1[0] - g0[0], g1[1] - g0[1], g1[2] - g0[2] };
+			const float length_sqr = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+			// Segments of duplicate points have no volume
+			if(!(length_sqr > 0.0f) || !std::isfinite(length_sqr))
+				continue;
+
+			const float base = ctx.cone_scale * (r0*r0 + r0 * r1 + r1 * r1) * std::sqrt(length_sqr);
+			const float h0 = base * a0;
+			const float h1 = base * (a1 - a0);
+
+			int cell[3];
+			int end_cell[3];
+			int step[3];
+			float s_next[3];
+			float s_delta[3];
+
+			for(int i = 0; i < 3; ++i) {
+				cell[i] = ctx.cell_of(g0[i], i);
+				end_cell[i] = ctx.cell_of(g1[i], i);
+
+				if(d[i] != 0.0f) {
+					const float inv_d = 1.0f / d[i];
+					step[i] = d[i] > 0.0f ? 1 : -1;
+					s_next[i] = ((float)(d[i] > 0.0f ? cell[i] + 1 : cell[i]) - g0[i]) * inv_d;
+					s_delta[i] = std::fabs(inv_d);
+				} else {
+					// Segments parallel to the cell boundaries of this axis never cross them
+					step[i] = 0;
+					s_next[i] = std::numeric_limits<float>::infinity();
+					s_delta[i] = 0.0f;
+				}
+			}
+
+			float s_enter = 0.0f;
+			for(;;) {
+				const int i = s_next[0] < s_next[1] ? (s_next[0] < s_next[2] ? 0 : 2) : (s_next[1] < s_next[2] ? 1 : 2);
+				const bool last = cell[i] == end_cell[i];
+				// Rounding can put a boundary slightly before the entry of a clamped start cell or after the end point
+				const float s_exit = last ? 1.0f : std::min(std::max(s_next[i], s_enter), 1.0f);
+
+				const uint32_t entry = cell[2] >= z_begin && cell[2] < z_end ?
+					table[ctx.brick_of(cell[0] / traversal_context::brick_size, cell[1] / traversal_context::brick_size, cell[2] / traversal_context::brick_size)] : 0u;
+				if(entry) {
+					const size_t index = (entry - 1u) * util::density_sums::brick_voxels + traversal_context::voxel_in_brick(cell);
+					const float fraction = s_exit - s_enter;
+					geometry[index] += fraction * base;
+					if(opacity)
+						opacity[index] += fraction * (h0 + h1 * 0.5f*(s_enter + s_exit));
+				}
+
+				if(last)
+					break;
+
+				cell[i] += step[i];
+				s_next[i] += s_delta[i];
+				s_enter = s_exit;
+			}
+		}
+	}
+
+#ifdef FIBER_BENCHMARKS
+	/*
+		Traverses a line through a uniform 3D grid. returns a list containing pairs of grid cell index and intersection
+		length. Only used as the reference of benchmark_density_traversal. The end points are clamped to the cells of the grid and no step goes past the cell of the end point along
+		its axis, so rounding errors can not carry the traversal beyond the end point and the visited cells stay within
+		the range of cells spanned by the end points.
+	*/
+	std::vector<std::pair<int, float>> traverse_line(const vec3& a, const vec3& b, const vec3& vbox_min, float vsize, const ivec3& res) {
+
+		std::vector<std::pair<int, float>> intervals;
+
+		// Amanatides Woo line traversal algorithm
+		vec3 dir = normalize(vec3(b - a));
+		vec3 dt;
+		ivec3 step;
+		vec3 orig_grid = a - vbox_min;
+		vec3 dest_grid = b - vbox_min;
+		vec3 t(0.0f);
+		float ct = 0.0f;
+
+		// Points on the upper boundary of the box belong to the last cell
+		ivec3 cell_idx;
+		ivec3 end_idx;
+		for(unsigned i = 0; i < 3; ++i) {
+			cell_idx[i] = std::min(std::max((int)(floor(orig_grid[i] / vsize)), 0), res[i] - 1);
+			end_idx[i] = std::min(std::max((int)(floor(dest_grid[i] / vsize)), 0), res[i] - 1);
+		}
+
+		for(unsigned i = 0; i < 3; ++i) {
+			float delta = vsize / dir[i];
+			if(dir[i] < 0.0f) {
+				dt[i] = -delta;
+				t[i] = (cell_idx[i] * vsize - orig_grid[i]) / dir[i];
+				step[i] = -1;
+			} else if(dir[i] > 0.0f) {
+				dt[i] = delta;
+				t[i] = ((cell_idx[i] + 1) * vsize - orig_grid[i]) / dir[i];
+				step[i] = 1;
+			} else {
+				// Lines parallel to the cell boundaries of this axis never cross them
+				dt[i] = 0.0f;
+				t[i] = std::numeric_limits<float>::infinity();
+				step[i] = 0;
+			}
+		}
+
+		intervals.push_back(std::make_pair(cell_idx[0] + res[0] * cell_idx[1] + res[0] * res[1] * cell_idx[2], 0.0f));
+
+		vec3 p = orig_grid;
+		size_t idx = 0;
+
+		while(cell_idx != end_idx) {
+			// Step along the axis with the nearest cell boundary, but never past the end cell
+			int i = t[0] < t[1] ? (t[0] < t[2] ? 0 : 2) : (t[1] < t[2] ? 1 : 2);
+			if(cell_idx[i] == end_idx[i])
+				break;
+
+			cell_idx[i] += step[i];
+			if(cell_idx[i] < 0 || cell_idx[i] > res[i] - 1)
+				break;
+			p = orig_grid + t[i] * dir;
+			t[i] += dt[i];
+
+			float l = (orig_grid - p).length() - ct;
+			ct += l;
+			intervals[idx].second = l;
+
+			intervals.push_back(std::make_pair(cell_idx[0] + res[0] * cell_idx[1] + res[0] * res[1] * cell_idx[2], 0.0f));
+			++idx;
+		}
+
+		float l = (p - dest_grid).length();
+		intervals[idx].second = l;
+
+		return intervals;
+	}
+
+	/*
+		Deposits the density of segment j the way create_density_volume did before the fused kernel, with a separate
+		loop over the intervals returned by traverse_line.
+	*/
+	void deposit_segment_reference(const util::density_input& input, const util::density_parameters& parameters, const util::density_grid& grid,
+		bool has_radii, bool has_opacities, uint64_t j, float* voxels) {
+
+		const ivec3 res((int)grid.resolution[0], (int)grid.resolution[1], (int)grid.resolution[2]);
+		const float vsize = grid.voxel_size;
+		const float vvol = vsize * vsize*vsize; // Volume per voxel
+
+		// The start and end points of this segment
+		vec3 p0(input.x[j], input.y[j], input.z[j]);
+		vec3 p1(input.x[j + 1], input.y[j + 1], input.z[j + 1]);
+
+		float total_length = (p1 - p0).length();
+		if(!(total_length > 0.0f) || !std::isfinite(total_length))
+			return;
+
+		// Get radius and opacity values for the start and end point
+		float r0 = has_radii ? input.radii[j] : parameters.radius;
+		float r1 = has_radii ? input.radii[j + 1] : parameters.radius;
+
+		float a0 = has_opacities ? input.opacities[j] : 1.0f;
+		float a1 = has_opacities ? input.opacities[j + 1] : 1.0f;
+
+		// Get the all intervals of cell-segment intersections
+		std::vector<std::pair<int, float>> intervals = traverse_line(p0, p1, grid.box_min, vsize, res);
+
+		float accum_length = 0.0f;
+
+		// Loop over all intervals to calculate the density contribution of this segment for the intersected cells
+		for(size_t k = 0; k < intervals.size(); ++k) {
+			float length = intervals[k].second;
+
+			// Interpolate the opacity over the segment in the current interval
+			float alpha0 = accum_length / total_length;
+			float alpha1 = (accum_length + length) / total_length;
+			accum_length += length;
+
+			float alpha_mid = 0.5f*(alpha0 + alpha1);
+			float opacity_scale_factor = (1.0f - alpha_mid) * a0 + alpha_mid * a1;
+			// Scale opacity by global opacity scale factor
+			opacity_scale_factor *= parameters.alpha_scale;
+
+			// density contribution is volume of the segments truncated cone divided by the voxel cell volume
+			float vol = (pi / 3.0f) * (r0*r0 + r0 * r1 + r1 * r1) * length;
+			float vol_rel = vol / vvol;
+
+			// Reduce volume influence according to opacity of segment
+			vol_rel *= 1.0f - parameters.opacity_influence * (1.0f - opacity_scale_factor);
+
+			voxels[intervals[k].first] += vol_rel;
+		}
+	}
+#endif
+}
+
+namespace util {
+
+	density_grid density_grid::from_box(const box3& box, unsigned resolution) {
+
+		density_grid grid;
+
+		vec3 ext = box.get_extent();
+		int max_ext_axis = ext[0] >= ext[1] ? (ext[0] >= ext[2] ? 0 : 2) : (ext[1] >= ext[2] ? 1 : 2);
+		float max_ext = ext[max_ext_axis];
+
+		resolution = std::max(resolution, 1u);
+		grid.voxel_size = max_ext > 0.0f ? max_ext / static_cast<float>(resolution) : 1.0f;
+
+		for(unsigned i = 0; i < 3; ++i)
+			grid.resolution[i] = std::max(static_cast<unsigned>(ceilf(ext[i] / grid.voxel_size)), 1u);
+
+		grid.box_min = box.get_min_pnt() - 0.5f*(grid.get_extent() - ext);
+		return grid;
+	}
+
+	size_t density_input::get_segment_count() const {
+
+		const size_t point_count = std::min(x.size(), std::min(y.size(), z.size()));
+
+		size_t count = 0;
+		for(const tractogram::tract& t : tracts) {
+			if(t.offset < point_count)
+				count += (size_t)std::min<uint64_t>(t.size, point_count - t.offset) - (t.size > 0 ? 1 : 0);
+		}
+		return count;
+	}
+
+	uvec3 density_sums::get_brick_resolution() const {
+
+		const uvec3& res = grid.resolution;
+		return uvec3((res[0] + brick_size - 1u) / brick_size, (res[1] + brick_size - 1u) / brick_size, (res[2] + brick_size - 1u) / brick_size);
+	}
+
+	void density_sums::clear() {
+
+		grid = density_grid();
+		std::vector<uint32_t>().swap(table);
+		std::vector<float>().swap(geometry);
+		std::vector<float>().swap(opacity);
+		unit_radius = true;
+	}
+
+	bool density_sums::is_valid() const {
+
+		const uvec3 bricks = get_brick_resolution();
+		if(table.size() != (size_t)bricks[0] * bricks[1] * bricks[2] || geometry.size() % brick_voxels != 0)
+			return false;
+		if(!opacity.empty() && opacity.size() != geometry.size())
+			return false;
+
+		const size_t brick_count = get_brick_count();
+		for(uint32_t entry : table) {
+			if(entry > brick_count)
+				return false;
+		}
+		return true;
+	}
+
+	size_t density_sums::get_memory_size() const {
+
+		return table.size() * sizeof(uint32_t) + (geometry.size() + opacity.size()) * sizeof(float);
+	}
+
+	size_t density_sums::find(unsigned x, unsigned y, unsigned z) const {
+
+		const uvec3 bricks = get_brick_resolution();
+		const uint32_t entry = table[((size_t)(z / brick_size) * bricks[1] + y / brick_size) * bricks[0] + x / brick_size];
+		if(entry == 0u)
+			return npos;
+		return (entry - 1u) * brick_voxels + ((size_t)(z % brick_size) * brick_size + y % brick_size) * brick_size + x % brick_size;
+	}
+
+	/*
+		A voxel of the sums G and H has the density r * ((1 - f) * G + f * a * H), where r is the squared radius for
+		unit radius sums and 1 otherwise, f the opacity influence and a the alpha scale. Without opacities H equals G.
+		The row is resolved in runs of the voxels that share a brick.
+	*/
+	void density_sums::resolve_row(const density_parameters& parameters, unsigned y, unsigned z, unsigned x_begin, unsigned x_end, float* dst) const {
+
+		const float radius_factor = unit_radius ? parameters.radius * parameters.radius : 1.0f;
+		const float opacity_factor = radius_factor * parameters.opacity_influence * parameters.alpha_scale;
+		const float geometry_factor = radius_factor * (1.0f - parameters.opacity_influence);
+
+		const uvec3 bricks = get_brick_resolution();
+		const uint32_t* entries = table.data() + ((size_t)(z / brick_size) * bricks[1] + y / brick_size) * bricks[0];
+		const size_t row_offset = ((size_t)(z % brick_size) * brick_size + y % brick_size) * brick_size;
+
+		for(unsigned x = x_begin; x < x_end;) {
+			const unsigned run_end = std::min((x / brick_size + 1u) * brick_size, x_end);
+			const uint32_t entry = entries[x / brick_size];
+			float* out = dst + (x - x_begin);
+			const size_t count = run_end - x;
+
+			if(entry == 0u) {
+				std::fill(out, out + count, 0.0f);
+			} else {
+				const size_t first = (entry - 1u) * brick_voxels + row_offset + x % brick_size;
+				const float* g = geometry.data() + first;
+
+				if(!opacity.empty()) {
+					const float* h = opacity.data() + first;
+					for(size_t i = 0; i < count; ++i)
+						out[i] = std::min(std::max(geometry_factor * g[i] + opacity_factor * h[i], 0.0f), 1.0f);
+				} else {
+					const float factor = geometry_factor + opacity_factor;
+					for(size_t i = 0; i < count; ++i)
+						out[i] = std::min(std::max(factor * g[i], 0.0f), 1.0f);
+				}
+			}
+			x = run_end;
+		}
+	}
+
+	/*
+		The grid is split into slabs of whole brick layers, several per thread, which are handed out dynamically so the
+		dense center of a brain does not keep one thread busy. Every slab owns its bricks and is filled by one thread,
+		so no two threads write the same voxel and no per-thread grids are needed.
+
+		The segments are first binned into the slabs of the layers between their end points, which contain all cells
+		the traversal visits. Consecutive segments of a tract in the same slab are kept as one run. The tracts are
+		binned in blocks, and every slab then walks the runs of all blocks in order. A segment that crosses slabs is
+		traversed by each of them but only deposits into the cells of the slab. Every voxel thus receives the
+		contributions of its segments in the original order, which makes the result identical to a sequential
+		voxelization regardless of the number of threads and slabs.
+
+		Before the deposit every slab marks the bricks its segments reach in the table. The marked bricks are then
+		numbered in table order and only they are allocated, so empty space costs one table entry per brick.
+	*/
+	bool voxelize_density(const density_input& input, const density_grid& grid, density_sums& sums, const std::atomic<bool>* cancel) {
+
+		const size_t point_count = std::min(input.x.size(), std::min(input.y.size(), input.z.size()));
+		const size_t tract_count = input.tracts.size();
+
+		const bool has_radii = input.radii.size() >= point_count;
+		const bool has_opacities = input.opacities.size() >= point_count;
+
+		const unsigned brick_size = density_sums::brick_size;
+
+		sums.grid = grid;
+		sums.unit_radius = !has_radii;
+		const uvec3 bricks = sums.get_brick_resolution();
+		sums.table.assign((size_t)bricks[0] * bricks[1] * bricks[2], 0u);
+		std::vector<float>().swap(sums.geometry);
+		std::vector<float>().swap(sums.opacity);
+
+		if(sums.table.empty() || tract_count == 0 || point_count == 0)
+			return !(cancel && *cancel);
+
+		const traversal_context ctx(grid);
+
+		const unsigned threads = thread_count();
+		const unsigned layers = grid.resolution[2];
+		// Slabs of fewer layers would traverse most segments twice, whole bricks keep every brick in one slab
+		const unsigned slab_height = (std::max((layers + 4u * threads - 1u) / (4u * threads), 4u) + brick_size - 1u) / brick_size * brick_size;
+		const unsigned slab_count = (layers + slab_height - 1u) / slab_height;
+
+		const size_t block_count = std::min(tract_count, (size_t)16 * threads);
+		std::vector<std::vector<segment_run>> bins(block_count * slab_count);
+
+		parallel_for(block_count, 1, [&](size_t begin, size_t end) {
+			for(size_t b = begin; b < end; ++b) {
+				std::vector<segment_run>* block_bins = bins.data() + b * slab_count;
+
+				const size_t first = tract_count * b / block_count;
+				const size_t last = tract_count * (b + 1) / block_count;
+
+				for(size_t i = first; i < last; ++i) {
+					const uint64_t from = input.tracts[i].offset;
+					const uint64_t to = std::min<uint64_t>(from + input.tracts[i].size, point_count);
+
+					for(uint64_t j = from; j + 1 < to; ++j) {
+						// Layers of the end points clamped like in the traversal, non-finite coordinates end up in the first layer
+						unsigned z0 = (unsigned)ctx.cell_of(ctx.to_grid(input.z[j], 2), 2);
+						unsigned z1 = (unsigned)ctx.cell_of(ctx.to_grid(input.z[j + 1], 2), 2);
+
+						for(unsigned s = std::min(z0, z1) / slab_height; s <= std::max(z0, z1) / slab_height; ++s) {
+							std::vector<segment_run>& runs = block_bins[s];
+							if(!runs.empty() && runs.back().end == j)
+								++runs.back().end;
+							else
+								runs.push_back({ j, j + 1 });
+						}
+					}
+				}
+			}
+		});
+
+		uint32_t* table = sums.table.data();
+
+		parallel_for(slab_count, 1, [&](size_t begin, size_t end) {
+			for(size_t s = begin; s < end; ++s) {
+				const int brick_z_begin = (int)(s * slab_height / brick_size);
+				const int brick_z_end = (int)std::min<size_t>((s + 1) * slab_height / brick_size, bricks[2]);
+
+				for(size_t b = 0; b < block_count; ++b) {
+					if(cancel && *cancel)
+						return;
+
+					for(const segment_run& run : bins[b * slab_count + s])
+						mark_run(ctx, input, run.begin, run.end, table, brick_z_begin, brick_z_end);
+				}
+			}
+		});
+
+		if(cancel && *cancel)
+			return false;
+
+		uint32_t brick_count = 0u;
+		for(uint32_t& entry : sums.table) {
+			if(entry)
+				entry = ++brick_count;
+		}
+
+		sums.geometry.assign(brick_count * density_sums::brick_voxels, 0.0f);
+		if(has_opacities)
+			sums.opacity.assign(brick_count * density_sums::brick_voxels, 0.0f);
+
+		float* geometry = sums.geometry.data();
+		float* opacity = has_opacities ? sums.opacity.data() : nullptr;
+
+		parallel_for(slab_count, 1, [&](size_t begin, size_t end) {
+			for(size_t s = begin; s < end; ++s) {
+				const int z_begin = (int)(s * slab_height);
+				const int z_end = (int)std::min<size_t>((s + 1) * slab_height, layers);
+
+				for(size_t b = 0; b < block_count; ++b) {
+					if(cancel && *cancel)
+						return;
+
+					for(const segment_run& run : bins[b * slab_count + s])
+						deposit_run(ctx, input, has_radii, run.begin, run.end, table, geometry, opacity, z_begin, z_end);
+				}
+			}
+		});
+
+		return !(cancel && *cancel);
+	}
+
+#ifdef FIBER_BENCHMARKS
+	void benchmark_density_voxelization(const density_input& input, const box3& box, unsigned repetitions) {
+
+		const size_t segment_count = input.get_segment_count();
+		if(segment_count == 0)
+			return;
+
+		const unsigned previous_limit = thread_limit();
+		thread_limit() = 0u;
+		const unsigned max_threads = thread_count();
+
+		std::cout << "=====\nBenchmarking density voxelization of " << segment_count << " segments with up to " << max_threads << " threads" << std::endl;
+
+		density_sums reference;
+		density_sums sums;
+
+		for(unsigned resolution = 64u; resolution <= 1024u; resolution *= 2u) {
+			const density_grid grid = density_grid::from_box(box, resolution);
+			const uvec3& res = grid.resolution;
+
+			double base_rate = 0.0;
+			for(unsigned threads = 1u;; threads = std::min(2u * threads, max_threads)) {
+				thread_limit() = threads;
+
+				density_sums& result = threads == 1u ? reference : sums;
+
+				double best = 0.0;
+				for(unsigned i = 0; i < std::max(repetitions, 1u); ++i) {
+					auto start = std::chrono::steady_clock::now();
+					voxelize_density(input, grid, result);
+					double time = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+					best = std::max(best, static_cast<double>(segment_count) / time * 1e-6);
+				}
+
+				if(threads == 1u)
+					base_rate = best;
+
+				bool identical = sums.table == reference.table && sums.geometry == reference.geometry && sums.opacity == reference.opacity;
+
+				std::cout << res[0] << "x" << res[1] << "x" << res[2] << ", " << threads << " threads: " << best << " Msegments/s, speedup "
+					<< best / base_rate << (threads == 1u ? "" : (identical ? ", identical" : ", DIFFERENT")) << std::endl;
+
+				if(threads >= max_threads)
+					break;
+			}
+
+			const size_t dense_size = grid.get_voxel_count() * sizeof(float) * (reference.opacity.empty() ? 1u : 2u);
+			std::cout << "sums: " << reference.get_brick_count() << " of " << reference.table.size() << " bricks occupied, " << reference.get_memory_size() / (1024.0 * 1024.0)
+				<< " MB against " << dense_size / (1024.0 * 1024.0) << " MB dense" << std::endl;
+		}
+
+		thread_limit() = previous_limit;
+		std::cout << "=====" << std::endl;
+	}
+
+	void benchmark_density_traversal(const density_input& input, const density_parameters& parameters, const box3& box, unsigned resolution, unsigned repetitions) {
+
+		const size_t point_count = std::min(input.x.size(), std::min(input.y.size(), input.z.size()));
+		const size_t segment_count = input.get_segment_count();
+		if(segment_count == 0)
+			return;
+
+		const bool has_radii = input.radii.size() >= point_count;
+		const bool has_opacities = input.opacities.size() >= point_count;
+
+		const density_grid grid = density_grid::from_box(box, resolution);
+		const traversal_context ctx(grid);
+		const uvec3& res = grid.resolution;
+
+		std::cout << "=====\nBenchmarking density traversal of " << segment_count << " segments into " << res[0] << "x" << res[1] << "x" << res[2] << " voxels on one thread" << std::endl;
+
+		// All bricks are allocated so the kernel deposits every segment completely
+		std::vector<float> reference(grid.get_voxel_count());
+		density_sums sums;
+		sums.grid = grid;
+		sums.unit_radius = !has_radii;
+		const uvec3 bricks = sums.get_brick_resolution();
+		sums.table.resize((size_t)bricks[0] * bricks[1] * bricks[2]);
+		for(size_t i = 0; i < sums.table.size(); ++i)
+			sums.table[i] = (uint32_t)(i + 1);
+		sums.geometry.resize(sums.table.size() * density_sums::brick_voxels);
+		if(has_opacities)
+			sums.opacity.resize(sums.geometry.size());
+
+		double best_reference = 0.0;
+		double best_fused = 0.0;
+		for(unsigned r = 0; r < std::max(repetitions, 1u); ++r) {
+			std::fill(reference.begin(), reference.end(), 0.0f);
+			std::fill(sums.geometry.begin(), sums.geometry.end(), 0.0f);
+			std::fill(sums.opacity.begin(), sums.opacity.end(), 0.0f);
+
+			auto start = std::chrono::steady_clock::now();
+			for(const tractogram::tract& t : input.tracts) {
+				const uint64_t to = std::min<uint64_t>(t.offset + t.size, point_count);
+				for(uint64_t j = t.offset; j + 1 < to; ++j)
+					deposit_segment_reference(input, parameters, grid, has_radii, has_opacities, j, reference.data());
+			}
+			double reference_time = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			start = std::chrono::steady_clock::now();
+			for(const tractogram::tract& t : input.tracts) {
+				const uint64_t to = std::min<uint64_t>(t.offset + t.size, point_count);
+				if(t.offset + 1 < to)
+					deposit_run(ctx, input, has_radii, t.offset, to - 1, sums.table.data(), sums.geometry.data(), has_opacities ? sums.opacity.data() : nullptr, 0, (int)res[2]);
+			}
+			double fused_time = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			double reference_rate = static_cast<double>(segment_count) / reference_time * 1e-6;
+			double fused_rate = static_cast<double>(segment_count) / fused_time * 1e-6;
+
+			std::cout << "run " << r << ": traverse_line " << reference_rate << " Msegments/s, fused kernel " << fused_rate << " Msegments/s" << std::endl;
+
+			best_reference = std::max(best_reference, reference_rate);
+			best_fused = std::max(best_fused, fused_rate);
+		}
+
+		// Both compute the same intervals with different rounding, segments grazing a cell edge can end up in either cell.
+		// The sums are combined like in resolve but without clamping.
+		const float radius_factor = sums.unit_radius ? parameters.radius * parameters.radius : 1.0f;
+		const float opacity_factor = radius_factor * parameters.opacity_influence * parameters.alpha_scale;
+		const float geometry_factor = radius_factor * (1.0f - parameters.opacity_influence);
+
+		double reference_sum = 0.0;
+		double fused_sum = 0.0;
+		float max_difference = 0.0f;
+		float max_density = 0.0f;
+		for(size_t i = 0; i < reference.size(); ++i) {
+			const size_t j = sums.find((unsigned)(i % res[0]), (unsigned)(i / res[0] % res[1]), (unsigned)(i / ((size_t)res[0] * res[1])));
+			float h = has_opacities ? sums.opacity[j] : sums.geometry[j];
+			float fused = geometry_factor * sums.geometry[j] + opacity_factor * h;
+
+			reference_sum += reference[i];
+			fused_sum += fused;
+			max_difference = std::max(max_difference, std::fabs(fused - reference[i]));
+			max_density = std::max(max_density, reference[i]);
+		}
+
+		std::cout << "best: traverse_line " << best_reference << " Msegments/s, fused kernel " << best_fused << " Msegments/s, speedup " << best_fused / best_reference << std::endl;
+		std::cout << "total density " << reference_sum << " and " << fused_sum << ", largest voxel difference " << max_difference << " at densities up to " << max_density << std::endl;
+
+		// A change of the radius or alpha scale only resolves the sums again
+		std::vector<float> densities(reference.size());
+		density_parameters changed = parameters;
+		double best_resolve = 1e9;
+		for(unsigned r = 0; r < std::max(repetitions, 1u); ++r) {
+			changed.radius = parameters.radius * (1.0f + 0.1f * (float)r);
+			changed.alpha_scale = parameters.alpha_scale / (1.0f + (float)r);
+
+			auto start = std::chrono::steady_clock::now();
+			parallel_for((size_t)res[1] * res[2], [&](size_t begin, size_t end) {
+				for(size_t row = begin; row < end; ++row)
+					sums.resolve_row(changed, (unsigned)(row % res[1]), (unsigned)(row / res[1]), 0u, res[0], densities.data() + row * res[0]);
+			});
+			best_resolve = std::min(best_resolve, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+
+		std::cout << "resolving the sums for new parameters: " << best_resolve * 1e3 << " ms against " << segment_count / best_fused * 1e-3 << " ms for the voxelization\n=====" << std::endl;
+	}
+#endif
+}
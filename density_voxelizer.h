@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <cgv/render/render_types.h>
+
+#include "span.h"
+#include "tractogram.h"
+
+namespace util {
+
+	typedef cgv::render::render_types::vec3 vec3;
+	typedef cgv::render::render_types::uvec3 uvec3;
+	typedef cgv::render::render_types::box3 box3;
+
+	/*
+		Uniform grid of cubic voxels that covers a bounding box. The voxels are stored in x-fastest order.
+	*/
+	struct density_grid {
+		uvec3 resolution = uvec3(0u);
+		vec3 box_min = vec3(0.0f);
+		float voxel_size = 1.0f;
+
+		/// grid with the given number of voxels along the longest axis of the box, centered on the box
+		static density_grid from_box(const box3& box, unsigned resolution);
+
+		size_t get_voxel_count() const { return (size_t)resolution[0] * resolution[1] * resolution[2]; }
+		vec3 get_extent() const { return voxel_size * vec3((float)resolution[0], (float)resolution[1], (float)resolution[2]); }
+	};
+
+	/*
+		Tubes to voxelize, referencing the columns of a tractogram. Without per-point radii the tubes are voxelized
+		with radius 1, without opacities every point is opaque.
+	*/
+	struct density_input {
+		span<const tractogram::tract> tracts;
+		span<const float> x;
+		span<const float> y;
+		span<const float> z;
+		span<const float> radii;
+		span<const float> opacities;
+
+		size_t get_segment_count() const;
+	};
+
+	/*
+		Global scales applied when the density sums are resolved. The radius replaces the unit radius of tubes
+		without per-point radii. The opacities are multiplied by alpha_scale and only reduce the density by the
+		fraction opacity_influence, which is 0 for opaque rendering.
+	*/
+	struct density_parameters {
+		float radius = 1.0f;
+		float alpha_scale = 1.0f;
+		float opacity_influence = 0.0f;
+	};
+
+	/*
+		Result of a voxelization split into sums that do not depend on the density parameters. geometry holds the
+		volume of the truncated cones in every voxel relative to the voxel volume, opacity the same volumes weighted
+		by the opacity interpolated along the segments. The density for any parameters is a weighted sum of both,
+		scaled by the squared radius if the tubes were voxelized with unit radius, so changing a parameter only
+		needs resolve_row instead of a new voxelization.
+
+		The sums are stored sparsely in bricks of 8^3 voxels, only the bricks the tubes pass through are allocated.
+		The table has an entry for every brick of the grid in x-fastest order, which is 0 for an empty brick and
+		otherwise one more than the index of the brick in the sums. The voxels of a brick are stored in x-fastest
+		order, voxels outside of the grid are 0.
+	*/
+	struct density_sums {
+		static const unsigned brick_size = 8u;
+		static const size_t brick_voxels = (size_t)brick_size * brick_size * brick_size;
+		static const size_t npos = ~size_t(0);
+
+		density_grid grid;
+		std::vector<uint32_t> table;
+		std::vector<float> geometry;
+		/// empty if the input had no opacities, which makes it equal to geometry
+		std::vector<float> opacity;
+		bool unit_radius = true;
+
+		void clear();
+		bool empty() const { return table.empty(); }
+		/// whether the sizes of the table and the sums match the grid, e.g. after reading them from a cache
+		bool is_valid() const;
+
+		/// number of bricks along each axis, the last ones can extend past the grid
+		uvec3 get_brick_resolution() const;
+		size_t get_brick_count() const { return geometry.size() / brick_voxels; }
+		/// bytes of the table and the sums
+		size_t get_memory_size() const;
+		/// returns the index of the voxel in the sums or npos if its brick is empty
+		size_t find(unsigned x, unsigned y, unsigned z) const;
+
+		/// write the densities of the voxels [x_begin, x_end) of row y of layer z for the parameters clamped to
+		/// [0, 1] to dst on the calling thread
+		void resolve_row(const density_parameters& parameters, unsigned y, unsigned z, unsigned x_begin, unsigned x_end, float* dst) const;
+	};
+
+	/// accumulate the density sums of all tube segments in the bricks of the grid they pass through. The grid is
+	/// split into slabs of z layers that are filled by all threads, the result is the same for any number of
+	/// threads. Returns false if cancel was set.
+	bool voxelize_density(const density_input& input, const density_grid& grid, density_sums& sums, const std::atomic<bool>* cancel = nullptr);
+
+#ifdef FIBER_BENCHMARKS
+	/// deposit all segments of the input into a grid of the given resolution on one thread with the allocating
+	/// traverse_line and with the fused traversal kernel, print the segments per second and compare the densities
+	/// for the parameters. Then resolve the sums for other parameters and compare the time with the voxelization.
+	void benchmark_density_traversal(const density_input& input, const density_parameters& parameters, const box3& box, unsigned resolution = 256u, unsigned repetitions = 3u);
+
+	/// voxelize the input at several resolutions of the box with increasing numbers of threads, print the
+	/// segments per second and the memory of the sums and check that all thread counts give the same sums
+	void benchmark_density_voxelization(const density_input& input, const box3& box, unsigned repetitions = 1u);
+#endif
+}
@@ -9,9 +9,18 @@
 #include <cgv_gl/gl/gl_tools.h>
 #include <cgv/media/image/image_reader.h>
 #include <cgv/utils/file.h>
-#include <cgv/utils/big_binary_file.h>
 #include <cgv/utils/advanced_scan.h>
 #include<iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+#include "parallel.h"
+#include "tractogram_reader.h"
+#include "volume_statistics.h"
+#include "volume_tools.h"
 
 
 
@@ -30,6 +39,8 @@ fiber_viewer::fiber_viewer() {
 
 	alss = ALSS_2;
 	voxel_resolution = VR_256;
+	sparse_density = false;
+	density_format = util::DF_FLOAT16;
 
 	tstyle.surface_color = rgb(1.0);
 	tstyle.illumination_mode = IM_OFF;
@@ -46,23 +57,91 @@ fiber_viewer::fiber_viewer() {
 
 	do_change_dataset = false;
 	do_change_color_source = false;
+	do_change_attribute = false;
 	do_create_density_volume = false;
+	do_update_density_volume = false;
 	do_rebuild_framebuffer = false;
 	do_rebuild_buffers = false;
+	do_rebuild_gpu_data = false;
 
 	disable_sorting = false;
 	disable_clipping = false;
 
+	attribute_scalar = 0;
+	use_dataset_cache = true;
+	compact_buffers = false;
+
+	for(int i = 0; i < CS_COUNT; ++i)
+		color_array_last_use[i] = 0u;
+	color_use_counter = 0u;
+	color_cache_budget = 1024u;
+	prepared_color_source = color_source;
+
+	load_state = LS_IDLE;
+	cancel_loading = false;
+	prepared_tract_count = 0;
+	load_fraction = 0.0f;
+	load_progress = 0.0f;
+	uploaded_tract_count = 0;
+	uploaded_segment_count = 0;
+	load_buffers_created = false;
+	load_test_dataset = false;
+	fa_window = vec2(0.0f, 1.0f);
+
 	view_ptr = nullptr;
 
-	// This is the base path for all resource files. Change this to the folder where you put the .nii files.
+	segment_ibo = 0;
+	ibo = 0;
+	positions_ssbo = 0;
+	radii_ssbo = 0;
+	colors_ssbo = 0;
+	scalars_ssbo = 0;
+	segments_ssbo = 0;
+	clip_bits_ssbo = 0;
+	brick_table_ssbo = 0;
+	scratch_buffer = 0;
+	density_tex = 0;
+	gpu_buffers_compact = false;
+	gpu_scalars_uploaded = false;
+
+	frame_time_query = 0;
+	frame_time_query_pending = false;
+	frame_time_query_compact = false;
+	frame_time_ms[0] = 0.0;
+	frame_time_ms[1] = 0.0;
+
+	setup_colormaps();
+
+	// This is the base path for all resource files. Change this to the folder where you put the .nii or .nii.gz files.
 	resource_path = "C:\\dev\\mycpp\\volume_data\\";
 }
 
+fiber_viewer::~fiber_viewer() {
+
+	cancel_dataset_loading();
+}
+
 void fiber_viewer::clear(cgv::render::context& ctx) {
 
+	cancel_dataset_loading();
+
 	cgv::render::ref_volume_renderer(ctx, -1);
 
+	for(int i = 0; i < CS_COUNT; ++i) {
+		if(colormap_luts[i].is_created())
+			colormap_luts[i].destruct(ctx);
+	}
+
+	if(brick_table_ssbo > 0) {
+		glDeleteBuffers(1, &brick_table_ssbo);
+		brick_table_ssbo = 0;
+	}
+
+	if(density_tex > 0) {
+		glDeleteTextures(1, &density_tex);
+		density_tex = 0;
+	}
+
 	tr.destruct(ctx);
 }
 
@@ -77,9 +156,37 @@ void fiber_viewer::stream_help(std::ostream& os) {
 	os << "fiber_viewer: rendering ... Ambient <O>cclusion\n" << std::endl;
 }
 
+/*
+	Reports the size of the GPU buffers for the current layout and for both layouts, so the savings of the
+	compact layout can be read off directly, and the averaged GPU time of the draw pass for both layouts.
+*/
 void fiber_viewer::stream_stats(std::ostream& os) {
-	
-	os << "statistics not implemented";
+
+	// The sizes are not final while the worker thread reads the dataset
+	if(!is_dataset_published()) {
+		os << "fiber_viewer: reading dataset" << std::endl;
+		return;
+	}
+
+	const double mb = 1.0 / (1024.0 * 1024.0);
+
+	os << "fiber_viewer: " << dataset.tract_count() << " tracts, " << dataset.point_count() << " points, " << segment_indices.size() << " segments" << std::endl;
+	os << "GPU buffers (" << (gpu_buffers_compact ? "compact" : "float") << "): " << get_gpu_buffer_size(gpu_buffers_compact) * mb << " MB";
+	os << " [float " << get_gpu_buffer_size(false) * mb << " MB, compact " << get_gpu_buffer_size(true) * mb << " MB]" << std::endl;
+
+	os << "Color arrays: " << get_color_data_size() * mb << " MB resident of " << color_cache_budget << " MB budget" << std::endl;
+
+	os << "GPU frame time: float ";
+	if(frame_time_ms[0] > 0.0)
+		os << frame_time_ms[0] << " ms";
+	else
+		os << "-";
+	os << ", compact ";
+	if(frame_time_ms[1] > 0.0)
+		os << frame_time_ms[1] << " ms";
+	else
+		os << "-";
+	os << std::endl;
 }
 
 bool fiber_viewer::handle(cgv::gui::event& e) {
@@ -158,10 +265,25 @@ void fiber_viewer::on_set(void* member_ptr) {
 		do_change_color_source = true;
 	}
 
-	if(member_ptr == &voxel_resolution || member_ptr == &render_mode) {
+	if(member_ptr == &attribute_scalar) {
+		do_change_attribute = true;
+	}
+
+	if(member_ptr == &voxel_resolution) {
 		do_create_density_volume = true;
 	}
 
+	// A dense volume of up to 1024^3 voxels needs up to 4.6 GB with its mipmaps
+	if((member_ptr == &voxel_resolution || member_ptr == &sparse_density) && voxel_resolution == VR_1024 && !sparse_density) {
+		sparse_density = true;
+		update_member(&sparse_density);
+	}
+
+	// The density sums do not depend on these, the density volume is only resolved again
+	if(member_ptr == &sparse_density || member_ptr == &density_format || member_ptr == &render_mode || member_ptr == &alpha_scale || member_ptr == &tstyle.radius || member_ptr == &tstyle.radius_scale) {
+		do_update_density_volume = true;
+	}
+
 	if(member_ptr == &fb.cf) {
 		cb.cf = fb.cf;
 		do_rebuild_framebuffer = true;
@@ -171,9 +293,22 @@ void fiber_viewer::on_set(void* member_ptr) {
 		do_rebuild_buffers = true;
 	}
 
+	if(member_ptr == &color_cache_budget && load_state == LS_IDLE) {
+		evict_color_data(color_source);
+	}
+
+	if(member_ptr == &compact_buffers) {
+		do_rebuild_gpu_data = true;
+	}
+
+	// Frame times are only comparable within the same render mode
+	if(member_ptr == &render_mode) {
+		frame_time_ms[0] = 0.0;
+		frame_time_ms[1] = 0.0;
+	}
+
 	if(member_ptr == &tstyle.enable_ambient_occlusion) {
-		std::string defines = "ENABLE_AMBIENT_OCCLUSION=";
-		defines += std::to_string((int)tstyle.enable_ambient_occlusion);
+		std::string defines = get_transparent_shader_defines();
 		
 		context* ctx_ptr = get_context();
 
@@ -197,300 +332,439 @@ bool fiber_viewer::generate_test_dataset() {
 	vec3 pos_b(0.5f, 0.6f, -0.5f);
 
 	// First tract from pos_a to pos_b
-	raw_positions.push_back(pos_a);
-	raw_positions.push_back(pos_b);
-
-	raw_radii.push_back(0.05f);
-	raw_radii.push_back(0.1f);
-
-	tracts.push_back(tract{ 0u, 2u }); // first tract starts at offset 0 and has 2 entires
+	dataset.add_tract({ pos_a, pos_b }, { 0.05f, 0.1f });
 
 	vec3 start(0.0f);
 
 	// Second tract with 5 points
+	std::vector<vec3> points;
 	for(unsigned i = 0; i < 5; ++i) {
-		raw_positions.push_back(start);
-		raw_radii.push_back(0.05f);
+		points.push_back(start);
 
 		start[0] += 0.5f;
 		start[1] += 0.3f * distr(rng);
 		start[2] += 0.3f * distr(rng);
 	}
 
-	tracts.push_back(tract{ 2u, 5u }); // second tract starts at offset 2 and has 5 entries
+	dataset.add_tract(points, std::vector<float>(points.size(), 0.05f));
 
 	return true;
 }
 
 /*
-	Loads fiber tractography files of format .trk as specified at http://www.trackvis.org/docs/?subsect=fileformat.
+	Returns the transformation applied to the positions of tractography files on reading.
 */
-bool fiber_viewer::read_trk_file(std::string file) {
+fiber_viewer::mat4 fiber_viewer::get_file_transformation() const {
 
-	cgv::utils::big_binary_file f;
+	// Multiply a matrix that transforms into opengl space (e.g flip y and z and invert x)
+	// Also scale the dataset down to prevent numerical instabilities resulting in ambient occlusion artifacts
+	mat4 flip(0.0f);
+	flip(0, 0) = -0.1f;
+	flip(1, 2) = 0.1f;
+	flip(2, 1) = 0.1f;
+	flip(3, 3) = 1.0f;
 
-	if(f.open(cgv::utils::big_binary_file::READ, file)) {
-		char buffer[6];
+	return flip;
+}
 
-		f.read(buffer);
-		std::string magic_id(buffer);
+/*
+	Reads a tractography file with the reader backend matching its file name (see tractogram_reader.h)
+	directly into the dataset container.
+*/
+bool fiber_viewer::read_tractogram_file(const std::string& file) {
 
-		if(magic_id != "TRACK") {
-			std::cout << "Error: could not read " << file << "!" << std::endl;
-			return false;
-		}
+	return tractogram_reader::read_file(file, get_file_transformation(), dataset);
+}
+
+/*
+	Starts loading a new dataset. The test dataset is generated synchronously, datasets from files are
+	read and prepared by a worker thread. The worker hands prepared tracts to the render thread in
+	chunks, which uploads them in update_dataset_loading, so tubes appear while loading continues.
+*/
+void fiber_viewer::set_dataset(context& ctx, bool generate_test) {
+
+	// Stop a load that may still be running for the previous dataset
+	cancel_dataset_loading();
 
-		short int dim_si[3];
-		ivec3 dim;
-		vec3 voxel_size, origin;
-		f.read(dim_si);
-		f.read(voxel_size);
-		f.read(origin);
+	// Clear and delete old buffers if present
+	delete_gpu_buffers();
+
+	dataset.clear();
+	dataset_cache_file.close();
+
+	segment_offsets.clear();
+	segment_indices.clear();
+	segment_clip_bits.clear();
+	for(int i = 0; i < CS_COUNT; ++i)
+		std::vector<rgba>().swap(color_arrays[i]);
+	std::vector<uint16_t>().swap(point_scalars);
+	fa_sampler.clear();
+	fa_window = vec2(0.0f, 1.0f);
+	density_sums.clear();
+	density_bricks.clear();
+	density_tex_data.clear();
+
+	// Only the selected color source is prepared while loading, others follow on demand
+	prepared_color_source = color_source;
+	color_array_last_use[prepared_color_source] = ++color_use_counter;
+	
+	// Clear the renderer
+	tr.destruct(ctx);
 
-		dim = ivec3(dim_si[0], dim_si[1], dim_si[2]);
+	if(!tr.init(ctx))
+		return;
 
-		short int n_scalars;
-		f.read(n_scalars);
+	tstyle.radius_scale = 1.0f;
+	tstyle.radius = generate_test ? 0.02f : 0.015f;
 
-		std::vector<std::string> scalar_names(10);
-		for(int i = 0; i < 10; ++i) {
-			char scalar_name[20];
-			f.read(scalar_name);
-			scalar_names[i] = std::string(scalar_name);
-		}
+	load_test_dataset = generate_test;
+	load_buffers_created = false;
+	uploaded_tract_count = 0;
+	uploaded_segment_count = 0;
+	prepared_tract_count = 0;
+	load_fraction = 0.0f;
+	cancel_loading = false;
+	load_state = LS_READING;
 
-		short int n_properties;
-		f.read(n_properties);
+	frame_time_ms[0] = 0.0;
+	frame_time_ms[1] = 0.0;
 
-		std::vector<std::string> property_names(10);
-		for(int i = 0; i < 10; ++i) {
-			char property_name[20];
-			f.read(property_name);
-			property_names[i] = std::string(property_name);
-		}
+	// The worker only reads this copy of the settings, the GUI may change the members while it runs
+	load_params = get_load_parameters();
 
-		mat4 vox_to_ras(1.0f);
-		f.read(vox_to_ras);
-		bool has_voxel_to_ras_transformation = vox_to_ras(3, 3) != 0.0f;
+	if(generate_test) {
+		load_dataset();
+		update_dataset_loading(ctx);
+	} else {
+		load_thread = std::thread(&fiber_viewer::load_dataset, this);
+	}
+}
 
-		if(!has_voxel_to_ras_transformation)
-			vox_to_ras.identity();
+/*
+	Requests the worker thread to stop and waits until it has finished.
+*/
+void fiber_viewer::cancel_dataset_loading() {
 
-		// Multiply a matrix that transforms into opengl space (e.g flip y and z and invert x)
-		// Also scale the dataset down to prevent numerical instabilities resulting in ambient occlusion artifacts
-		mat4 flip(0.0f);
-		flip(0, 0) = -0.1f;
-		flip(1, 2) = 0.1f;
-		flip(2, 1) = 0.1f;
-		flip(3, 3) = 1.0f;
-		vox_to_ras = flip * vox_to_ras;
+	if(load_thread.joinable()) {
+		cancel_loading = true;
+		load_thread.join();
+	}
 
-		// skip reserved space
-		long long p = f.position();
-		f.seek(p + 444ll);
+	cancel_loading = false;
+	load_state = LS_IDLE;
+}
 
-		char voxel_order[4];
-		f.read(voxel_order);
+/*
+	Copies the current GUI settings a load depends on. Called on the render thread only.
+*/
+fiber_viewer::load_parameters fiber_viewer::get_load_parameters() const {
+
+	load_parameters parameters;
+	parameters.file_name = dataset_filename;
+	parameters.use_cache = use_dataset_cache;
+	parameters.voxel_resolution = voxel_resolution;
+	parameters.sparse_density = sparse_density;
+	parameters.density_format = density_format;
+	parameters.attribute_scalar = attribute_scalar;
+	parameters.radius = tstyle.radius;
+	parameters.density = get_density_parameters();
+	return parameters;
+}
 
-		// skip pad2, image_orientation_patient and pad1
-		p = f.position();
-		f.seek(p + 4ll + 24ll + 2ll);
+/*
+	Returns whether the render thread may read the dataset, its bounding box and the segment index. The
+	worker thread writes them before it enters LS_PREPARING and leaves them unchanged afterwards.
+*/
+bool fiber_viewer::is_dataset_published() const {
 
-		// skip internal invert and swap flags
-		p = f.position();
-		f.seek(p + 6ll);
+	return load_state != LS_READING;
+}
 
-		int32_t n_count;
-		f.read(n_count);
-		bool number_of_tracks_stored = n_count != 0;
+/*
+	Runs on the worker thread. Reads the dataset from the cache or the file, prepares the colors of the
+	selected color source chunk by chunk and finally generates the density volume if it was not cached.
+	All settings are taken from load_params, which the render thread does not change during the load.
+	The render thread only accesses the dataset and the prepared arrays after load_state became
+	LS_PREPARING, and then only the colors of the tracts published via prepared_tract_count. The
+	density sums and volumes are only accessed once the worker has finished and was joined.
+*/
+void fiber_viewer::load_dataset() {
 
-		// skip version number
-		p = f.position();
-		f.seek(p + 4ll);
+	std::cout << "=====\nGenerating/loading data... ";
+	util::timer t;
 
-		int32_t hdr_size;
-		f.read(hdr_size);
+	bool success = false;
+	bool from_cache = false;
+	uint64_t cache_key = 0u;
 
-		if(hdr_size != 1000) {
-			std::cout << "Error: could not read " << file << "!" << std::endl;
-			return false;
+	if(load_test_dataset) {
+		success = generate_test_dataset();
+	} else {
+		// Try the preprocessed dataset cache before reading and preparing the dataset from file
+		if(load_params.use_cache) {
+			cache_key = get_cache_key();
+			from_cache = cache_key != 0u && read_cache(cache_key);
 		}
 
-		long long bytes_left = f.size() - f.position();
+		// Read dataset from file
+		success = from_cache || read_tractogram_file(load_params.file_name);
+	}
+
+	if(!success || cancel_loading) {
+		load_state = LS_FAILED;
+		return;
+	}
 
-		// Now read the acual track data
-		int count = 0;
-		while(bytes_left > 0) {
-			int32_t track_count; // number of points in this track
-			f.read(track_count);
+	if(from_cache) {
+		t.stop();
+		std::cout << "loaded from cache in " << t.seconds() << "s\n=====" << std::endl;
+	} else {
+		// The bounding box of the points is enlarged by the tube radius plus a small margin
+		dataset_bbox = dataset.compute_bounding_box();
+		dataset_bbox.add_point(dataset_bbox.get_min_pnt() - (load_params.radius + 0.01f));
+		dataset_bbox.add_point(dataset_bbox.get_max_pnt() + (load_params.radius + 0.01f));
+
+		// Move dataset to positive octant of the world
+		vec3 offset = -dataset_bbox.get_min_pnt();
+		dataset.translate(offset);
+
+		// Undo the translation and the transformation applied on reading to sample volumes in scanner space
+		mat4 position_to_world = cgv::math::translate4(-offset);
+		if(!load_test_dataset)
+			position_to_world = inv(get_file_transformation()) * position_to_world;
+		fa_sampler.set_position_transform(position_to_world);
+
+		// Update the bounding box according to the new position
+		dataset_bbox.ref_min_pnt() = vec3(0.0f);
+		dataset_bbox.ref_max_pnt() += offset;
+
+		t.stop();
+		std::cout << "done in " << t.seconds() << "s\n=====" << std::endl;
+	}
 
-			// read all track points
-			for(int32_t i = 0; i < track_count; ++i) {
-				// read position
-				vec3 pos;
-				f.read(pos);
+	// Create the segment index and the colors of the selected color source from generated data
+	std::cout << "=====\nPreparing data... ";
+	t.restart();
 
-				vec4 pos4 = vox_to_ras * vec4(pos[0], pos[1], pos[2], 1.0f);
-				pos[0] = pos4[0];
-				pos[1] = pos4[1];
-				pos[2] = pos4[2];
+	// The segment index is always rebuilt and rejects datasets too large for the GPU buffers, the cache holds the volumes
+	if(!build_segment_index()) {
+		load_state = LS_FAILED;
+		return;
+	}
 
-				raw_positions.push_back(pos);
+	if(!from_cache)
+		prepare_volumes();
 
-				// read scalars (skip for now)
-				p = f.position();
-				f.seek(p + (long long)n_scalars * 4ll);
-			}
+	allocate_color_data(prepared_color_source);
+
+	load_fraction = 0.1f;
+	load_state = LS_PREPARING;
 
-			// read properties (skip for now)
-			p = f.position();
-			f.seek(p + (long long)n_properties * 4ll);
+	// Wait until the render thread created the GPU buffers from the allocated arrays, so it never
+	// reads a range while it is being written here
+	while(!load_test_dataset && !load_buffers_created && !cancel_loading)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 
-			tracts.push_back(tract{ (unsigned)count, (unsigned)track_count });
-			count += track_count;
-			bytes_left = f.size() - f.position();
+	// Prepare the tracts in chunks of roughly the same number of segments and publish each finished chunk
+	const size_t segment_count = segment_indices.size();
+	const size_t chunk_segments = std::max(segment_count / 64, size_t(1024));
+
+	const size_t tract_count = dataset.tract_count();
+
+	size_t first = 0;
+	while(first < tract_count) {
+		if(cancel_loading) {
+			load_state = LS_FAILED;
+			return;
 		}
-	}
-}
 
-void fiber_viewer::set_dataset(context& ctx, bool generate_test) {
+		size_t last = first;
+		while(last < tract_count && segment_offsets[last] - segment_offsets[first] < chunk_segments)
+			++last;
 
-	// Clear and delete old buffers if present
-	if(segment_ibo > 0) {
-		glDeleteBuffers(1, &segment_ibo);
-		segment_ibo = 0;
-	}
+		prepare_colors(prepared_color_source, first, last);
 
-	if(ibo > 0) {
-		glDeleteBuffers(1, &ibo);
-		ibo = 0;
-	}
+		size_t prepared = last < tract_count ? segment_offsets[last] : segment_count;
+		prepared_tract_count = last;
+		load_fraction = 0.1f + 0.7f * static_cast<float>(prepared) / static_cast<float>(std::max(segment_count, size_t(1)));
 
-	if(positions_ssbo > 0) {
-		glDeleteBuffers(1, &positions_ssbo);
-		positions_ssbo = 0;
+		first = last;
 	}
 
-	if(radii_ssbo > 0) {
-		glDeleteBuffers(1, &radii_ssbo);
-		radii_ssbo = 0;
+	t.stop();
+	std::cout << "done in " << t.seconds() << "s" << std::endl;
+	std::cout << "Number of tracts: " << tract_count << std::endl;
+	std::cout << "Number of segments: " << segment_count << "\n=====" << std::endl;
+
+	// The density sums are part of the cache
+	if(from_cache) {
+		resolve_density_volume();
+		load_fraction = 1.0f;
+		load_state = LS_FINISHED;
+		return;
 	}
 
-	if(colors_ssbo > 0) {
-		glDeleteBuffers(1, &colors_ssbo);
-		colors_ssbo = 0;
+	// Generate the density volume used for ambient occlusion
+	std::cout << "=====\nGenerating density volume... ";
+	t.restart();
+
+	compute_density_volume(dataset_bbox);
+
+	if(cancel_loading) {
+		load_state = LS_FAILED;
+		return;
 	}
 
+	t.stop();
+	std::cout << "done in " << t.seconds() << "s\n=====" << std::endl;
+
+	if(cache_key != 0u)
+		write_cache(cache_key);
 
-	tracts.clear();
-	raw_positions.clear();
-	raw_radii.clear();
-	raw_attributes.clear();
+	load_fraction = 1.0f;
+	load_state = LS_FINISHED;
+}
 
-	positions.clear();
-	radii.clear();
-	colors_midpoint.clear();
-	colors_segment.clear();
-	colors_attribute.clear();
-	colors_coolwarm.clear();
-	colors_extended_kindlmann.clear();
-	colors_extended_blackbody.clear();
-	colors_blackbody.clear();
-	colors_isorainbow.clear();
-	colors_boys.clear();
-	
-	// Clear the renderer
-	tr.destruct(ctx);
+/*
+	Runs on the render thread once per frame while a dataset is loading. Creates the GPU buffers once the
+	prepared arrays are allocated, uploads all chunks finished since the last frame and completes the setup
+	when the worker thread is done.
+*/
+void fiber_viewer::update_dataset_loading(context& ctx) {
 
-	if(!tr.init(ctx))
+	int state = load_state;
+
+	if(state == LS_IDLE)
 		return;
 
-	// Generate or load a dataset
-	std::cout << "=====\nGenerating/loading data... ";
-	util::timer t;
+	if(state == LS_FAILED) {
+		if(load_thread.joinable())
+			load_thread.join();
+		load_state = LS_IDLE;
+		std::cout << "Loading of the dataset was aborted" << std::endl;
+		return;
+	}
 
-	tstyle.radius_scale = 1.0f;
+	load_progress = load_fraction;
+	update_member(&load_progress);
 
-	bool success = false;
+	if(state == LS_READING) {
+		post_redraw();
+		return;
+	}
 
-	if(generate_test) {
-		tstyle.radius = 0.02f;
-		success = generate_test_dataset();
-	} else {
-		tstyle.radius = 0.015f;
-		// Read dataset from file
-		success = read_trk_file(dataset_filename);
+	if(!load_buffers_created) {
+		dataset_center = dataset_bbox.get_center();
+
+		// Move the camera to show the dataset cenetred in the viewport
+		view_ptr->set_focus(dataset_bbox.get_center());
+		view_ptr->set_y_extent_at_focus((double)length(dataset_bbox.get_extent()) * 0.6);
+
+		// The arrays already have their final size, so the GPU buffers are created only once
+		upload_data(ctx);
+		set_uploaded_tract_count(prepared_tract_count);
+		load_buffers_created = true;
 	}
 
-	if(!success) {
-		// TODO: clear data
-		return;
+	size_t prepared = prepared_tract_count;
+	if(prepared > uploaded_tract_count) {
+		upload_tract_range(ctx, uploaded_tract_count, prepared);
+		set_uploaded_tract_count(prepared);
 	}
 
-	dataset_bbox = box3(1.0f, -1.0f);
-	for(unsigned i = 0; i < raw_positions.size(); ++i) {
-		vec3 p = raw_positions[i];
+	if(state == LS_FINISHED) {
+		if(load_thread.joinable())
+			load_thread.join();
+
+		upload_density_volume(ctx);
+		create_index_buffers(ctx);
+
+		load_state = LS_IDLE;
 
-		dataset_bbox.add_point(p - tstyle.radius);
-		dataset_bbox.add_point(p + tstyle.radius);
+		update_member(&tstyle.radius);
+		update_member(&tstyle.radius_scale);
 	}
 
-	dataset_bbox.add_point(dataset_bbox.get_min_pnt() - 0.01f);
-	dataset_bbox.add_point(dataset_bbox.get_max_pnt() + 0.01f);
+	post_redraw();
+}
 
-	// Move dataset to positive octant of the world
-	// We then use the sign bit of the x-component of the position to encode if the tube shall be clipped at this position.
-	// Clipping removes internal overlapping structures of transparent tubes.
-	vec3 offset = -dataset_bbox.get_min_pnt();
+/*
+	Converts count colors to 8 bit per component. The byte order matches packUnorm4x8 in the shaders.
+*/
+static void pack_colors(const rgba* colors, size_t count, rgba8* packed) {
 
-	for(size_t i = 0; i < raw_positions.size(); ++i)
-		raw_positions[i] += offset;
+	for(size_t i = 0; i < count; ++i) {
+		for(unsigned c = 0; c < 4; ++c) {
+			float v = cgv::math::clamp(colors[i][c], 0.0f, 1.0f);
+			packed[i][c] = static_cast<cgv::type::uint8_type>(v * 255.0f + 0.5f);
+		}
+	}
+}
 
-	// Update the bounding box according to the new position
-	dataset_bbox.ref_min_pnt() = vec3(0.0f);
-	dataset_bbox.ref_max_pnt() += offset;
+/*
+	Uploads the prepared per-point colors of the tracts in [first, last) into the already allocated GPU buffers.
+	Positions, radii and the segment index are complete before preparation starts and are uploaded as a whole.
+*/
+void fiber_viewer::upload_tract_range(context& ctx, size_t first, size_t last) {
 
-	dataset_center = dataset_bbox.get_center();
+	if(first >= last)
+		return;
 
-	// Move the camera to show the dataset cenetred in the viewport
-	view_ptr->set_focus(dataset_bbox.get_center());
-	view_ptr->set_y_extent_at_focus((double)length(dataset_bbox.get_extent()) * 0.6);
+	size_t offset = dataset.tracts[first].offset;
+	size_t count = dataset.tracts[last - 1].offset + dataset.tracts[last - 1].size - offset;
 
-	t.stop();
-	std::cout << "done in " << t.seconds() << "s\n=====" << std::endl;
+	if(get_scalar_colormap(prepared_color_source)) {
+		if(point_scalars.size() != dataset.point_count())
+			return;
 
-	// Create tube positions and colors from generated data
-	std::cout << "=====\nPreparing data... ";
-	t.restart();
+		tr.replace_attribute_range(ctx, "scalar", point_scalars, offset, count);
 
-	prepare_data(ctx);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, scalars_ssbo);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset * sizeof(uint16_t), count * sizeof(uint16_t), (void*)(point_scalars.data() + offset));
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		return;
+	}
 
-	t.stop();
-	std::cout << "done in " << t.seconds() << "s" << std::endl;
-	std::cout << "Number of tracts: " << tracts.size() << std::endl;
-	std::cout << "Number of segments: " << (positions.size() / 2) << "\n=====" << std::endl;
+	const std::vector<rgba>& color_data = get_color_data(prepared_color_source);
+	if(color_data.size() != dataset.point_count())
+		return;
 
-	// Generate the density volume used for ambient occlusion
-	create_density_volume(ctx, dataset_bbox, tstyle.radius * tstyle.radius_scale);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, colors_ssbo);
 
-	// Set data in the renderer
-	tr.set_render_style(tstyle);
-	tr.set_position_array(ctx, positions);
-	if(radii.size() == positions.size())
-		tr.set_radius_array(ctx, radii);
-	set_color_source(ctx);
+	if(gpu_buffers_compact) {
+		std::vector<rgba8> packed_colors(count);
+		pack_colors(color_data.data() + offset, count, packed_colors.data());
 
-	// Set up gpu sorter and index buffers used for sorting the tube segments and indexed rendering
-	unsigned segment_count = positions.size() / 2;
+		tr.replace_attribute_range(ctx, "color", packed_colors.data(), offset, count);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset * sizeof(rgba8), count * sizeof(rgba8), (void*)packed_colors.data());
+	} else {
+		tr.replace_attribute_range(ctx, "color", color_data, offset, count);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset * sizeof(rgba), count * sizeof(rgba), (void*)(color_data.data() + offset));
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+/*
+	Sets the number of tracts whose data is complete on the GPU and the resulting number of segments to draw.
+*/
+void fiber_viewer::set_uploaded_tract_count(size_t count) {
+
+	uploaded_tract_count = count;
+	uploaded_segment_count = count < dataset.tract_count() ? segment_offsets[count] : segment_indices.size();
+}
+
+/*
+	Sets up the gpu sorter and the index buffer of sorted segments. The line index buffer is created
+	with the other buffers in upload_data.
+*/
+void fiber_viewer::create_index_buffers(context& ctx) {
+
+	unsigned segment_count = (unsigned)segment_indices.size();
 
 	if(!sorter.init(ctx, segment_count))
 		return;
 
-	glGenBuffers(1, &ibo);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, positions.size() * sizeof(unsigned), (void*)0, GL_STATIC_DRAW);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
 	glGenBuffers(1, &segment_ibo);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, segment_ibo);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, segment_count * sizeof(unsigned), (void*)0, GL_STATIC_DRAW);
@@ -498,244 +772,649 @@ void fiber_viewer::set_dataset(context& ctx, bool generate_test) {
 }
 
 /*
-	Prepares the data for rendering. All consecutive tracts (lines) need to be rendered on a per-segment basis.
-	Converts points in a line from:
-		1 -> 2 -> 3 -> 4
-	to:
-		1,2 2,3 3,4
-
-	by duplicating position, radius and color where two segments of a connected line meet.
+	Returns the name of the preprocessed dataset cache file belonging to the dataset file being loaded.
 */
-void fiber_viewer::prepare_data(context& ctx) {
+std::string fiber_viewer::get_cache_file_name() const {
 
-	std::vector<vec3> tposs;
-	
-	for(unsigned i = 0; i < tracts.size(); ++i) {
-		int o = tracts[i].offset;
-		int s = tracts[i].size;
+	return load_params.file_name + ".fvcache";
+}
 
-		int mid = o + s / 2;
-		if(s % 2 == 0)
-			mid -= 1;
-		rgb color(0.0f);
+/*
+	Returns a key identifying the content of the dataset and volume files and all parameters the prepared
+	data depends on, or 0 if the dataset file could not be read.
+*/
+uint64_t fiber_viewer::get_cache_key() const {
 
-		vec3 dir(0.0f);
-		rgba last_color(0.0f);
+	uint64_t key = dataset_cache::hash_file(load_params.file_name);
+	if(key == 0u)
+		return 0u;
 
-		for(unsigned j = o; j < o + s - 1; ++j) {
-			vec3 a = raw_positions[j];
-			vec3 b = raw_positions[j + 1];
+	key = dataset_cache::hash_combine(key, dataset_cache::hash_file(get_volume_file_name("dti_FA")));
+	key = dataset_cache::hash_combine(key, dataset_cache::hash_file(get_volume_file_name("dti_MD")));
 
-			if(j == mid) {
-				vec3 dir = normalize(a - b);
-				dir.abs();
-				color = rgb(dir[0], dir[2], dir[1]);
-			}
+	// The density sums do not depend on the render mode and the alpha scale
+	std::vector<float> params = {
+		(float)load_params.voxel_resolution,
+		load_params.radius,
+		(float)load_params.attribute_scalar
+	};
 
-			if(j == o) {
-				vec3 last_dir = normalize(b - a);
-				last_dir.abs();
-				last_color = rgba(last_dir[0], last_dir[2], last_dir[1], 1.0f);
-			}
+	return dataset_cache::hash_combine(key, dataset_cache::hash_bytes(params.data(), params.size() * sizeof(float)));
+}
 
-			if(j == o + s - 2) {
-				dir = normalize(b - a);
-			} else {
-				dir = normalize(raw_positions[j + 2] - a);
-			}
+/*
+	Loads the raw and prepared data and the density sums from the cache file if it matches the given key.
+	The cache file stays mapped and the columns of the dataset use its sections in place, the smaller
+	volumes and density sums are copied.
+*/
+bool fiber_viewer::read_cache(uint64_t key) {
 
-			dir.abs();
-			colors_segment.push_back(last_color);
-			last_color = rgba(dir[0], dir[2], dir[1], 1.0f);
-			colors_segment.push_back(last_color);
+	dataset_cache& cache = dataset_cache_file;
+	if(!cache.open(get_cache_file_name(), key))
+		return false;
 
-			positions.push_back(a);
-			positions.push_back(b);
+	std::vector<char> names;
+	unsigned n_scalars = 0u, n_properties = 0u;
 
-			if(j > o)
-				a[0] *= -1.0f;
+	std::vector<float> fa_volume;
+	uvec3 fa_volume_res;
+	mat4 fa_world_to_voxel, fa_position_transform;
 
-			if(j < o + s - 2)
-				b[0] *= -1.0f;
+	auto get_column = [&cache](const std::string& name, tractogram::column& column) {
+		util::span<const float> values;
+		if(!cache.get_span(name, values))
+			return false;
+		column.reference(values.data(), values.size());
+		return true;
+	};
 
-			tposs.push_back(a);
-			tposs.push_back(b);
+	bool success =
+		cache.get_value("bbox", dataset_bbox) &&
+		cache.get("tracts", dataset.tracts) &&
+		get_column("x", dataset.x) &&
+		get_column("y", dataset.y) &&
+		get_column("z", dataset.z) &&
+		get_column("radii", dataset.radii) &&
+		cache.get_value("n_scalars", n_scalars) &&
+		cache.get_value("n_properties", n_properties) &&
+		cache.get("names", names) &&
+		cache.get("fa_volume", fa_volume) &&
+		cache.get_value("fa_volume_res", fa_volume_res) &&
+		cache.get_value("fa_world_to_voxel", fa_world_to_voxel) &&
+		cache.get_value("fa_position_transform", fa_position_transform) &&
+		cache.get_value("fa_window", fa_window) &&
+		cache.get("fa_data", fa_tex.data) &&
+		cache.get_value("fa_res", fa_tex.resolution) &&
+		cache.get_value("density_grid", density_sums.grid) &&
+		cache.get("density_table", density_sums.table) &&
+		cache.get("density_geometry", density_sums.geometry) &&
+		cache.get("density_opacity", density_sums.opacity) &&
+		cache.get_value("density_unit_radius", density_sums.unit_radius);
+
+	dataset.scalars.resize(n_scalars);
+	for(unsigned i = 0; success && i < n_scalars; ++i)
+		success = get_column("scalar" + std::to_string(i), dataset.scalars[i]);
+
+	dataset.properties.resize(n_properties);
+	for(unsigned i = 0; success && i < n_properties; ++i)
+		success = get_column("property" + std::to_string(i), dataset.properties[i]);
+
+	// Scalar and property names are stored as one block of newline terminated strings
+	std::vector<std::string> all_names;
+	std::string name;
+	for(char c : names) {
+		if(c == '\n') {
+			all_names.push_back(name);
+			name.clear();
+		} else {
+			name += c;
 		}
+	}
 
-		for(unsigned j = o; j < o + s - 1; ++j) {
-			rgba col4 = rgba(color.R(), color.G(), color.B(), 1.0f);
-			colors_midpoint.push_back(col4);
-			colors_midpoint.push_back(col4);
-		}
+	success = success && all_names.size() == n_scalars + n_properties &&
+		dataset.y.size() == dataset.x.size() && dataset.z.size() == dataset.x.size() &&
+		density_sums.is_valid();
+
+	if(!success) {
+		std::cout << "Warning: ignoring incomplete cache file " << get_cache_file_name() << std::endl;
+
+		dataset.clear();
+		density_sums.clear();
+		cache.close();
+		return false;
 	}
 
-	//Scalar Colormapping
+	dataset.scalar_names.assign(all_names.begin(), all_names.begin() + n_scalars);
+	dataset.property_names.assign(all_names.begin() + n_scalars, all_names.end());
+
+	fa_sampler.set_volume(fa_volume_res, std::move(fa_volume), fa_world_to_voxel);
+	fa_sampler.set_position_transform(fa_position_transform);
+
+	return true;
+}
+
+/*
+	Writes the raw and prepared data and the density sums to the cache file of the current dataset.
+*/
+void fiber_viewer::write_cache(uint64_t key) {
+
+	std::vector<char> names;
+	for(const std::string& name : dataset.scalar_names) {
+		names.insert(names.end(), name.begin(), name.end());
+		names.push_back('\n');
+	}
+	for(const std::string& name : dataset.property_names) {
+		names.insert(names.end(), name.begin(), name.end());
+		names.push_back('\n');
+	}
+
+	unsigned n_scalars = (unsigned)dataset.scalars.size();
+	unsigned n_properties = (unsigned)dataset.properties.size();
+
+	dataset_cache cache;
+	cache.add_value("bbox", dataset_bbox);
+	cache.add("tracts", dataset.tracts);
+	cache.add("x", dataset.x_span());
+	cache.add("y", dataset.y_span());
+	cache.add("z", dataset.z_span());
+	cache.add("radii", dataset.radius_span());
+	cache.add_value("n_scalars", n_scalars);
+	cache.add_value("n_properties", n_properties);
+	cache.add("names", names);
+	for(unsigned i = 0; i < n_scalars; ++i)
+		cache.add("scalar" + std::to_string(i), dataset.scalar_span(i));
+	for(unsigned i = 0; i < n_properties; ++i)
+		cache.add("property" + std::to_string(i), dataset.property_span(i));
+
+	cache.add("fa_volume", fa_sampler.get_data());
+	cache.add_value("fa_volume_res", fa_sampler.get_resolution());
+	cache.add_value("fa_world_to_voxel", fa_sampler.get_world_to_voxel());
+	cache.add_value("fa_position_transform", fa_sampler.get_position_transform());
+	cache.add_value("fa_window", fa_window);
+	cache.add("fa_data", fa_tex.data);
+	cache.add_value("fa_res", fa_tex.resolution);
+	cache.add_value("density_grid", density_sums.grid);
+	cache.add("density_table", density_sums.table);
+	cache.add("density_geometry", density_sums.geometry);
+	cache.add("density_opacity", density_sums.opacity);
+	cache.add_value("density_unit_radius", density_sums.unit_radius);
+
+	if(!cache.write(get_cache_file_name(), key))
+		std::cout << "Warning: could not write cache file " << get_cache_file_name() << std::endl;
+}
+
+/*
+	Creates the color maps used for the scalar color mapping modes.
+*/
+void fiber_viewer::setup_colormaps() {
+
+	const util::colormap_registry& registry = util::colormap_registry::instance();
+
+	coolwarm_colormap = registry.get("coolwarm");
+	extended_kindlmann_colormap = registry.get("extended_kindlmann");
+	extended_blackbody_colormap = registry.get("extended_blackbody");
+	blackbody_colormap = registry.get("blackbody");
+	isorainbow_colormap = registry.get("isorainbow");
+	attribute_colormap = registry.get("attribute");
+}
+
+/*
+	Samples the color maps of the scalar color sources into 1D textures. The tube shaders look the colors up
+	with the per-point scalar, so changing between these sources never touches the vertex data.
+*/
+void fiber_viewer::create_colormap_luts(context& ctx) {
+
+	const unsigned lut_size = 256u;
+	std::vector<rgba> lut(lut_size);
+
+	for(int i = 0; i < CS_COUNT; ++i) {
+		const util::colormap* colormap = get_scalar_colormap((ColorSource)i);
+		if(!colormap)
+			continue;
+
+		for(unsigned j = 0; j < lut_size; ++j)
+			lut[j] = colormap->interpolate(static_cast<float>(j) / static_cast<float>(lut_size - 1u));
+
+		cgv::data::data_format format(lut_size, cgv::type::info::TI_FLT32, cgv::data::CF_RGBA);
+		cgv::data::data_view data(&format, lut.data());
+
+		texture& tex = colormap_luts[i];
+		if(tex.is_created())
+			tex.destruct(ctx);
+
+		tex = texture("flt32[R,G,B,A]", TF_LINEAR, TF_LINEAR, TW_CLAMP_TO_EDGE);
+		tex.create(ctx, data, 0);
+	}
+}
+
+/*
+	Returns the file of the volume with the given name in the resource path. A compressed .nii.gz file
+	is preferred over the .nii file when it exists, it is read through the parallel BGZF path.
+*/
+std::string fiber_viewer::get_volume_file_name(const std::string& name) const {
+
+	std::string file_name = resource_path + name + ".nii.gz";
+	if(cgv::utils::file::exists(file_name))
+		return file_name;
+	return resource_path + name + ".nii";
+}
+
+/*
+	Reads the FA and MD volumes, fills the FA texture data and hands the FA volume to the sampler that is
+	used for the scalar color mapping. The FA texture is cropped to the non-zero voxels of the volume, so
+	it lines up with the bounding box of the tracts it is stretched over.
+*/
+void fiber_viewer::prepare_volumes() {
+
+	fa_tex.data.clear();
+	fa_tex.resolution = uvec3(0u);
+
+	// The images are freed when leaving this function, which also releases the file mappings of their data
+	typedef std::unique_ptr<nifti_image, void(*)(nifti_image*)> nifti_image_ptr;
 
 	//read .niidata
 	//read fa data
-	nifti_image* nii1 = nifti_image_read((resource_path + "dti_FA.nii").c_str(), 1);
+	const std::string fa_file_name = get_volume_file_name("dti_FA");
+	nifti_image_ptr nii1(nifti_image_read(fa_file_name.c_str(), 1), nifti_image_free);
 	if (!nii1) {
-		fprintf(stderr, "** failed to read NIfTI from '%s'.\n", resource_path + "dti_FA.nii");
-		//return 2;
+		std::cout << "Warning: failed to read NIfTI from " << fa_file_name << std::endl;
+		return;
 	}
 	
 	//read md data
-	nifti_image* nii2 = nifti_image_read((resource_path + "dti_MD.nii").c_str(), 1);
-	float* ptrdata_md = (float*)nii2->data;
+	nifti_image_ptr nii2(nifti_image_read(get_volume_file_name("dti_MD").c_str(), 1), nifti_image_free);
 	
-	// Get dimensions of input
-	int size_x = nii1->nx;
-	int size_y = nii1->ny;
-	int size_z = nii1->nz;
-	int size_time = nii1->nt;
-	int nx = nii1->nx;
-	int nxy = nii1->nx * nii1->ny;
-	int nxyz = nii1->nx * nii1->ny * nii1->nz;
-	int nr_voxels = size_time * size_z * size_y * size_x;
-	float* ptrdata = (float*)nii1->data;
-
-	//check fa data
-	float fa_max = 0;
-	float fa_avr = 0;
-	for (int i = 0; i < nr_voxels; i++) {
-		fa_avr = fa_avr + ptrdata[i];
-		if (ptrdata[i] > fa_max) {
-			fa_max = ptrdata[i];
+	// Statistics of the brain voxels, the background outside of the brain mask is 0. FA lies in [0, 1], the
+	// histogram of MD is fitted to its values in the same pass.
+	util::volume_statistics fa_stats = util::compute_statistics(nii1.get(), 256u, true, 0.0f, 1.0f);
+	std::cout << "FA: mean " << fa_stats.mean << ", standard deviation " << std::sqrt(fa_stats.variance)
+		<< ", range " << fa_stats.min << " - " << fa_stats.max << std::endl;
+
+	if (nii2) {
+		util::volume_statistics md_stats = util::compute_statistics(nii2.get(), 256u, true);
+		std::cout << "MD: mean " << md_stats.mean << ", standard deviation " << std::sqrt(md_stats.variance)
+			<< ", range " << md_stats.min << " - " << md_stats.max << std::endl;
+	}
+
+	// The window maps the FA values between the 0.5th and 99.5th percentile to the full range of the transfer
+	// function and the color maps, so a few outliers do not compress the contrast of the other voxels
+	fa_window = vec2(fa_stats.percentile(0.005f), fa_stats.percentile(0.995f));
+	if(!(fa_window[1] > fa_window[0]))
+		fa_window = vec2(0.0f, 1.0f);
+
+	std::cout << "FA window: " << fa_window[0] << " - " << fa_window[1] << std::endl;
+
+	// The scalar color mapping samples the FA volume at the point positions through its sform or qform
+	if(!fa_sampler.set_nifti(nii1.get())) {
+		std::cout << "Warning: unsupported data type in the FA volume" << std::endl;
+		return;
+	}
+
+	// Trim the empty space around the brain, so the volume aligns with the tract geometry. The sampler holds
+	// the FA values converted to float, which works for any data type of the file.
+	const std::vector<float>& fa = fa_sampler.get_data();
+	const uvec3 fa_res = fa_sampler.get_resolution();
+
+	util::voxel_extent extent = util::find_nonzero_extent(fa.data(), fa_res);
+	if(extent.empty)
+		extent = util::voxel_extent(fa_res);
+
+	std::cout << "FA crop: " << extent.min << " - " << extent.max << " of " << fa_res << std::endl;
+
+	// The FA and the other .nii volumes define their up axis as z. This does not
+	// coincide with the OpenGL standard, where the y axis points upwards. To remedy
+	// this y and z are swapped while copying the cropped voxels into the texture data.
+	const util::axis_permutation permutation = util::axis_permutation::swap_yz();
+	util::permute_axes(fa.data(), fa_res, extent, permutation, fa_tex.data);
+	fa_tex.resolution = permutation.apply(extent.get_size());
+
+	// Apply the window, the background stays at 0
+	const float window_offset = fa_window[0];
+	const float window_scale = 1.0f / (fa_window[1] - fa_window[0]);
+	util::parallel_for(fa_tex.data.size(), [&](size_t begin, size_t end) {
+		for(size_t i = begin; i < end; ++i)
+			fa_tex.data[i] = cgv::math::clamp((fa_tex.data[i] - window_offset) * window_scale, 0.0f, 1.0f);
+	});
+}
+
+/*
+	Builds the segment index. The points of a tract 1 -> 2 -> 3 -> 4 form the segments 1,2 2,3 3,4, which
+	are stored as the index of their first point only, so all per-point data is shared between neighbouring
+	segments. Additionally computes the index of the first segment of every tract and the clipping flags of
+	every segment. The segment offsets are a prefix sum over the segment counts, then every tract fills its
+	own range of the index in parallel. The GPU buffers address points with 32 bit indices, datasets with
+	more points are rejected and false is returned.
+*/
+bool fiber_viewer::build_segment_index() {
+
+	// Leave room for the padding of the segment count in the GPU sorter
+	const size_t max_point_count = (size_t)std::numeric_limits<unsigned>::max() - 1024u;
+	if(dataset.point_count() > max_point_count) {
+		std::cout << "Error: the dataset has " << dataset.point_count() << " points, but at most " << max_point_count
+			<< " can be rendered with 32 bit indices. Split it into several files!" << std::endl;
+		segment_offsets.clear();
+		segment_indices.clear();
+		segment_clip_bits.clear();
+		return false;
+	}
+
+	const std::vector<tract>& tracts = dataset.tracts;
+	segment_offsets.resize(tracts.size());
+
+	size_t segment_count = 0;
+	for(size_t i = 0; i < tracts.size(); ++i) {
+		segment_offsets[i] = segment_count;
+		segment_count += tracts[i].size > 1 ? (size_t)tracts[i].size - 1 : 0;
+	}
+
+	segment_indices.resize(segment_count);
+
+	// Two clipping bits per segment addressed by the index of its first point, packed into 32 bit words.
+	// Bit 0 is set if the segment has a predecessor and bit 1 if it has a successor in the same tract.
+	// Clipping removes internal overlapping structures of transparent tubes.
+	// The container uses 64 bit offsets, the point count was checked to fit the 32 bit indices.
+	const size_t word_count = (dataset.point_count() + 15) / 16;
+	segment_clip_bits.assign(word_count, 0u);
+
+	// Neighbouring tracts can share the words at their ends, these are combined atomically
+	std::unique_ptr<std::atomic<unsigned>[]> shared_bits(new std::atomic<unsigned>[word_count]);
+	for(size_t w = 0; w < word_count; ++w)
+		shared_bits[w].store(0u, std::memory_order_relaxed);
+
+	util::parallel_for_stealing(tracts.size(), 64, [&](size_t begin, size_t end) {
+		for(size_t i = begin; i < end; ++i) {
+			size_t o = tracts[i].offset;
+			size_t s = tracts[i].size;
+			size_t k = segment_offsets[i];
+
+			if(s < 2)
+				continue;
+
+			unsigned bits = 0u;
+			for(size_t j = o; j + 1 < o + s; ++j, ++k) {
+				segment_indices[k] = (unsigned)j;
+
+				unsigned b = 0u;
+				if(j > o)
+					b |= 0x01u;
+				if(j + 2 < o + s)
+					b |= 0x02u;
+
+				bits |= b << (2 * (j % 16));
+
+				// Flush at the end of a word or of the tract, only words within the tract are written directly
+				if(j % 16 == 15 || j + 2 == o + s) {
+					size_t w = j / 16;
+					if(w * 16 >= o && w * 16 + 16 <= o + s)
+						segment_clip_bits[w] = bits;
+					else
+						shared_bits[w].fetch_or(bits, std::memory_order_relaxed);
+					bits = 0u;
+				}
+			}
 		}
+	});
+
+	util::parallel_for(word_count, [&](size_t begin, size_t end) {
+		for(size_t w = begin; w < end; ++w)
+			segment_clip_bits[w] |= shared_bits[w].load(std::memory_order_relaxed);
+	});
+
+	return true;
+}
+
+/*
+	Allocates the per-point color array of the given source with its final size, so prepare_colors can fill
+	arbitrary tract ranges in place and finished ranges can be read while other ranges are still being prepared.
+	The attribute colors stay empty if the dataset has no attribute scalar.
+*/
+void fiber_viewer::allocate_color_data(ColorSource source) {
+
+	size_t n = dataset.point_count();
+
+	// All scalar color sources share the per-point FA values
+	if(get_scalar_colormap(source)) {
+		point_scalars.resize(n);
+		return;
 	}
-	fa_avr = fa_avr / nr_voxels;
-	
-	//check md data
-	float md_min = 1;
-	float md_max = 0;
-	float md_scale;
-	for (int i = 0; i < nr_voxels; i++) {
-		if (ptrdata_md[i] > md_max) {
-			md_max = ptrdata_md[i];
+
+	if(source == CS_ATTRIBUTE && get_raw_attributes().size() != n)
+		color_arrays[source].clear();
+	else
+		color_arrays[source].resize(n);
+}
+
+/*
+	Returns the color map of the scalar color sources that map the FA value, nullptr for all other sources.
+*/
+const util::colormap* fiber_viewer::get_scalar_colormap(ColorSource source) const {
+
+	switch(source) {
+	case CS_COOLWARM: return coolwarm_colormap;
+	case CS_EXTENDED_KINDLMANN: return extended_kindlmann_colormap;
+	case CS_EXTENDED_BLACKBODY: return extended_blackbody_colormap;
+	case CS_BLACKBODY: return blackbody_colormap;
+	case CS_ISORAINBOW: return isorainbow_colormap;
+	default: return nullptr;
+	}
+}
+
+/*
+	Prepares the per-point colors of the given source for the tracts in [first, last). The scalar color sources
+	only store the FA value of every point, which is mapped to a color on the GPU. Positions and radii are
+	rendered directly from the dataset through the segment index. The array must have been allocated with
+	allocate_color_data before and every tract only writes to the range of its own points.
+*/
+void fiber_viewer::prepare_colors(ColorSource source, size_t first, size_t last) {
+
+	if(!has_color_data(source) || first >= last)
+		return;
+
+	std::vector<rgba>& colors = color_arrays[source];
+
+	const std::vector<tract>& tracts = dataset.tracts;
+	const util::span<const float> x = dataset.x_span();
+	const util::span<const float> y = dataset.y_span();
+	const util::span<const float> z = dataset.z_span();
+	const util::span<const float> raw_attributes = get_raw_attributes();
+
+	auto position = [&](size_t j) { return vec3(x[j], y[j], z[j]); };
+
+	// Every tract only writes to the range of its own points, so the tracts are prepared in parallel in a single
+	// pass each. Tract lengths differ by orders of magnitude, the work-stealing loop keeps all threads busy.
+	util::parallel_for_stealing(last - first, 16, [&](size_t begin, size_t end) {
+		// Segment directions of the Boy's surface colors and sampled FA values, gathered in blocks and mapped in batches
+		const size_t block_size = 1024;
+		std::vector<float> directions;
+		std::vector<float> fa_values;
+		const float window_offset = fa_window[0];
+		const float window_scale = 1.0f / (fa_window[1] - fa_window[0]);
+
+		for(size_t i = first + begin; i < first + end; ++i) {
+			size_t o = tracts[i].offset;
+			size_t s = tracts[i].size;
+
+			if(s < 2 && source != CS_ATTRIBUTE)
+				continue;
+
+			switch(source) {
+			case CS_MIDPOINT:
+			{
+				size_t mid = o + s / 2;
+				if(s % 2 == 0)
+					mid -= 1;
+
+				// The midpoint color is the direction of the middle segment
+				vec3 dir = normalize(position(mid) - position(mid + 1));
+				dir.abs();
+				rgba color(dir[0], dir[2], dir[1], 1.0f);
+
+				for(size_t j = o; j < o + s; ++j)
+					colors[j] = color;
+			}
+			break;
+			case CS_SEGMENT:
+				for(size_t j = o; j < o + s; ++j) {
+					// The segment color is the tangent direction at each point
+					vec3 dir;
+					if(j == o)
+						dir = normalize(position(j + 1) - position(j));
+					else if(j == o + s - 1)
+						dir = normalize(position(j) - position(j - 1));
+					else
+						dir = normalize(position(j + 1) - position(j - 1));
+
+					dir.abs();
+					colors[j] = rgba(dir[0], dir[2], dir[1], 1.0f);
+				}
+				break;
+			case CS_COOLWARM:
+			case CS_EXTENDED_KINDLMANN:
+			case CS_EXTENDED_BLACKBODY:
+			case CS_BLACKBODY:
+			case CS_ISORAINBOW:
+				//Scalar Colormapping
+				fa_values.resize(block_size);
+
+				for(size_t b = o; b < o + s; b += block_size) {
+					size_t count = std::min(block_size, o + s - b);
+					util::span<float> values(fa_values.data(), count);
+
+					// Trilinear FA at the point positions, points outside of the volume get 0
+					fa_sampler.sample(x.subspan(b, count), y.subspan(b, count), z.subspan(b, count), values);
+
+					// Normalize with the FA window, so the color map covers the values that actually occur
+					for(size_t j = 0; j < count; ++j) {
+						float fa = cgv::math::clamp((values[j] - window_offset) * window_scale, 0.0f, 1.0f);
+						point_scalars[b + j] = static_cast<uint16_t>(fa * 65535.0f + 0.5f);
+					}
+				}
+				//Scalar Colormapping
+				break;
+			case CS_BOYS:
+				//Alaleh's boy's surface
+				directions.resize(3 * block_size);
+
+				for(size_t b = o; b < o + s; b += block_size) {
+					size_t count = std::min(block_size, o + s - b);
+					float* dx = directions.data();
+					float* dy = dx + block_size;
+					float* dz = dy + block_size;
+
+					for(size_t j = 0; j < count; ++j) {
+						// Every point takes the color of the segment starting at it, the last point that of the last segment
+						size_t k = b + j < o + s - 1 ? b + j : b + j - 1;
+						dx[j] = x[k + 1] - x[k];
+						dy[j] = y[k + 1] - y[k];
+						dz[j] = z[k + 1] - z[k];
+					}
+
+					util::boys_surface_colors(util::span<const float>(dx, count), util::span<const float>(dy, count), util::span<const float>(dz, count), util::span<rgba>(colors).subspan(b, count));
+				}
+				//Alaleh's boy's surface
+				break;
+			case CS_ATTRIBUTE:
+				// Maps the selected attribute scalar through the attribute color map
+				attribute_colormap->map(raw_attributes.subspan(o, s), util::span<rgba>(colors).subspan(o, s));
+				break;
+			default:
+				break;
+			}
 		}
-		if (ptrdata_md[i] < md_min) {
-			md_min = ptrdata_md[i];
+	});
+}
+
+/*
+	Returns whether the array of the given source is allocated for all points of the dataset.
+*/
+bool fiber_viewer::has_color_data(ColorSource source) const {
+
+	size_t n = dataset.point_count();
+
+	if(get_scalar_colormap(source))
+		return point_scalars.size() == n;
+
+	return color_arrays[source].size() == n;
+}
+
+/*
+	Makes sure the colors of the given source are prepared and marks them as most recently used. Prepares
+	them for all tracts if they are not resident and evicts other sources that no longer fit into the
+	memory budget. Returns whether colors are available.
+*/
+bool fiber_viewer::ensure_color_data(ColorSource source) {
+
+	color_array_last_use[source] = ++color_use_counter;
+
+	size_t n = dataset.point_count();
+	if(n == 0)
+		return false;
+
+	if(!has_color_data(source)) {
+		util::timer t;
+
+		allocate_color_data(source);
+		prepare_colors(source, 0, dataset.tract_count());
+
+		t.stop();
+		std::cout << "Prepared colors of source " << (int)source << " in " << t.seconds() << "s" << std::endl;
+	}
+
+	evict_color_data(source);
+
+	return has_color_data(source);
+}
+
+/*
+	Releases the least recently used color arrays until all resident arrays fit into color_cache_budget.
+	The given source and the source on the GPU are never released.
+*/
+void fiber_viewer::evict_color_data(ColorSource keep) {
+
+	const size_t budget = (size_t)color_cache_budget * 1024 * 1024;
+
+	size_t size = get_color_data_size();
+	while(size > budget) {
+		int lru = -1;
+		for(int i = 0; i < CS_COUNT; ++i) {
+			if(i == keep || i == prepared_color_source || color_arrays[i].empty())
+				continue;
+			if(lru < 0 || color_array_last_use[i] < color_array_last_use[lru])
+				lru = i;
 		}
-	}
-	md_scale = md_max - md_min;
 
-	std::cout << "=============AVR=FA===============: " << fa_avr << std::endl;
-	std::cout << "=============MAX=FA===============: " << fa_max << std::endl;
+		if(lru < 0)
+			break;
 
+		size -= color_arrays[lru].size() * sizeof(rgba);
+		std::vector<rgba>().swap(color_arrays[lru]);
+	}
+}
 
-	// The FA and the other .nii volumes define their up axis as z. This does not
-	// coincide with the OpenGL standard, where the y axis points upwards. To remedy
-	// this we need to flip y and z in the volume data. While flipping we read the
-	// data from the nifti_image object and write it into a vector that we use to
-	// fill a texture (fa_tex) for alter display.
-	fa_tex.texture.clear();
-	fa_tex.data.resize(nr_voxels);
-
-	for(unsigned i = 0; i < nr_voxels; ++i) {
-		uvec3 coord = util::idx2coord(i, ivec3(size_x, size_z, size_y));
-		std::swap(coord[1], coord[2]);
-		unsigned idx = util::coord2idx(coord, ivec3(size_x, size_y, size_z));
-
-		// This creates an outer shell around the volume data to visualize the boundaries.
-		// You can remove this once you have finished trimming off the empty regions.
-		// TODO: remove
-		//if(	coord[0] == 0 || coord[0] == size_x - 1 ||
-		//	coord[1] == 0 || coord[1] == size_y - 1 ||
-		//	coord[2] == 0 || coord[2] == size_z - 1)
-		//show the cutting box, all the data get from following cutting algorithm
-		if (coord[0] == 24 || coord[0] == 93 ||
-			coord[1] == 11 || coord[1] == 92 ||
-			coord[2] == 1 || coord[2] == 76)
-			fa_tex.data[i] = 0.2f;
-		else
-			fa_tex.data[i] = ptrdata[idx];
-		// end remove
-
-		// TODO: enable
-		//fa_tex.data[i] = ptrdata[idx];
-	}
-
-	// We flipped the values so now we also need to flip the size in y and z direction
-	std::swap(size_y, size_z);
-
-	// TODO: Trim the empty volume space.
-	// Open the program and load the brain.trk file. Tahke a look at the shape of the brain
-	// and switch the render mdoe to "volume". You should see a rendering of the loaded fa_dti
-	// volume data with a highlighted shell, which shows the bounding box. Notice how the brain
-	// shapes of the tubes and this volume are different. There is lots of empty space around
-	// the brain which needs to be removed in order to align the volume data with the tract geometry
-	// as good as possible. Implement an algorithm which removes this empty space on all coordinate
-	// axes and then remove the code for creating the boundig box shell in the prevoius loop. You
-	// can use a temporary vector to hold the new data and write it back to the texture data once
-	// finished. Make sure to set the size to the new parameters.
-
-	// !implement here!
-	float max_x_coor = 0;
-	unsigned max_x_idx;
-	float min_x_coor = 116;
-	unsigned min_x_idx;
-	float max_y_coor = 0;
-	unsigned max_y_idx;
-	float min_y_coor = 116;
-	unsigned min_y_idx;
-	float max_z_coor = 0;
-	unsigned max_z_idx;
-	float min_z_coor = 80;
-	unsigned min_z_idx;
-	for (unsigned i = 0; i < nr_voxels; ++i) {
-		if (ptrdata[i] != 0) {
-			uvec3 coord_fa = util::idx2coord(i, ivec3(size_x, size_z, size_y));//116,116,80
-			if (coord_fa[0]> max_x_coor) {
-				max_x_coor = coord_fa[0];
-				max_x_idx = i;
-			}
-			if (coord_fa[1] > max_y_coor) {
-				max_y_coor = coord_fa[1];
-				max_y_idx = i;
-			}
-			if (coord_fa[2] > max_z_coor) {
-				max_z_coor = coord_fa[2];
-				max_z_idx = i;
-			}
-			if (coord_fa[0] < min_x_coor) {
-				min_x_coor = coord_fa[0];
-				min_x_idx = i;
-			}
-			if (coord_fa[1] < min_y_coor) {
-				min_y_coor = coord_fa[1];
-				min_y_idx = i;
-			}
-			if (coord_fa[2] < min_z_coor) {
-				min_z_coor = coord_fa[2];
-				min_z_idx = i;
-			}
-		}
+/*
+	Returns the number of bytes occupied by all resident color arrays and the point scalars.
+*/
+size_t fiber_viewer::get_color_data_size() const {
 
-	}
-	std::cout << "min_x_coor:" << min_x_coor <<"," << "min_x_idx:" << min_x_idx << "," << "max_x_coor:" << max_x_coor << "," << "max_x_idx:" << max_x_idx <<  std::endl;
-	std::cout << "min_y_coor:" << min_y_coor << "," << "min_y_idx:" << min_y_idx << "," << "max_y_coor:" << max_y_coor << "," << "max_y_idx:" << max_y_idx << std::endl;
-	std::cout << "min_z_coor:" << min_z_coor << "," << "min_z_idx:" << min_z_idx << "," << "max_z_coor:" << max_z_coor << "," << "max_z_idx:" << max_z_idx << std::endl;
-	
-	//cut box
-	std::vector<float> fa_new;
-	for (unsigned i = 0; i < nr_voxels; ++i) {
-		uvec3 coord = util::idx2coord(i, ivec3(size_x, size_z, size_y));//(116,116,80)
-		if (coord[0] >= 24 && coord[0] <= 93 &&
-			coord[1] >= 11 && coord[1] <= 92 &&
-			coord[2] >= 1 && coord[2] <= 76) {
-			fa_new.push_back(ptrdata[i]);//md: change "ptrdata[i]" to "(ptrdata_md[i]-md_min)/md_scale"
-		}
-	}
-	//std::cout << "fa_new size:" << fa_new.size() << std::endl;
+	size_t size = point_scalars.size() * sizeof(uint16_t);
+	for(int i = 0; i < CS_COUNT; ++i)
+		size += color_arrays[i].size() * sizeof(rgba);
 
+	return size;
+}
 
+/*
+	Uploads the prepared data to the GPU and sets it in the renderer.
+*/
+void fiber_viewer::upload_data(context& ctx) {
 
 	// Set the volume transformation parameters to match the bounding box
 	mat4 vol_transformation = cgv::math::translate4(dataset_bbox.get_min_pnt()) * cgv::math::scale4(dataset_bbox.get_extent());
 	vstyle.transformation_matrix = vol_transformation;
 
 	// Set some texture informations
-	fa_tex.connect(new cgv::data::data_format(size_x, size_y, size_z, cgv::type::info::TypeId::TI_FLT32, cgv::data::ComponentFormat::CF_R));
+	fa_tex.texture.clear();
+	fa_tex.connect(new cgv::data::data_format(fa_tex.resolution[0], fa_tex.resolution[1], fa_tex.resolution[2], cgv::type::info::TypeId::TI_FLT32, cgv::data::ComponentFormat::CF_R));
 	fa_tex.texture.create(ctx, fa_tex.view, 0);
 	fa_tex.texture.set_min_filter(TF_LINEAR_MIPMAP_LINEAR);
 	fa_tex.texture.set_mag_filter(TF_LINEAR);
@@ -745,368 +1424,180 @@ void fiber_viewer::prepare_data(context& ctx) {
 	fa_tex.texture.set_border_color(0.0f, 0.0f, 0.0f, 0.0f);
 	fa_tex.texture.generate_mipmaps(ctx);
 
+	gpu_buffers_compact = compact_buffers;
 
+	const size_t point_count = dataset.point_count();
+	// Buffer sizes are rounded up to whole 32 bit words for the shader storage buffers
+	const size_t position_bytes = (point_count * (gpu_buffers_compact ? 3 * sizeof(uint16_t) : sizeof(vec3)) + 3) / 4 * 4;
 
+	// Quantized positions cover the dataset bounding box, the shaders map them back with offset and scale
+	const vec3 position_offset = gpu_buffers_compact ? dataset_bbox.get_min_pnt() : vec3(0.0f);
+	const vec3 position_scale = gpu_buffers_compact ? dataset_bbox.get_extent() : vec3(1.0f);
 
+	tr.set_position_quantization(position_offset, position_scale);
+	sorter.set_position_quantization(gpu_buffers_compact, position_offset, position_scale);
 
-
-
-	rgba col5[8];
-	col5[0] = rgba(0.3f, 0.3f, 0.8f, 1.0f);
-	col5[1] = rgba(0.5f, 0.5f, 0.9f, 1.0f);
-	col5[2] = rgba(0.6f, 0.7f, 1.0f, 1.0f);
-	col5[3] = rgba(0.8f, 0.8f, 0.9f, 1.0f);
-	col5[4] = rgba(0.9f, 0.8f, 0.8f, 1.0f);
-	col5[5] = rgba(0.9f, 0.7f, 0.5f, 1.0f);
-	col5[6] = rgba(0.9f, 0.4f, 0.3f, 1.0f);
-	col5[7] = rgba(0.7f, 0.0f, 0.2f, 1.0f);
-
-	
-
-	util::linear_interpolator coolwarm_colormap;
-	coolwarm_colormap.values.clear();
-	coolwarm_colormap.values.push_back(col5[0]);
-	coolwarm_colormap.values.push_back(col5[1]);
-	coolwarm_colormap.values.push_back(col5[2]);
-	coolwarm_colormap.values.push_back(col5[3]);
-	coolwarm_colormap.values.push_back(col5[4]);
-	coolwarm_colormap.values.push_back(col5[5]);
-	coolwarm_colormap.values.push_back(col5[6]);
-	coolwarm_colormap.values.push_back(col5[7]);
-
-
-	rgba col6[8];
-	col6[0] = rgba(0.0f, 0.0f, 0.0f, 1.0f);
-	col6[1] = rgba(0.2f, 0.0f, 0.5f, 1.0f);
-	col6[2] = rgba(0.0f, 0.3f, 0.2f, 1.0f);
-	col6[3] = rgba(0.2f, 0.5f, 0.0f, 1.0f);
-	col6[4] = rgba(0.9f, 0.4f, 0.0f, 1.0f);
-	col6[5] = rgba(1.0f, 0.5f, 0.8f, 1.0f);
-	col6[6] = rgba(0.9f, 0.8f, 1.0f, 1.0f);
-	col6[7] = rgba(1.0f, 1.0f, 1.0f, 1.0f);
-
-
-	util::linear_interpolator extended_kindlmann_colormap;
-	extended_kindlmann_colormap.values.clear();
-	extended_kindlmann_colormap.values.push_back(col6[0]);
-	extended_kindlmann_colormap.values.push_back(col6[1]);
-	extended_kindlmann_colormap.values.push_back(col6[2]);
-	extended_kindlmann_colormap.values.push_back(col6[3]);
-	extended_kindlmann_colormap.values.push_back(col6[4]);
-	extended_kindlmann_colormap.values.push_back(col6[5]);
-	extended_kindlmann_colormap.values.push_back(col6[6]);
-	extended_kindlmann_colormap.values.push_back(col6[7]);
-
-	rgba coleb[8];
-	coleb[0] = rgba(0.0f, 0.0f, 0.0f, 1.0f);
-	coleb[1] = rgba(0.2f, 0.0f, 0.3f, 1.0f);
-	coleb[2] = rgba(0.4f, 0.1f, 0.4f, 1.0f);
-	coleb[3] = rgba(0.6f, 0.2f, 0.4f, 1.0f);
-	coleb[4] = rgba(0.8f, 0.3f, 0.3f, 1.0f);
-	coleb[5] = rgba(0.9f, 0.5f, 0.1f, 1.0f);
-	coleb[6] = rgba(0.9f, 0.8f, 0.1f, 1.0f);
-	coleb[7] = rgba(1.0f, 1.0f, 0.6f, 1.0f);
-
-	util::linear_interpolator extended_blackbody_colormap;
-	extended_blackbody_colormap.values.clear();
-	extended_blackbody_colormap.values.push_back(coleb[0]);
-	extended_blackbody_colormap.values.push_back(coleb[1]);
-	extended_blackbody_colormap.values.push_back(coleb[2]);
-	extended_blackbody_colormap.values.push_back(coleb[3]);
-	extended_blackbody_colormap.values.push_back(coleb[4]);
-	extended_blackbody_colormap.values.push_back(coleb[5]);
-	extended_blackbody_colormap.values.push_back(coleb[6]);
-	extended_blackbody_colormap.values.push_back(coleb[7]);
-
-	rgba colbb[8];
-	colbb[0] = rgba(0.0f, 0.0f, 0.0f, 1.0f);
-	colbb[1] = rgba(0.2f, 0.1f, 0.0f, 1.0f);
-	colbb[2] = rgba(0.5f, 0.1f, 0.1f, 1.0f);
-	colbb[3] = rgba(0.7f, 0.2f, 0.1f, 1.0f);
-	colbb[4] = rgba(0.9f, 0.4f, 0.0f, 1.0f);
-	colbb[5] = rgba(0.9f, 0.6f, 0.0f, 1.0f);
-	colbb[6] = rgba(0.9f, 0.8f, 0.2f, 1.0f);
-	colbb[7] = rgba(1.0f, 1.0f, 1.0f, 1.0f);
-
-
-	util::linear_interpolator blackbody_colormap;
-	blackbody_colormap.values.clear();
-	blackbody_colormap.values.push_back(colbb[0]);
-	blackbody_colormap.values.push_back(colbb[1]);
-	blackbody_colormap.values.push_back(colbb[2]);
-	blackbody_colormap.values.push_back(colbb[3]);
-	blackbody_colormap.values.push_back(colbb[4]);
-	blackbody_colormap.values.push_back(colbb[5]);
-	blackbody_colormap.values.push_back(colbb[6]);
-	blackbody_colormap.values.push_back(colbb[7]);
-	
-
-	rgba colrb[7];
-	colrb[0] = rgba(1.0f, 0.0f, 0.0f, 1.0f);
-	colrb[1] = rgba(1.0f, 0.5f, 0.0f, 1.0f);
-	colrb[2] = rgba(1.0f, 1.0f, 1.0f, 1.0f);
-	colrb[3] = rgba(0.0f, 1.0f, 0.0f, 1.0f);
-	colrb[4] = rgba(0.0f, 0.0f, 1.0f, 1.0f);
-	colrb[5] = rgba(0.2f, 0.2f, 0.4f, 1.0f);
-	colrb[6] = rgba(0.5f, 0.0f, 1.0f, 1.0f);
-
-	util::linear_interpolator isorainbow_colormap;
-	isorainbow_colormap.values.clear();
-	isorainbow_colormap.values.push_back(colrb[0]);
-	isorainbow_colormap.values.push_back(colrb[1]);
-	isorainbow_colormap.values.push_back(colrb[2]);
-	isorainbow_colormap.values.push_back(colrb[3]);
-	isorainbow_colormap.values.push_back(colrb[4]);	
-	isorainbow_colormap.values.push_back(colrb[5]);
-	isorainbow_colormap.values.push_back(colrb[6]);
-
-
-	for (unsigned i = 0; i < tracts.size(); ++i) {
-		int o = tracts[i].offset;
-		int s = tracts[i].size;		
-
-		for (unsigned j = o; j < o + s - 1; ++j) {
-			vec3 a = raw_positions[j];
-			vec3 b = raw_positions[j + 1];
-			float fa;
-			float md;
-
-			//ivec3 fa_index_a = ivec3(int(raw_positions[j].x() * (116 / 26.9)), int(raw_positions[j].y() * (116 / 27.9)), int(raw_positions[j].z() * (80 / 32.2)));
-			//ivec3 fa_index_b = ivec3(int(raw_positions[j+1].x() * (116 / 26.9)), int(raw_positions[j+1].y() * (116 / 27.9)), int(raw_positions[j+1].z() * (80 / 32.2)));
-			//ivec3 fa_index_a = ivec3(int(raw_positions[j].x() * (116 / dataset_bbox.ref_max_pnt().x())), int(raw_positions[j].z() * (116 / dataset_bbox.ref_max_pnt().z())), int(raw_positions[j].y() * (80 / dataset_bbox.ref_max_pnt().y())));
-			//ivec3 fa_index_b = ivec3(int(raw_positions[j+1].x() * (116 / dataset_bbox.ref_max_pnt().x())), int(raw_positions[j+1].z() * (116 / dataset_bbox.ref_max_pnt().z())), int(raw_positions[j+1].y() * (80 / dataset_bbox.ref_max_pnt().y())));
-			//int m = fa_index_a.x() + fa_index_a.y() * 116 + fa_index_a.z()*116*116;
-			//int n = fa_index_b.x() + fa_index_b.y() * 116 + fa_index_b.z()*116*116;
-			ivec3 fa_index_a = ivec3(int(raw_positions[j].x() * (70 / dataset_bbox.ref_max_pnt().x())), int(raw_positions[j].z() * (82 / dataset_bbox.ref_max_pnt().z())), int(raw_positions[j].y() * (76 / dataset_bbox.ref_max_pnt().y())));
-			ivec3 fa_index_b = ivec3(int(raw_positions[j + 1].x() * (70 / dataset_bbox.ref_max_pnt().x())), int(raw_positions[j + 1].z() * (82 / dataset_bbox.ref_max_pnt().z())), int(raw_positions[j + 1].y() * (76 / dataset_bbox.ref_max_pnt().y())));
-			int m = fa_index_a.x() + fa_index_a.y() * 70 + fa_index_a.z() * 70 * 82;
-			int n = fa_index_b.x() + fa_index_b.y() * 70 + fa_index_b.z() * 70 * 82;
-			fa = (ptrdata[m] + ptrdata[n]) / 2;
-			md = (ptrdata_md[m] + ptrdata_md[n]-2* md_min)/md_scale/2;
-			float alphamd = md*100;//md is very small, and there is negative value. almost -0.001 to 0.003.
-			
-			//if (alpha > 1) {
-			//	alpha = 1;
-			//}
-
-			//if (j <= nii1->nvox) {
-				//fa = (ptrdata[j + 1] + ptrdata[j]) / 2;
-
-				float alpha = (float)(fa / fa_max); //if you want to change to md image: float alpha = alphamd;
-
-				//rgba color = coolwarm_colormap.interpolate(alpha);
-				rgba color_a = coolwarm_colormap.interpolate(fa_new[m]);
-				rgba color_b = coolwarm_colormap.interpolate(fa_new[n]);
-				colors_coolwarm.push_back(color_a);
-				colors_coolwarm.push_back(color_b);
-
-				//rgba color2 = extended_kindlmann_colormap.interpolate(alpha);
-				rgba color_a2 = extended_kindlmann_colormap.interpolate(fa_new[m]);
-				rgba color_b2 = extended_kindlmann_colormap.interpolate(fa_new[n]);
-				colors_extended_kindlmann.push_back(color_a2);
-				colors_extended_kindlmann.push_back(color_b2);
-
-				//rgba color3 = extended_blackbody_colormap.interpolate(alpha);
-				rgba color_a3 = extended_blackbody_colormap.interpolate(fa_new[m]);
-				rgba color_b3 = extended_blackbody_colormap.interpolate(fa_new[n]);
-				colors_extended_blackbody.push_back(color_a3);
-				colors_extended_blackbody.push_back(color_b3);
-
-				//rgba color4 = blackbody_colormap.interpolate(alpha);
-				rgba color_a4 = blackbody_colormap.interpolate(fa_new[m]);
-				rgba color_b4 = blackbody_colormap.interpolate(fa_new[n]);
-				colors_blackbody.push_back(color_a4);
-				colors_blackbody.push_back(color_b4);
-
-				//rgba color5 = isorainbow_colormap.interpolate(alpha);
-				rgba color_a5 = isorainbow_colormap.interpolate(fa_new[m]);
-				rgba color_b5 = isorainbow_colormap.interpolate(fa_new[n]);
-				colors_isorainbow.push_back(color_a5);
-				colors_isorainbow.push_back(color_b5);
-			//}
-			
-		}
+	// The renderer expects interleaved positions. They are written straight from the coordinate
+	// columns into the mapped vertex buffer, so no interleaved copy is ever kept on the host.
+	tr.set_render_style(tstyle);
+	GLuint position_vbo = tr.create_position_buffer(ctx, point_count, gpu_buffers_compact);
+
+	glBindBuffer(GL_ARRAY_BUFFER, position_vbo);
+	void* mapped_positions = glMapBufferRange(GL_ARRAY_BUFFER, 0, position_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if(mapped_positions) {
+		util::parallel_for(point_count, [&](size_t begin, size_t end) {
+			if(gpu_buffers_compact)
+				dataset.quantize_positions(begin, end - begin, position_offset, position_scale, (uint16_t*)mapped_positions + 3 * begin);
+			else
+				dataset.interleave_positions(begin, end - begin, (float*)mapped_positions + 3 * begin);
+		});
+		glUnmapBuffer(GL_ARRAY_BUFFER);
 	}
-	//Scalar Colormapping
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	//Alaleh's boy's surface
-	for (unsigned i = 0; i < tracts.size(); ++i) {
-		int o = tracts[i].offset;
-		int s = tracts[i].size;
+	// Create a shader storage buffer object to hold the data for the transparent tubes.
+	// We dont use vertex buffer objects here because we need access to the neighbouring
+	// segments during rendering. The positions are copied on the GPU from the vertex buffer.
+	glGenBuffers(1, &positions_ssbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, positions_ssbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, position_bytes, (void*)0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-		for (unsigned j = o; j < o + s - 1; ++j) {
+	glBindBuffer(GL_COPY_READ_BUFFER, position_vbo);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, positions_ssbo);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, position_bytes);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 
-			vec3 a = raw_positions[j];
-			vec3 b = raw_positions[j + 1];
-			float rgb_array[3];
-			float startPoint[3];
-			float endPoint[3];
-			for (int i = 0; i < 3; i++)
-			{
-				startPoint[i] = a[i];
-				endPoint[i] = b[i];
-			}
+	// Radii are a single column and are uploaded from the container without conversion
+	glGenBuffers(1, &radii_ssbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, radii_ssbo);
+	const util::span<const float> radii = dataset.radius_span();
+	glBufferData(GL_SHADER_STORAGE_BUFFER, radii.size() * sizeof(float), (void*)radii.data(), GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-			//normalization is done inside the function 
-			rp2ColorMapping(startPoint, endPoint, rgb_array);
+	if(dataset.has_radii())
+		tr.set_radius_array(ctx, radii.data(), radii.size());
 
-			rgba col4 = rgba(rgb_array[0], rgb_array[1], rgb_array[2], 1.0f);
-			colors_boys.push_back(col4);
-			colors_boys.push_back(col4);
+	glGenBuffers(1, &colors_ssbo);
+	glGenBuffers(1, &scalars_ssbo);
+	gpu_scalars_uploaded = false;
 
-		}
-	}	//Alaleh's boy's surface
+	// The segment index and clipping flags used by the sorter and the transparent tube shaders
+	glGenBuffers(1, &segments_ssbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, segments_ssbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, segment_indices.size() * sizeof(unsigned), (void*)segment_indices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
+	glGenBuffers(1, &clip_bits_ssbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, clip_bits_ssbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, segment_clip_bits.size() * sizeof(unsigned), (void*)segment_clip_bits.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-	if(raw_radii.size() == raw_positions.size()) {
-		for(unsigned i = 0; i < tracts.size(); ++i) {
-			int o = tracts[i].offset;
-			int s = tracts[i].size;
+	// Line index buffer with the two point indices of every segment in segment order. Sorting for
+	// transparent rendering rewrites it in visibility order.
+	std::vector<unsigned> line_indices(2 * segment_indices.size());
+	for(size_t i = 0; i < segment_indices.size(); ++i) {
+		line_indices[2 * i] = segment_indices[i];
+		line_indices[2 * i + 1] = segment_indices[i] + 1;
+	}
 
-			float last_radius = 0.0f;
+	glGenBuffers(1, &ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, line_indices.size() * sizeof(unsigned), (void*)line_indices.data(), GL_DYNAMIC_COPY);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-			for(unsigned j = o; j < o + s - 1; ++j) {
-				if(j == o)
-					last_radius = raw_radii[j];
+	upload_colors(ctx);
+}
 
-				radii.push_back(last_radius);
+/*
+	Deletes all per-dataset GPU buffers created by upload_data and create_index_buffers.
+*/
+void fiber_viewer::delete_gpu_buffers() {
 
-				last_radius = raw_radii[j + 1];
-				radii.push_back(last_radius);
-			}
-		}
+	if(segment_ibo > 0) {
+		glDeleteBuffers(1, &segment_ibo);
+		segment_ibo = 0;
 	}
 
-	if(raw_attributes.size() == raw_positions.size()) {
-		for(unsigned i = 0; i < tracts.size(); ++i) {
-			int o = tracts[i].offset;
-			int s = tracts[i].size;
-
-			rgba last_color(0.0f);
-
-			for(unsigned j = o; j < o + s - 1; ++j) {
-				if(j == o) {
-					float attr = raw_attributes[j];
-					attr = cgv::math::clamp(attr, 0.0f, 1.0f);
-					last_color = color_map.interpolate(attr);
-				}
+	if(ibo > 0) {
+		glDeleteBuffers(1, &ibo);
+		ibo = 0;
+	}
 
-				colors_attribute.push_back(last_color);
+	if(positions_ssbo > 0) {
+		glDeleteBuffers(1, &positions_ssbo);
+		positions_ssbo = 0;
+	}
 
-				float attr = raw_attributes[j + 1];
-				attr = cgv::math::clamp(attr, 0.0f, 1.0f);
-				last_color = color_map.interpolate(attr);
+	if(radii_ssbo > 0) {
+		glDeleteBuffers(1, &radii_ssbo);
+		radii_ssbo = 0;
+	}
 
-				colors_attribute.push_back(last_color);
-			}
-		}
+	if(colors_ssbo > 0) {
+		glDeleteBuffers(1, &colors_ssbo);
+		colors_ssbo = 0;
 	}
 
-	// Create a shader storage buffer object to hold the data for the transparent tubes.
-	// We dont use vertex buffer objects here because we need access to the neighbouring
-	// segments during rendering.
-	glGenBuffers(1, &positions_ssbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, positions_ssbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, tposs.size() * sizeof(vec3), (void*)tposs.data(), GL_DYNAMIC_COPY);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	if(scalars_ssbo > 0) {
+		glDeleteBuffers(1, &scalars_ssbo);
+		scalars_ssbo = 0;
+	}
+	gpu_scalars_uploaded = false;
 
-	glGenBuffers(1, &radii_ssbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, radii_ssbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, radii.size() * sizeof(float), (void*)radii.data(), GL_DYNAMIC_COPY);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	if(segments_ssbo > 0) {
+		glDeleteBuffers(1, &segments_ssbo);
+		segments_ssbo = 0;
+	}
 
-	glGenBuffers(1, &colors_ssbo);
+	if(clip_bits_ssbo > 0) {
+		glDeleteBuffers(1, &clip_bits_ssbo);
+		clip_bits_ssbo = 0;
+	}
 }
 
 /*
-	Traverses a line through a uniform 3D grid. returns a list containing pairs of grid cell index and intersection length.
+	Returns the number of bytes the per-dataset GPU buffers occupy in the float or the compact layout.
+	Positions, colors and point scalars are held twice, as vertex buffers for deferred rendering and as shader
+	storage buffers for transparent rendering.
 */
-std::vector<std::pair<int, float>> traverse_line(vec3& a, vec3& b, vec3& vbox_min, float vsize, ivec3& res) {
-
-	std::vector<std::pair<int, float>> intervals;
-
-	// Amanatides Woo line traversal algorithm
-	vec3 dir = normalize(vec3(b - a));
-	vec3 dt;
-	ivec3 step;
-	vec3 orig_grid = a - vbox_min;
-	vec3 dest_grid = b - vbox_min;
-	vec3 t(0.0f);
-	float ct = 0.0f;
-
-	for(unsigned i = 0; i < 3; ++i) {
-		float delta = vsize / dir[i];
-		if(dir[i] < 0.0f) {
-			dt[i] = -delta;
-			t[i] = (floor(orig_grid[i] / vsize) * vsize - orig_grid[i]) / dir[i];
-			step[i] = -1;
-		} else {
-			dt[i] = delta;
-			t[i] = ((floor(orig_grid[i] / vsize) + 1) * vsize - orig_grid[i]) / dir[i];
-			step[i] = 1;
-		}
-	}
+size_t fiber_viewer::get_gpu_buffer_size(bool compact) const {
 
-	ivec3 cell_idx(
-		(int)(floor(orig_grid.x() / vsize)),
-		(int)(floor(orig_grid.y() / vsize)),
-		(int)(floor(orig_grid.z() / vsize))
-	);
+	const size_t point_count = dataset.point_count();
+	const size_t segment_count = segment_indices.size();
 
-	ivec3 end_idx(
-		(int)(floor(dest_grid.x() / vsize)),
-		(int)(floor(dest_grid.y() / vsize)),
-		(int)(floor(dest_grid.z() / vsize))
-	);
+	size_t position_bytes = (point_count * (compact ? 3 * sizeof(uint16_t) : sizeof(vec3)) + 3) / 4 * 4;
+	size_t color_bytes = point_count * (compact ? sizeof(rgba8) : sizeof(rgba));
+	size_t radius_bytes = dataset.radii.size() * sizeof(float);
+	size_t scalar_bytes = gpu_scalars_uploaded ? (point_count * sizeof(uint16_t) + 3) / 4 * 4 : 0;
 
-	intervals.push_back(std::make_pair<int, float>(cell_idx[0] + res[0] * cell_idx[1] + res[0] * res[1] * cell_idx[2], 0.0f));
+	// Segment index, line and sorted segment index buffers and the clipping bits
+	size_t index_bytes = segment_count * 4 * sizeof(unsigned) + segment_clip_bits.size() * sizeof(unsigned);
 
-	vec3 p = orig_grid;
-	size_t idx = 0;
+	return 2 * (position_bytes + color_bytes + radius_bytes + scalar_bytes) + index_bytes;
+}
 
-	while(cell_idx != end_idx) {
-		if(t[0] < t[1]) {
-			if(t[0] < t[2]) {
-				cell_idx[0] += step[0];
-				if(cell_idx[0] < 0 || cell_idx[0] > res[0] - 1)
-					break;
-				p = orig_grid + t[0] * dir;
-				t[0] += dt[0];
-			} else {
-				cell_idx[2] += step[2];
-				if(cell_idx[2] < 0 || cell_idx[2] > res[2] - 1)
-					break;
-				p = orig_grid + t[2] * dir;
-				t[2] += dt[2];
-			}
-		} else {
-			if(t[1] < t[2]) {
-				cell_idx[1] += step[1];
-				if(cell_idx[1] < 0 || cell_idx[1] > res[1] - 1)
-					break;
-				p = orig_grid + t[1] * dir;
-				t[1] += dt[1];
-			} else {
-				cell_idx[2] += step[2];
-				if(cell_idx[2] < 0 || cell_idx[2] > res[2] - 1)
-					break;
-				p = orig_grid + t[2] * dir;
-				t[2] += dt[2];
-			}
-		}
+/*
+	Returns the scalar column selected as per-point attribute in load_params or an empty array if the dataset
+	has no scalars.
+*/
+util::span<const float> fiber_viewer::get_raw_attributes() const {
 
-		float l = (orig_grid - p).length() - ct;
-		ct += l;
-		intervals[idx].second = l;
+	const int scalar = load_params.attribute_scalar;
+	if(scalar < 0 || scalar >= (int)dataset.scalars.size())
+		return util::span<const float>();
+
+	return dataset.scalar_span(scalar);
+}
 
-		intervals.push_back(std::make_pair<int, float>(cell_idx[0] + res[0] * cell_idx[1] + res[0] * res[1] * cell_idx[2], 0.0f));
-		++idx;
-	}
 
-	float l = (p - dest_grid).length();
-	intervals[idx].second = l;
+/*
+	Returns the prepared color array for the given color source.
+*/
+const std::vector<rgba>& fiber_viewer::get_color_data(ColorSource source) const {
 
-	return intervals;
+	return color_arrays[source < CS_COUNT ? source : CS_MIDPOINT];
 }
 
 /*
@@ -1114,21 +1605,47 @@ std::vector<std::pair<int, float>> traverse_line(vec3& a, vec3& b, vec3& vbox_mi
 	This density can be used to determine how much light passes through each voxel which is used
 	to determine the ambient occlusion term.
 
-	Warning: Each time the tube radius or alpha scale (only in transparent rendering modes) changes
-	the volume needs to be generated again! This can be done by selecting the same (or a different)
-	voxel resolution in the gui.
+	The voxelization keeps sums that are independent of the tube radius, the alpha scale and the
+	render mode, so changing one of them only calls update_density_volume.
 */
-void fiber_viewer::create_density_volume(const context& ctx, const box3 bbox, const float radius) {
+void fiber_viewer::create_density_volume(const context& ctx, const box3 bbox) {
 
 	std::cout << "=====\nGenerating density volume... ";
 	util::timer t;
 
-	density_tex.texture.clear();
+	compute_density_volume(bbox);
+	upload_density_volume(ctx);
 
-	vec3 ext = bbox.get_extent();
+	t.stop();
+	std::cout << "done in " << t.seconds() << "s\n=====" << std::endl;
+}
+
+/*
+	Resolves the density sums for the current tube radius, alpha scale and render mode and uploads
+	the volume again, which takes milliseconds instead of a new voxelization.
+*/
+void fiber_viewer::update_density_volume(const context& ctx) {
+
+	if(density_sums.empty())
+		return;
+
+	util::timer t;
+
+	resolve_density_volume();
+	upload_density_volume(ctx);
+
+	t.stop();
+	std::cout << "Updated density volume in " << t.seconds() * 1000.0 << "ms" << std::endl;
+}
+
+/*
+	Voxelizes the tracts into density_sums and resolves them into density_tex_data. Does not touch
+	any render state and only reads the settings in load_params, so it can run on the loading thread.
+*/
+void fiber_viewer::compute_density_volume(const box3 bbox) {
 
 	unsigned resolution = 8u;
-	switch(voxel_resolution) {
+	switch(load_params.voxel_resolution) {
 	case VR_8: resolution = 8u; break;
 	case VR_16: resolution = 16u; break;
 	case VR_32: resolution = 32u; break;
@@ -1136,117 +1653,171 @@ void fiber_viewer::create_density_volume(const context& ctx, const box3 bbox, co
 	case VR_128: resolution = 128u; break;
 	case VR_256: resolution = 256u; break;
 	case VR_512: resolution = 512u; break;
+	case VR_1024: resolution = 1024u; break;
 	}
 
 	// Calculate the cube voxel size and the resolution in each dimension
-	int max_ext_axis = cgv::math::max_index(ext);
-	float max_ext = ext[max_ext_axis];
-	float vsize = max_ext / static_cast<float>(resolution);
-
-	float vvol = vsize * vsize*vsize; // Volume per voxel
-
-	// Calculate the number of voxels in each dimension
-	unsigned resx = static_cast<unsigned>(ceilf(ext.x() / vsize));
-	unsigned resy = static_cast<unsigned>(ceilf(ext.y() / vsize));
-	unsigned resz = static_cast<unsigned>(ceilf(ext.z() / vsize));
-
-	std::cout << "voxel resolution:" << resx << ", " << resy << ", " << resz << std::endl;
+	const util::density_grid grid = util::density_grid::from_box(bbox, resolution);
+	const uvec3& res = grid.resolution;
 
-	vec3 vres = vec3(resx, resy, resz);
-	vec3 vbox_ext = vsize * vres;
-	vec3 vbox_min = bbox.get_min_pnt() - 0.5f*(vbox_ext - ext);
+	std::cout << "voxel resolution:" << res[0] << ", " << res[1] << ", " << res[2] << std::endl;
 
-	std::vector<float> voxels(resx*resy*resz, 0.0f);
-
-	bool has_radii = raw_radii.size() == raw_positions.size();
-	bool has_attributes = raw_attributes.size() == raw_positions.size();
-
-	// When rendering opaque the transparency has no influence on the density.
-	// Transparent tubes however affect the density of the voxels to simulate
-	// the effect of blocking less light, when tubes are more transparent.
-	float opacity_influence = render_mode == RM_DEFERRED ? 0.0f : 1.0f;
+	if(!util::voxelize_density(get_density_input(), grid, density_sums, &cancel_loading)) {
+		density_sums.clear();
+		return;
+	}
 
-	// Loop over all tracts
-	for(unsigned i = 0; i < tracts.size(); ++i) {
-		unsigned offset = tracts[i].offset;
-		unsigned size = tracts[i].size;
+	std::cout << "Density sums with " << density_sums.get_brick_count() << " of " << density_sums.table.size() << " bricks in " << density_sums.get_memory_size() / (1024.0 * 1024.0) << " MB" << std::endl;
 
-		unsigned from = offset;
-		unsigned to = offset + size - 1;
+	resolve_density_volume();
+}
 
-		// Loop over all segments this tract is composed of
-		for(unsigned j = from; j < to; ++j) {
-			// The start and end points of this segment
-			vec3 p0 = raw_positions[j];
-			vec3 p1 = raw_positions[j + 1];
+/*
+	Computes density_tex_data from the density sums for the parameters in load_params, clamped to a
+	sensible range, and the density texture parameters of the grid. The levels are converted to the
+	density format while they are resolved and the mipmaps are built here as well. A sparse density
+	volume is built into density_bricks and density_tex_data receives its brick pool.
+*/
+void fiber_viewer::resolve_density_volume() {
 
-			// Get radius and opacity values for the start and end point
-			float r0 = radius;
-			float r1 = radius;
+	const util::density_grid& grid = density_sums.grid;
+	const uvec3& res = grid.resolution;
 
-			float a0 = 1.0f;
-			float a1 = 1.0f;
+	density_bricks.clear();
+	if(load_params.sparse_density && !util::build_density_bricks(density_sums, load_params.density, load_params.density_format, density_bricks, density_tex_data))
+		std::cout << "The brick pool exceeds the maximum texture size, using a dense density volume" << std::endl;
 
-			if(has_radii) {
-				r0 = radii[j];
-				r1 = radii[j + 1];
-			}
+	if(density_bricks.empty())
+		util::build_density_mipmaps(density_sums, load_params.density, load_params.density_format, density_tex_data);
 
-			if(has_attributes) {
-				a0 = raw_attributes[j];
-				a1 = raw_attributes[j + 1];
-			}
+	// Keep the ambient occlusion attributes until the volume is uploaded
+	vec3 vres = vec3((float)res[0], (float)res[1], (float)res[2]);
+	float max_res = std::max(vres[0], std::max(vres[1], vres[2]));
 
-			// Get the all intervals of cell-segment intersections
-			std::vector<std::pair<int, float>> intervals = traverse_line(p0, p1, vbox_min, vsize, ivec3(vres));
+	density_tex_offset = grid.box_min;
+	density_tex_scaling = vec3(1.0f) / grid.get_extent();
+	density_tex_coord_scaling = vec3(max_res) / vres;
+	density_texel_size = 1.0f / max_res;
+}
 
-			float total_length = (p1 - p0).length();
-			float accum_length = 0.0f;
+/*
+	Returns the tubes of the dataset for the voxelization of the density volume. Called by the worker
+	thread while loading and by the render thread only once loading has finished.
+*/
+util::density_input fiber_viewer::get_density_input() const {
+
+	util::density_input input;
+	input.tracts = dataset.tracts;
+	input.x = dataset.x_span();
+	input.y = dataset.y_span();
+	input.z = dataset.z_span();
+	if(dataset.has_radii())
+		input.radii = dataset.radius_span();
+	input.opacities = get_raw_attributes();
+	return input;
+}
 
-			// Loop over all intervals to calculate the density contribution of this segment for the intersected cells
-			for(size_t k = 0; k < intervals.size(); ++k) {
-				float length = intervals[k].second;
+/*
+	Returns the parameters the density sums are resolved with for the current GUI settings, tubes
+	without per-point radii have the scaled tube radius. Read on the render thread into load_params.
+*/
+util::density_parameters fiber_viewer::get_density_parameters() const {
 
-				// Interpolate radius and opacity over the segment in the current interval
-				float alpha0 = accum_length / total_length;
-				float alpha1 = (accum_length + length) / total_length;
+	util::density_parameters parameters;
+	parameters.radius = tstyle.radius * tstyle.radius_scale;
+	parameters.alpha_scale = alpha_scale;
 
-				float radius0 = (1.0f - alpha0) * r0 + alpha0 * r1;
-				float radius1 = (1.0f - alpha1) * r0 + alpha1 * r1;
+	// When rendering opaque the transparency has no influence on the density.
+	// Transparent tubes however affect the density of the voxels to simulate
+	// the effect of blocking less light, when tubes are more transparent.
+	parameters.opacity_influence = render_mode == RM_DEFERRED ? 0.0f : 1.0f;
 
-				float alpha_mid = 0.5f*(alpha0 + alpha1);
-				float opacity_scale_factor = (1.0f - alpha_mid) * a0 + alpha_mid * a1;
-				// Scale opacity by global opacity scale factor
-				opacity_scale_factor *= alpha_scale;
+	return parameters;
+}
 
-				// density contribution is volume of the segments truncated cone divided by the voxel cell volume
-				float vol = (PI / 3.0f) * (r0*r0 + r0 * r1 + r1 * r1) * length;
-				float vol_rel = vol / vvol;
+/*
+	Creates the density texture from the levels in density_tex_data and sets the density texture
+	parameters and cone tracing sample directions in the tube render style. A sparse volume is
+	uploaded as its brick pool, which is filtered within the bricks only, and its brick table.
+*/
+void fiber_viewer::upload_density_volume(const context& ctx) {
 
-				// Reduce volume influence according to opacity of segment
-				vol_rel *= 1.0f - opacity_influence * (1.0f - opacity_scale_factor);
+	// Set ambient occlusion attributes in tube render style
+	tstyle.tex_offset = density_tex_offset;
+	tstyle.tex_scaling = density_tex_scaling;
+	tstyle.tex_coord_scaling = density_tex_coord_scaling;
+	tstyle.texel_size = density_texel_size;
+
+	const bool sparse = !density_bricks.empty();
+	if(!density_tex_data.empty()) {
+		GLint internal_format = GL_R32F;
+		GLenum type = GL_FLOAT;
+		switch(density_tex_data.format) {
+		case util::DF_FLOAT16: internal_format = GL_R16F; type = GL_HALF_FLOAT; break;
+		case util::DF_UNORM8: internal_format = GL_R8; type = GL_UNSIGNED_BYTE; break;
+		default: break;
+		}
 
-				accum_length += length;
-				voxels[intervals[k].first] += vol_rel;
-			}
+		// The texture is created again since the format or the number of levels may change
+		if(density_tex > 0)
+			glDeleteTextures(1, &density_tex);
+		glGenTextures(1, &density_tex);
+		glBindTexture(GL_TEXTURE_3D, density_tex);
+
+		// Rows of R16F and R8 texels are not aligned to 4 bytes
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for(size_t i = 0; i < density_tex_data.levels.size(); ++i) {
+			const uvec3& res = density_tex_data.resolutions[i];
+			glTexImage3D(GL_TEXTURE_3D, (GLint)i, internal_format, res[0], res[1], res[2], 0, GL_RED, type, density_tex_data.levels[i].data());
 		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		const float border_color[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_BASE_LEVEL, 0);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, (GLint)density_tex_data.levels.size() - 1);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, density_tex_data.levels.size() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_3D, GL_TEXTURE_BORDER_COLOR, border_color);
+		glBindTexture(GL_TEXTURE_3D, 0);
+
+		std::cout << "Density texture with " << density_tex_data.levels.size() << " levels in " << density_tex_data.get_size() / (1024.0 * 1024.0) << " MB" << std::endl;
+
+		// The levels are resolved again from the density sums when a parameter changes
+		density_tex_data.clear();
 	}
 
-	density_tex.data.resize(resx*resy*resz);
+	if(sparse) {
+		if(brick_table_ssbo == 0)
+			glGenBuffers(1, &brick_table_ssbo);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, brick_table_ssbo);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, density_bricks.table.size() * sizeof(uint32_t), density_bricks.table.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-	// Clamp all density values to a sensible range
-	for(unsigned i = 0; i < voxels.size(); ++i)
-		density_tex.data[i] = cgv::math::clamp(voxels[i], 0.0f, 1.0f);
+		tstyle.density_level_count = (int)density_bricks.levels.size();
+		tstyle.density_level_resolution.clear();
+		tstyle.density_level_bricks.clear();
+		for(const util::density_bricks::level& level : density_bricks.levels) {
+			tstyle.density_level_resolution.push_back(ivec3(level.resolution[0], level.resolution[1], level.resolution[2]));
+			tstyle.density_level_bricks.push_back(ivec4(level.bricks[0], level.bricks[1], level.bricks[2], level.table_offset));
+		}
+		tstyle.brick_pool_slots = ivec3(density_bricks.pool_slots[0], density_bricks.pool_slots[1], density_bricks.pool_slots[2]);
+		const uvec3 res = density_bricks.get_pool_resolution();
+		tstyle.brick_pool_texel_size = vec3(1.0f) / vec3((float)res[0], (float)res[1], (float)res[2]);
+
+		std::cout << "Sparse density volume with " << density_bricks.brick_count << " bricks in " << density_bricks.get_memory_size(load_params.density_format) / (1024.0 * 1024.0) << " MB" << std::endl;
+	} else if(brick_table_ssbo > 0) {
+		glDeleteBuffers(1, &brick_table_ssbo);
+		brick_table_ssbo = 0;
+	}
 
-	density_tex.connect(new cgv::data::data_format(resx, resy, resz, cgv::type::info::TypeId::TI_FLT32, cgv::data::ComponentFormat::CF_R));
-	density_tex.texture.create(ctx, density_tex.view, 0);
-	density_tex.texture.set_min_filter(TF_LINEAR_MIPMAP_LINEAR);
-	density_tex.texture.set_mag_filter(TF_LINEAR);
-	density_tex.texture.set_wrap_s(TW_CLAMP_TO_BORDER);
-	density_tex.texture.set_wrap_t(TW_CLAMP_TO_BORDER);
-	density_tex.texture.set_wrap_r(TW_CLAMP_TO_BORDER);
-	density_tex.texture.set_border_color(0.0f, 0.0f, 0.0f, 0.0f);
-	density_tex.texture.generate_mipmaps(ctx);
+	// The tube renderer rebuilds its shaders for the new define by itself
+	if(tstyle.sparse_density != sparse) {
+		tstyle.sparse_density = sparse;
+		load_shader(ctx, tube_transparent_naive_prog, "tube_transparent_naive", get_transparent_shader_defines());
+	}
 
 	// Generate 3 cone sample directions to be used in the shader
 	std::vector<vec3> sample_dirs(3);
@@ -1262,19 +1833,11 @@ void fiber_viewer::create_density_volume(const context& ctx, const box3 bbox, co
 
 	float b = sqrtf(1 - c * c);
 
-	// Set ambient occlusion attributes in tube render style
-	tstyle.tex_offset = vbox_min;
-	tstyle.tex_scaling = vec3(1.0f) / vbox_ext;
-	tstyle.tex_coord_scaling = vec3(vres[max_ext_axis]) / vres;
-	tstyle.texel_size = 1.0f / vres[max_ext_axis];
 	tstyle.cone_angle_factor = 2.0f * sinf(alpha2) / sinf(beta);
 	tstyle.sample_dirs.resize(3);
 	tstyle.sample_dirs[0] = vec3(0.0f, b, c);
 	tstyle.sample_dirs[1] = vec3(a, b, -dh);
 	tstyle.sample_dirs[2] = vec3(-a, b, -dh);
-
-	t.stop();
-	std::cout << "done in " << t.seconds() << "s\n=====" << std::endl;
 }
 
 bool fiber_viewer::init(cgv::render::context& ctx) {
@@ -1291,11 +1854,7 @@ bool fiber_viewer::init(cgv::render::context& ctx) {
 	cb.cf = util::CF_FLT32;
 	cb.create_and_validate(ctx, ctx.get_width(), ctx.get_height());
 
-	// Setup a color map
-	color_map.values.clear();
-	color_map.values.push_back(rgba(0.0f, 1.0f, 0.0f, 0.0f));
-	color_map.values.push_back(rgba(0.0f, 0.0f, 1.0f, 0.5f));
-	color_map.values.push_back(rgba(1.0f, 0.0f, 0.0f, 1.0f));
+	create_colormap_luts(ctx);
 
 	set_dataset(ctx, true);
 
@@ -1325,6 +1884,8 @@ bool fiber_viewer::init(cgv::render::context& ctx) {
 
 	create_buffers(ctx);
 
+	glGenQueries(1, &frame_time_query);
+
 	// Set the background color
 	background_color.alpha() = 1.0f; // Front-to-back blending
 
@@ -1342,6 +1903,8 @@ void fiber_viewer::init_frame(cgv::render::context& ctx) {
 		update_member(&tstyle.radius_scale);
 	}
 
+	update_dataset_loading(ctx);
+
 	if(do_rebuild_framebuffer) {
 		do_rebuild_framebuffer = false;
 		fb.destruct(ctx);
@@ -1353,9 +1916,41 @@ void fiber_viewer::init_frame(cgv::render::context& ctx) {
 		create_buffers(ctx);
 	}
 
+	// Changes that need the complete prepared data are deferred until loading has finished
+	if(load_state != LS_IDLE)
+		return;
+
+	// No worker is running, the deferred changes below see the current settings
+	load_params = get_load_parameters();
+
+	if(do_rebuild_gpu_data) {
+		do_rebuild_gpu_data = false;
+
+		if(!segment_indices.empty()) {
+			delete_gpu_buffers();
+			upload_data(ctx);
+			create_index_buffers(ctx);
+		}
+	}
+
 	if(do_create_density_volume) {
 		do_create_density_volume = false;
-		create_density_volume(ctx, dataset_bbox, tstyle.radius * tstyle.radius_scale);
+		do_update_density_volume = false;
+		create_density_volume(ctx, dataset_bbox);
+	}
+
+	if(do_update_density_volume) {
+		do_update_density_volume = false;
+		update_density_volume(ctx);
+	}
+
+	if(do_change_attribute) {
+		do_change_attribute = false;
+		// Attribute colors are prepared again when they are shown the next time
+		std::vector<rgba>().swap(color_arrays[CS_ATTRIBUTE]);
+		// The attribute scales the opacity in the transparent modes, so the density changes as well
+		create_density_volume(ctx, dataset_bbox);
+		do_change_color_source = true;
 	}
 
 	if(do_change_color_source) {
@@ -1376,6 +1971,28 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 	tr.set_eye_position(eye);
 	tr.set_view_direction(view_dir);
 
+	// Collect the GPU time of an earlier frame once it is available without waiting for it
+	if(frame_time_query_pending) {
+		GLint available = 0;
+		glGetQueryObjectiv(frame_time_query, GL_QUERY_RESULT_AVAILABLE, &available);
+
+		if(available) {
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(frame_time_query, GL_QUERY_RESULT, &elapsed);
+
+			double& average = frame_time_ms[frame_time_query_compact ? 1 : 0];
+			double ms = 1e-6 * static_cast<double>(elapsed);
+			average = average > 0.0 ? 0.95 * average + 0.05 * ms : ms;
+			frame_time_query_pending = false;
+		}
+	}
+
+	bool measure_frame_time = frame_time_query != 0 && !frame_time_query_pending;
+	if(measure_frame_time) {
+		frame_time_query_compact = gpu_buffers_compact;
+		glBeginQuery(GL_TIME_ELAPSED, frame_time_query);
+	}
+
 	switch (render_mode) {
 	case RM_DEFERRED:
 	{
@@ -1391,7 +2008,7 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 			glClearColor(background_color.R(), background_color.G(), background_color.B(), 1.0f);
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-			tr.rasterize(ctx, positions.size());
+			tr.rasterize(ctx, 2 * uploaded_segment_count, ibo);
 
 			fb.fb.disable(ctx);
 			fb.fb.pop_viewport(ctx);
@@ -1399,14 +2016,21 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 			fb.color.enable(ctx, 0);
 			fb.position.enable(ctx, 1);
 			fb.normal.enable(ctx, 2);
-			density_tex.enable(ctx, 3);
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_3D, density_tex);
+			glActiveTexture(GL_TEXTURE0);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, brick_table_ssbo);
 
 			tr.shade(ctx);
 
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, 0);
+
 			fb.color.disable(ctx);
 			fb.position.disable(ctx);
 			fb.normal.disable(ctx);
-			density_tex.disable(ctx);
+			glActiveTexture(GL_TEXTURE3);
+			glBindTexture(GL_TEXTURE_3D, 0);
+			glActiveTexture(GL_TEXTURE0);
 
 			tr.disable(ctx);
 		}
@@ -1420,12 +2044,15 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 			will most likely produce artifacts.
 		*/
 
-		// Sort the segments
-		if (!disable_sorting)
-			sort(ctx, positions_ssbo, segment_ibo, eye);
+		// Sort the segments, the sorter only exists once the dataset is loaded completely
+		if (!disable_sorting && segment_ibo > 0)
+			sort(ctx, eye);
 
 		set_transparent_shader_uniforms(ctx, view_ptr, tube_transparent_naive_prog);
 
+		// Scalar color sources read the point scalars and map them through their color map
+		bool use_colormap = get_scalar_colormap(prepared_color_source) != nullptr;
+
 		cb.fb.enable(ctx);
 		glClear(GL_COLOR_BUFFER_BIT);
 
@@ -1435,19 +2062,32 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, positions_ssbo);
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, radii_ssbo);
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, colors_ssbo);
-
-		density_tex.enable(ctx, 1);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, use_colormap ? scalars_ssbo : colors_ssbo);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, clip_bits_ssbo);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, brick_table_ssbo);
 
-		glDrawElements(GL_LINES, positions.size(), GL_UNSIGNED_INT, (void*)0);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_3D, density_tex);
+		glActiveTexture(GL_TEXTURE0);
+		if(use_colormap)
+			colormap_luts[prepared_color_source].enable(ctx, 5);
 
+		// While the dataset is still loading the index buffer holds the segments unsorted in tract order
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+		glDrawElements(GL_LINES, 2 * uploaded_segment_count, GL_UNSIGNED_INT, (void*)0);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-		density_tex.disable(ctx);
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_3D, 0);
+		glActiveTexture(GL_TEXTURE0);
+		if(use_colormap)
+			colormap_luts[prepared_color_source].disable(ctx);
 
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, 0);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, 0);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, 0);
 
 		tube_transparent_naive_prog.disable(ctx);
 		glDisable(GL_BLEND);
@@ -1494,7 +2134,7 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 
 	//	// Sort the segments
 	//	if(!disable_sorting)
-	//		sort(ctx, positions_ssbo, segment_ibo, eye);
+	//		sort(ctx, eye);
 
 	//	set_transparent_shader_uniforms(ctx, view_ptr, tube_transparent_al_prog);
 	//	tube_transparent_al_prog.set_uniform(ctx, "scratch_size", scratch_size_per_pixel);
@@ -1514,7 +2154,7 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 	//	density_tex.enable(ctx, 1);
 	//	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
 
-	//	glDrawElements(GL_LINES, positions.size(), GL_UNSIGNED_INT, (void*)0);
+	//	glDrawElements(GL_LINES, 2 * uploaded_segment_count, GL_UNSIGNED_INT, (void*)0);
 	//	
 	//	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	//	density_tex.disable(ctx);
@@ -1551,53 +2191,75 @@ void fiber_viewer::draw(cgv::render::context& ctx) {
 	//break;
 	//}
 	}
+
+	if(measure_frame_time) {
+		glEndQuery(GL_TIME_ELAPSED);
+		frame_time_query_pending = true;
+	}
 }
 
+/*
+	Prepares the selected color source if it is not resident and uploads its colors. Switching between the
+	scalar color sources only changes the color map once the point scalars are on the GPU.
+*/
 void fiber_viewer::set_color_source(const context& ctx) {
 
-	std::vector<rgba>& color_data = std::vector<rgba>(0);
-
-	switch(color_source) {
-	case CS_ATTRIBUTE:
-		color_data = colors_attribute;
-		break;
-	case CS_MIDPOINT:
-		color_data = colors_midpoint;
-		break;
-	case CS_SEGMENT:
-		color_data = colors_segment;
-		break;
-	case CS_COOLWARM:
-		color_data = colors_coolwarm;
-		break;
-	case CS_EXTENDED_KINDLMANN:
-		color_data = colors_extended_kindlmann;
-		break;
-	case CS_EXTENDED_BLACKBODY:
-		color_data = colors_extended_blackbody;
-		break;
-	case CS_BLACKBODY:
-		color_data = colors_blackbody;
-		break;
-	case CS_ISORAINBOW:
-		color_data = colors_isorainbow;
-		break;
-	case CS_BOYS:
-		color_data = colors_boys;
-		break;
-
-	}
-
-	if(color_data.size() > 0) {
-		tr.set_color_array(ctx, color_data);
+	if(!ensure_color_data(color_source))
+		return;
 
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, colors_ssbo);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, color_data.size() * sizeof(rgba), (void*)color_data.data(), GL_DYNAMIC_COPY);
+	prepared_color_source = color_source;
+	upload_colors(ctx);
+}
+
+/*
+	Uploads the colors of prepared_color_source into the color vertex buffer and shader storage buffer. Scalar
+	color sources upload the point scalars instead, unless they are already on the GPU, and select their color map.
+*/
+void fiber_viewer::upload_colors(const context& ctx) {
+
+	if(get_scalar_colormap(prepared_color_source)) {
+		tr.set_colormap(&colormap_luts[prepared_color_source]);
+
+		if(gpu_scalars_uploaded || point_scalars.empty())
+			return;
+
+		tr.set_scalar_array(ctx, point_scalars.data(), point_scalars.size());
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, scalars_ssbo);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (point_scalars.size() * sizeof(uint16_t) + 3) / 4 * 4, (void*)0, GL_DYNAMIC_COPY);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, point_scalars.size() * sizeof(uint16_t), (void*)point_scalars.data());
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		gpu_scalars_uploaded = true;
+		return;
+	}
+
+	tr.set_colormap(nullptr);
+
+	const std::vector<rgba>& color_data = get_color_data(prepared_color_source);
+
+	if(color_data.empty())
+		return;
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, colors_ssbo);
+
+	if(gpu_buffers_compact) {
+		std::vector<rgba8> packed_colors(color_data.size());
+		util::parallel_for(color_data.size(), [&](size_t begin, size_t end) {
+			pack_colors(color_data.data() + begin, end - begin, packed_colors.data() + begin);
+		});
+
+		tr.set_color_array(ctx, packed_colors);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, packed_colors.size() * sizeof(rgba8), (void*)packed_colors.data(), GL_DYNAMIC_COPY);
+	} else {
+		tr.set_color_array(ctx, color_data);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, color_data.size() * sizeof(rgba), (void*)color_data.data(), GL_DYNAMIC_COPY);
 	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-bool fiber_viewer::load_shader(context& ctx, shader_program& prog, std::string name, std::string defines) {
+bool fiber_viewer::load_shader(const context& ctx, shader_program& prog, std::string name, std::string defines) {
 
 	if(prog.is_created()) {
 		prog.destruct(ctx);
@@ -1612,11 +2274,27 @@ bool fiber_viewer::load_shader(context& ctx, shader_program& prog, std::string n
 	return true;
 }
 
-void fiber_viewer::sort(context& ctx, const GLuint position_buffer, const GLuint index_buffer, const vec3& eye_position) {
+/*
+	Returns the defines of the transparent tube shaders for the ambient occlusion setting and the
+	uploaded density volume.
+*/
+std::string fiber_viewer::get_transparent_shader_defines() const {
+
+	std::string defines = "ENABLE_AMBIENT_OCCLUSION=";
+	defines += std::to_string((int)tstyle.enable_ambient_occlusion);
+	defines += ";ENABLE_SPARSE_DENSITY=";
+	defines += std::to_string((int)tstyle.sparse_density);
+	return defines;
+}
 
-	sorter.sort(ctx, positions_ssbo, segment_ibo, eye_position);
+/*
+	Sorts the segments by distance to the eye and writes the point indices of the sorted segments to the line index buffer.
+*/
+void fiber_viewer::sort(context& ctx, const vec3& eye_position) {
 
-	unsigned segment_count = positions.size() / 2;
+	sorter.sort(ctx, positions_ssbo, segments_ssbo, segment_ibo, eye_position);
+
+	unsigned segment_count = (unsigned)segment_indices.size();
 
 	expand_indices_prog.enable(ctx);
 	expand_indices_prog.set_uniform(ctx, "n", segment_count - sorter.get_padding());
@@ -1624,13 +2302,15 @@ void fiber_viewer::sort(context& ctx, const GLuint position_buffer, const GLuint
 
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, segment_ibo);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ibo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, segments_ssbo);
 
 	glDispatchCompute(sorter.get_group_size(), 1, 1);
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT);
 	expand_indices_prog.disable(ctx);
 
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, 0);
 }
 
 void fiber_viewer::set_transparent_shader_uniforms(context& ctx, view* view_ptr, shader_program& prog) {
@@ -1643,8 +2323,12 @@ void fiber_viewer::set_transparent_shader_uniforms(context& ctx, view* view_ptr,
 		view_dir = view_ptr->get_view_dir();
 	}
 
+	// Nothing is drawn before the dataset is published, the worker thread may still write it
+	const bool published = is_dataset_published();
+	const box3 bbox = published ? dataset_bbox : box3(vec3(0.0f), vec3(1.0f));
+
 	prog.enable(ctx);
-	prog.set_uniform(ctx, "use_global_radius", radii.size() != positions.size());
+	prog.set_uniform(ctx, "use_global_radius", !published || !dataset.has_radii());
 	prog.set_uniform(ctx, "radius", tstyle.radius);
 	prog.set_uniform(ctx, "radius_scale", tstyle.radius_scale);
 	prog.set_uniform(ctx, "eye_pos", eye_pos);
@@ -1652,6 +2336,11 @@ void fiber_viewer::set_transparent_shader_uniforms(context& ctx, view* view_ptr,
 	prog.set_uniform(ctx, "viewport_dims", ivec2(ctx.get_width(), ctx.get_height()));
 	prog.set_uniform(ctx, "alpha_scale", alpha_scale);
 	prog.set_uniform(ctx, "disable_clipping", disable_clipping);
+	prog.set_uniform(ctx, "quantized_positions", gpu_buffers_compact);
+	prog.set_uniform(ctx, "position_offset", gpu_buffers_compact ? bbox.get_min_pnt() : vec3(0.0f));
+	prog.set_uniform(ctx, "position_scale", gpu_buffers_compact ? bbox.get_extent() : vec3(1.0f));
+	prog.set_uniform(ctx, "packed_colors", gpu_buffers_compact);
+	prog.set_uniform(ctx, "use_colormap", get_scalar_colormap(prepared_color_source) != nullptr);
 	
 	ctx.set_material(tstyle.material);
 	ctx.set_color(tstyle.surface_color);
@@ -1670,6 +2359,14 @@ void fiber_viewer::set_transparent_shader_uniforms(context& ctx, view* view_ptr,
 		prog.set_uniform(ctx, "cone_angle_factor", tstyle.cone_angle_factor);
 		prog.set_uniform_array(ctx, "sample_dirs", tstyle.sample_dirs);
 
+		if(tstyle.sparse_density) {
+			prog.set_uniform(ctx, "density_level_count", tstyle.density_level_count);
+			prog.set_uniform_array(ctx, "density_level_resolution", tstyle.density_level_resolution);
+			prog.set_uniform_array(ctx, "density_level_bricks", tstyle.density_level_bricks);
+			prog.set_uniform(ctx, "brick_pool_slots", tstyle.brick_pool_slots);
+			prog.set_uniform(ctx, "brick_pool_texel_size", tstyle.brick_pool_texel_size);
+		}
+
 		mat4 MV(ctx.get_modelview_matrix());
 		mat3 NM;
 		NM(0, 0) = MV(0, 0);
@@ -1725,13 +2422,20 @@ void fiber_viewer::create_gui() {
 	add_decorator("Line Viewer", "heading", "level=2");
 
 	//add_member_control(this, "Dataset", dataset, "dropdown", "enums='test,brain_segment,whole_brain'");
-	add_gui("Dataset", dataset_filename, "file_name", "title='select dataset file';filter='tractography files:*.trk|All Files:*.*'");
+	add_gui("Dataset", dataset_filename, "file_name", "title='select dataset file';filter='tractography files:*.{trk,tck,gz}|All Files:*.*'");
+	add_member_control(this, "Use dataset cache", use_dataset_cache, "check", "");
+	add_member_control(this, "Compact GPU buffers", compact_buffers, "check", "");
+	add_member_control(this, "Color cache (MB)", color_cache_budget, "value_slider", "min=64;max=16384;log=true;ticks=true");
+	add_view("Loading", load_progress, "", "w=100");
+	add_member_control(this, "Attribute scalar", attribute_scalar, "value_slider", "min=0;max=9;ticks=true");
 	add_member_control(this, "Color mapping", color_source, "dropdown", "enums='attribute,midpoint,segment,coolwarm,e_kindlmann,e_blackbody,blackbody,isorainbow,boysurface'");
 	add_member_control(this, "Render mode", render_mode, "dropdown", "enums='deferred,transparent naive,transparent atomic loop,volume'");
 	add_member_control(this, "FB format", fb.cf, "dropdown", "enums='flt32,uint8'");
 	add_member_control(this, "Scratch size", alss, "dropdown", "enums='1,2,4,8,16,32'");
 
-	add_member_control(this, "Voxel resolution", voxel_resolution, "dropdown", "enums='8,16,32,64,128,256,512'");
+	add_member_control(this, "Voxel resolution", voxel_resolution, "dropdown", "enums='8,16,32,64,128,256,512,1024'");
+	add_member_control(this, "Sparse density volume", sparse_density, "check", "");
+	add_member_control(this, "Density format", density_format, "dropdown", "enums='flt32,flt16,unorm8'");
 
 	add_member_control(this, "Disable sorting", disable_sorting, "check", "");
 	add_member_control(this, "Disable clipping", disable_clipping, "check", "");
@@ -1752,122 +2456,6 @@ void fiber_viewer::create_gui() {
 	}
 }
 
-//Alaleh's
-void rp2ColorMapping(float startP[3], float endP[3], float rgb[3])
-{
-	float v[3];
-
-	for (int k = 0; k <= 2; k++)
-		v[k] = endP[k] - startP[k];
-
-	//do a normalization, just in case
-	float l = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
-
-	v[0] = v[0] / l;
-	v[1] = v[1] / l;
-	v[2] = v[2] / l;
-
-	float x = v[0];
-	float y = v[1];
-	float z = v[2];
-
-	float xx2 = v[0] * v[0];
-	float xx3 = v[0] * v[0] * v[0];
-	float yy2 = v[1] * v[1];
-	float yy3 = v[1] * v[1] * v[1];
-	float zz2 = v[2] * v[2];
-	float zz3 = v[2] * v[2] * v[2];
-	float zz4 = v[2] * v[2] * v[2] * v[2];
-	float xy = v[0] * v[1];
-	float xz = v[0] * v[2];
-	float yz = v[1] * v[2];
-
-	float hh1 = .5 * (3 * zz2 - 1) / 1.58;
-	float hh2 = 3 * xz / 2.745;
-	float hh3 = 3 * yz / 2.745;
-	float hh4 = 1.5 * (xx2 - yy2) / 2.745;
-	float hh5 = 6 * xy / 5.5;
-	float hh6 = (1 / 1.176) * .125 * (35 * zz4 - 30 * zz2 + 3);
-	float hh7 = 2.5 * x * (7 * zz3 - 3 * z) / 3.737;
-	float hh8 = 2.5 * y * (7 * zz3 - 3 * z) / 3.737;
-	float hh9 = ((xx2 - yy2) * 7.5 * (7 * zz2 - 1)) / 15.85;
-	float hh10 = ((2 * xy) * (7.5 * (7 * zz2 - 1))) / 15.85;
-	float hh11 = 105 * (4 * xx3 * z - 3 * xz * (1 - zz2)) / 59.32;
-	float hh12 = 105 * (-4 * yy3 * z + 3 * yz * (1 - zz2)) / 59.32;
-
-	float s0 = -23.0;
-	float s1 = 227.9;
-	float s2 = 251.0;
-	float s3 = 125.0;
-
-	auto SS = [](float NA, float ND) -> float
-	{
-		return NA * sin(ND * 3.141592 / 180);
-	};
-
-	auto CC = [](float NA, float ND) -> float
-	{
-		return NA * cos(ND * 3.141592 / 180);
-	};
-
-	float ss23 = SS(2.71, s0);
-	float cc23 = CC(2.71, s0);
-	float ss45 = SS(2.12, s1);
-	float cc45 = CC(2.12, s1);
-	float ss67 = SS(.972, s2);
-	float cc67 = CC(.972, s2);
-	float ss89 = SS(.868, s3);
-	float cc89 = CC(.868, s3);
-
-	float X = 0.0;
-	X = X + hh2 * cc23;
-	X = X + hh3 * ss23;
-
-	X = X + hh5 * cc45;
-	X = X + hh4 * ss45;
-
-	X = X + hh7 * cc67;
-	X = X + hh8 * ss67;
-
-	X = X + hh10 * cc89;
-	X = X + hh9 * ss89;
-
-	float Y = 0.0;
-	Y = Y + hh2 * -ss23;
-	Y = Y + hh3 * cc23;
-
-	Y = Y + hh5 * -ss45;
-	Y = Y + hh4 * cc45;
-
-	Y = Y + hh7 * -ss67;
-	Y = Y + hh8 * cc67;
-
-	Y = Y + hh10 * -ss89;
-	Y = Y + hh9 * cc89;
-
-
-	float Z = 0.0;
-	Z = Z + hh1 * -2.8;
-	Z = Z + hh6 * -0.5;
-	Z = Z + hh11 * 0.3;
-	Z = Z + hh12 * -2.5;
-
-	// scale and normalize to fit in the rgb space
-	float w_x = 4.1925;
-	float trl_x = -2.0425;
-
-	float w_y = 4.0217;
-	float trl_y = -1.8541;
-
-	float w_z = 4.0694;
-	float trl_z = -2.1899;
-
-
-	rgb[0] = 0.9 * abs(((X - trl_x) / w_x)) + 0.05;
-	rgb[1] = 0.9 * abs(((Y - trl_y) / w_y)) + 0.05;
-	rgb[2] = 0.9 * abs(((Z - trl_z) / w_z)) + 0.05;
-}//Alaleh's
-
 #include "lib_begin.h"
 
 #include <cgv/base/register.h>
@@ -14,11 +14,21 @@
 #include <cgv/render/shader_program.h>
 #include <cgv_gl/volume_renderer.h>
 #include <random>
+#include <atomic>
+#include <thread>
 
 
 #include "util.h"
+#include "colormap.h"
+#include "boys_surface.h"
+#include "volume_sampler.h"
+#include "density_voxelizer.h"
+#include "density_bricks.h"
+#include "density_texture.h"
 #include "tube_renderer.h"
 #include "gpu_sorter.h"
+#include "tractogram_reader.h"
+#include "dataset_cache.h"
 
 #include "nifti1.h"
 #include "znzlib.h"
@@ -53,6 +63,7 @@ protected:
 		CS_ISORAINBOW,
 		CS_BOYS,
 
+		CS_COUNT
 	} color_source;
 
 	enum AtomicLoopScratchSize {
@@ -71,44 +82,114 @@ protected:
 		VR_64,
 		VR_128,
 		VR_256,
-		VR_512
+		VR_512,
+		VR_1024
 	} voxel_resolution;
+	// Store the density volume as sparse bricks instead of a dense texture, always used at 1024 voxels
+	bool sparse_density;
+	// Texel format of the density texture, R16F and R8 need a half and a quarter of the memory of R32F
+	util::density_format density_format;
 
 	double check_for_click;
 	bool do_change_dataset;
 	bool do_change_color_source;
+	bool do_change_attribute;
 	bool do_create_density_volume;
+	bool do_update_density_volume;
 	bool do_rebuild_framebuffer;
 	bool do_rebuild_buffers;
+	bool do_rebuild_gpu_data;
 
 	bool disable_sorting;
 	bool disable_clipping;
+	bool use_dataset_cache;
+	// Store positions as 16 bit unsigned normalized values relative to dataset_bbox and colors as RGBA8 on the GPU
+	bool compact_buffers;
 
-	struct tract {
-		unsigned offset = 0u;
-		unsigned size = 0u;
-	};
+	typedef tractogram::tract tract;
 
-	// Raw data
+	// Raw data. Tracts, coordinates, radii, scalars and properties are kept in one structure-of-arrays
+	// container (see tractogram.h) and handed to the processing functions as spans.
 	box3 dataset_bbox;
-	std::vector<tract> tracts;
-	std::vector<vec3> raw_positions;
-	std::vector<float> raw_radii;
-	std::vector<float> raw_attributes;
-
-	// Prepared data
-	std::vector<vec3> positions;
-	std::vector<float> radii;
-	std::vector<rgba> colors_midpoint;
-	std::vector<rgba> colors_segment;
-	std::vector<rgba> colors_attribute;
-	std::vector<rgba> colors_coolwarm;
-	std::vector<rgba> colors_extended_kindlmann;
-	std::vector<rgba> colors_blackbody;
-	std::vector<rgba> colors_extended_blackbody;
-	std::vector<rgba> colors_isorainbow;
-	std::vector<rgba> colors_boys;
+	tractogram dataset;
+	// Cache file the columns of the dataset reference in place when it was loaded from the cache
+	dataset_cache dataset_cache_file;
+	// Index of the scalar column that is used as the per-point attribute
+	int attribute_scalar;
+
+	// Segment index. Positions and radii are shared between segments and rendered from the dataset,
+	// every segment is given by the index of its first point (see build_segment_index)
+	std::vector<unsigned> segment_indices;
+	// Two clipping bits per segment addressed by the index of its first point, 16 segments per word
+	std::vector<unsigned> segment_clip_bits;
+	// Index of the first segment of every tract
+	std::vector<size_t> segment_offsets;
+
+	// Prepared per-point colors indexed by color source. A color source is prepared the first time it is
+	// selected and stays resident until it is the least recently used one and all arrays together exceed
+	// color_cache_budget megabytes.
+	std::vector<rgba> color_arrays[CS_COUNT];
+	uint64_t color_array_last_use[CS_COUNT];
+	uint64_t color_use_counter;
+	unsigned color_cache_budget;
+	// Color source that is uploaded to the GPU, the loading thread prepares only this source
+	ColorSource prepared_color_source;
+	// FA value of every point as 16 bit unsigned normalized scalar. The scalar color sources share it
+	// and are mapped through their color map texture on the GPU instead of storing colors per point.
+	std::vector<uint16_t> point_scalars;
+	// FA volume sampled at the point positions for the scalar color mapping
+	volume_sampler fa_sampler;
+	// FA values mapped to the ends of the transfer function and the color maps, taken from the FA histogram
+	vec2 fa_window;
+
+	// Color maps for the scalar color mapping modes, owned by the color map registry
+	const util::colormap* coolwarm_colormap;
+	const util::colormap* extended_kindlmann_colormap;
+	const util::colormap* extended_blackbody_colormap;
+	const util::colormap* blackbody_colormap;
+	const util::colormap* isorainbow_colormap;
+	// 1D lookup textures of the color maps above indexed by color source
+	texture colormap_luts[CS_COUNT];
+
+	// Asynchronous loading. The worker thread reads and prepares the dataset while the render
+	// thread uploads every chunk of prepared tracts published through prepared_tract_count.
+	// The dataset, its bounding box and the segment index are only written in LS_READING, the
+	// density sums and volumes until LS_FINISHED. The render thread waits for these states,
+	// see is_dataset_published.
+	enum LoadState {
+		LS_IDLE,
+		LS_READING,
+		LS_PREPARING,
+		LS_FINISHED,
+		LS_FAILED
+	};
+
+	// Settings of the dataset, density volume and attribute preparation, copied from the GUI members on the
+	// render thread when a load starts and whenever no load is running. The worker thread and the functions
+	// it calls only read this copy, so changes made in the GUI meanwhile are applied after loading.
+	struct load_parameters {
+		std::string file_name;
+		bool use_cache = true;
+		VoxelResolution voxel_resolution = VR_256;
+		bool sparse_density = false;
+		util::density_format density_format = util::DF_FLOAT32;
+		int attribute_scalar = 0;
+		// Tube radius the bounding box of the dataset is enlarged by
+		float radius = 0.0f;
+		util::density_parameters density;
+	};
 
+	load_parameters load_params;
+	std::thread load_thread;
+	std::atomic<int> load_state;
+	std::atomic<bool> cancel_loading;
+	std::atomic<bool> load_buffers_created;
+	std::atomic<size_t> prepared_tract_count;
+	std::atomic<float> load_fraction;
+	float load_progress;
+	size_t uploaded_tract_count;
+	size_t uploaded_segment_count;
+	bool load_test_dataset;
 
 	texture tf_tex;
 	std::string resource_path;
@@ -123,18 +204,45 @@ protected:
 	util::frame_buffer_container fb;
 	util::color_buffer_container cb;
 
-	util::texture_container<float> density_tex;
+	// Density texture with the mipmaps built on the CPU, uploaded directly to control its internal format
+	GLuint density_tex;
+	// Levels of the density texture in density_format until they are uploaded
+	util::density_texture_data density_tex_data;
+	// Density sums of the last voxelization, resolved into density_tex_data when a density parameter changes
+	util::density_sums density_sums;
+	// Bricks of the sparse density volume, density_tex_data then holds the brick pool. Empty for a dense volume.
+	util::density_bricks density_bricks;
 	util::texture_container<float> fa_tex;
 
+	// Density texture parameters, applied to the tube render style when the density volume is uploaded
+	vec3 density_tex_offset;
+	vec3 density_tex_scaling;
+	vec3 density_tex_coord_scaling;
+	float density_texel_size;
+
 	GLuint segment_ibo;
 	GLuint ibo;
 	GLuint positions_ssbo;
 	GLuint radii_ssbo;
 	GLuint colors_ssbo;
+	GLuint scalars_ssbo;
+	GLuint segments_ssbo;
+	GLuint clip_bits_ssbo;
+	GLuint brick_table_ssbo;
 	GLuint scratch_buffer;
+	// Layout of the buffers currently on the GPU, compact_buffers only takes effect with the next upload
+	bool gpu_buffers_compact;
+	// Whether the point scalars are on the GPU, switching between scalar color sources then only binds another color map
+	bool gpu_scalars_uploaded;
+
+	// GPU time of the draw pass, averaged separately for the float and the compact buffer layout
+	GLuint frame_time_query;
+	bool frame_time_query_pending;
+	bool frame_time_query_compact;
+	double frame_time_ms[2];
 
 	rgba background_color;
-	util::linear_interpolator color_map;
+	const util::colormap* attribute_colormap;
 	vec3 dataset_center;
 	float alpha_scale;
 	
@@ -148,21 +256,61 @@ protected:
 	shader_program clear_ssbo_prog;
 
 	bool generate_test_dataset();
-	bool read_trk_file(std::string file);
+	mat4 get_file_transformation() const;
+	bool read_tractogram_file(const std::string& file);
 
 	void set_dataset(context& ctx, bool generate_test = true);
-	void prepare_data(context& ctx);
-	void create_density_volume(const context& ctx, const box3 bbox, const float radius);
+	void cancel_dataset_loading();
+	load_parameters get_load_parameters() const;
+	bool is_dataset_published() const;
+	void load_dataset();
+	void update_dataset_loading(context& ctx);
+	void upload_tract_range(context& ctx, size_t first, size_t last);
+	void set_uploaded_tract_count(size_t count);
+	util::span<const float> get_raw_attributes() const;
+	const std::vector<rgba>& get_color_data(ColorSource source) const;
+	bool has_color_data(ColorSource source) const;
+	bool ensure_color_data(ColorSource source);
+	void evict_color_data(ColorSource keep);
+	size_t get_color_data_size() const;
+	const util::colormap* get_scalar_colormap(ColorSource source) const;
+
+	std::string get_cache_file_name() const;
+	uint64_t get_cache_key() const;
+	bool read_cache(uint64_t key);
+	void write_cache(uint64_t key);
+
+	void setup_colormaps();
+	void create_colormap_luts(context& ctx);
+	std::string get_volume_file_name(const std::string& name) const;
+	void prepare_volumes();
+	bool build_segment_index();
+	void allocate_color_data(ColorSource source);
+	void prepare_colors(ColorSource source, size_t first, size_t last);
+	void upload_data(context& ctx);
+	void delete_gpu_buffers();
+	size_t get_gpu_buffer_size(bool compact) const;
+	void create_index_buffers(context& ctx);
+	void create_density_volume(const context& ctx, const box3 bbox);
+	void update_density_volume(const context& ctx);
+	void compute_density_volume(const box3 bbox);
+	void resolve_density_volume();
+	util::density_input get_density_input() const;
+	util::density_parameters get_density_parameters() const;
+	void upload_density_volume(const context& ctx);
+	std::string get_transparent_shader_defines() const;
 
 	void set_color_source(const context& ctx);
-	bool load_shader(context& ctx, shader_program& prog, std::string name, std::string defines = "");
+	void upload_colors(const context& ctx);
+	bool load_shader(const context& ctx, shader_program& prog, std::string name, std::string defines = "");
 	void create_buffers(const context& ctx);
-	void sort(context& ctx, const GLuint position_buffer, const GLuint index_buffer, const vec3& eye_position);
+	void sort(context& ctx, const vec3& eye_position);
 	void set_transparent_shader_uniforms(context& ctx, view* view_ptr, shader_program& prog);
 	void do_final_blend(context& ctx);
 	
 public:
 	class fiber_viewer();
+	~fiber_viewer();
 	std::string get_type_name() const { return "fiber_viewer"; }
 
 	void clear(cgv::render::context& ctx);
@@ -181,7 +329,4 @@ public:
 	void create_gui();
 };
 
-//Alaleh
-void rp2ColorMapping(float[3], float[3], float[3]);
-
 void getniidata();
@@ -0,0 +1,71 @@
+#version 430
+
+#define ENABLE_SPARSE_DENSITY 0
+
+/*
+	Samples the density volume of the ambient occlusion cone tracing at a texture coordinate of the dense volume and
+	a fractional mipmap level. The sparse volume is made of bricks of 8^3 voxels that also store the voxels one
+	before them along each axis, see density_bricks.h. The density texture is then the pool of all bricks and the
+	brick table gives the pool slot of every brick of every level plus one, or 0 for an empty brick.
+*/
+
+#if ENABLE_SPARSE_DENSITY == 1
+const int BRICK_SIZE = 8;
+const int BRICK_STORED_SIZE = BRICK_SIZE + 1;
+
+uniform int density_level_count;
+// Voxels along each axis of every level
+uniform ivec3 density_level_resolution[8];
+// Bricks along each axis in xyz and the first brick table entry in w of every level
+uniform ivec4 density_level_bricks[8];
+// Bricks along each axis of the pool
+uniform ivec3 brick_pool_slots;
+// Reciprocal of the pool resolution in voxels
+uniform vec3 brick_pool_texel_size;
+
+layout (std430, binding = 4) readonly buffer brick_table_buffer {
+	uint brick_table[];
+};
+
+float sample_density_level(sampler3D density_tex, vec3 pos, int level) {
+
+	// Voxel i of the level has its center at w = i + 1, brick b stores the voxels with centers from w = 8 * b on
+	vec3 w = pos * vec3(density_level_resolution[level]) + 0.5;
+	ivec4 bricks = density_level_bricks[level];
+	if(any(lessThan(w, vec3(0.0))))
+		return 0.0;
+
+	ivec3 b = ivec3(w) / BRICK_SIZE;
+	if(any(greaterThanEqual(b, bricks.xyz)))
+		return 0.0;
+
+	uint entry = brick_table[bricks.w + (b.z * bricks.y + b.y) * bricks.x + b.x];
+	if(entry == 0u)
+		return 0.0;
+
+	int slot = int(entry - 1u);
+	ivec3 s = ivec3(slot % brick_pool_slots.x, (slot / brick_pool_slots.x) % brick_pool_slots.y, slot / (brick_pool_slots.x * brick_pool_slots.y));
+
+	// The brick holds both voxels around the position, so the hardware filter does not reach into other bricks
+	vec3 local = w - vec3(b * BRICK_SIZE);
+	return textureLod(density_tex, (vec3(s * BRICK_STORED_SIZE) + local + 0.5) * brick_pool_texel_size, 0.0).r;
+}
+#endif
+
+float sample_density(sampler3D density_tex, vec3 pos, float level) {
+
+#if ENABLE_SPARSE_DENSITY == 1
+	// Mix the two levels around the fractional level like trilinear mipmap filtering
+	level = clamp(level, 0.0, float(density_level_count - 1));
+	int l0 = int(level);
+	int l1 = min(l0 + 1, density_level_count - 1);
+	float a = level - float(l0);
+
+	float density = sample_density_level(density_tex, pos, l0);
+	if(a > 0.0)
+		density = mix(density, sample_density_level(density_tex, pos, l1), a);
+	return density;
+#else
+	return textureLod(density_tex, pos, level).r;
+#endif
+}
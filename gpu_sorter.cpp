@@ -10,6 +10,10 @@ gpu_sorter::gpu_sorter() {
 	indices_out_ssbo = 0;
 	prefix_sum_ssbo = 0;
 	blocksums_ssbo = 0;
+
+	quantized_positions = false;
+	position_offset = vec3(0.0f);
+	position_scale = vec3(1.0f);
 }
 
 gpu_sorter::~gpu_sorter() {
@@ -17,6 +21,13 @@ gpu_sorter::~gpu_sorter() {
 	delete_buffers();
 }
 
+void gpu_sorter::set_position_quantization(bool quantized, const vec3& offset, const vec3& scale) {
+
+	quantized_positions = quantized;
+	position_offset = offset;
+	position_scale = scale;
+}
+
 bool gpu_sorter::init(context& ctx, size_t position_count) {
 
 	if(!load_shader_progs(ctx))
@@ -98,14 +109,18 @@ bool gpu_sorter::init(context& ctx, size_t position_count) {
 	return true;
 }
 
-void gpu_sorter::sort(context& ctx, GLuint position_buffer, GLuint index_buffer, vec3 eye_pos) {
+void gpu_sorter::sort(context& ctx, GLuint position_buffer, GLuint segment_buffer, GLuint index_buffer, vec3 eye_pos) {
 
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, position_buffer);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, distance_in_ssbo);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, index_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, segment_buffer);
 
 	distance_prog.enable(ctx);
 	distance_prog.set_uniform(ctx, "eye_pos", eye_pos);
+	distance_prog.set_uniform(ctx, "quantized_positions", quantized_positions);
+	distance_prog.set_uniform(ctx, "position_offset", position_offset);
+	distance_prog.set_uniform(ctx, "position_scale", position_scale);
 	glDispatchCompute(group_size, 1, 1);
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 	distance_prog.disable(ctx);
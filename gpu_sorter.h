@@ -22,6 +22,11 @@ private:
 	GLuint prefix_sum_ssbo;
 	GLuint blocksums_ssbo;
 
+	/// layout of the position buffer, see set_position_quantization
+	bool quantized_positions;
+	vec3 position_offset;
+	vec3 position_scale;
+
 	/// shader programs
 	shader_program distance_prog;
 	shader_program scan_local_prog;
@@ -36,7 +41,10 @@ public:
 	~gpu_sorter();
 
 	bool init(context& ctx, size_t position_count);
-	void sort(context& ctx, GLuint position_buffer, GLuint index_buffer, vec3 eye_position);
+	/// declare the positions as three 16 bit unsigned normalized values per point that are mapped to offset + scale * value, or as three floats if quantized is false
+	void set_position_quantization(bool quantized, const vec3& offset, const vec3& scale);
+	/// sort the segments given by the index of their first point in segment_buffer by distance to the eye, the sorted segment indices are written to index_buffer
+	void sort(context& ctx, GLuint position_buffer, GLuint segment_buffer, GLuint index_buffer, vec3 eye_position);
 
 	unsigned int get_padding() { return n_pad; }
 	unsigned int get_group_size() { return group_size; }
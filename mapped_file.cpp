@@ -0,0 +1,131 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file::mapped_file() {
+
+	ptr = nullptr;
+	length = 0;
+
+#ifdef _WIN32
+	file_handle = INVALID_HANDLE_VALUE;
+	mapping_handle = nullptr;
+#else
+	fd = -1;
+#endif
+}
+
+mapped_file::~mapped_file() {
+
+	close();
+}
+
+bool mapped_file::open(const std::string& file_name) {
+
+	close();
+
+#ifdef _WIN32
+	file_handle = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(file_handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) {
+		close();
+		return false;
+	}
+
+	mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!mapping_handle) {
+		close();
+		return false;
+	}
+
+	ptr = static_cast<const char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+	if(!ptr) {
+		close();
+		return false;
+	}
+
+	length = static_cast<size_t>(file_size.QuadPart);
+#else
+	fd = ::open(file_name.c_str(), O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		close();
+		return false;
+	}
+
+	void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	if(p == MAP_FAILED) {
+		close();
+		return false;
+	}
+
+	// The file is read front to back, so let the kernel read ahead aggressively
+	madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+
+	ptr = static_cast<const char*>(p);
+	length = static_cast<size_t>(st.st_size);
+#endif
+
+	return true;
+}
+
+void mapped_file::close() {
+
+#ifdef _WIN32
+	if(ptr)
+		UnmapViewOfFile(ptr);
+	if(mapping_handle)
+		CloseHandle(mapping_handle);
+	if(file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+
+	mapping_handle = nullptr;
+	file_handle = INVALID_HANDLE_VALUE;
+#else
+	if(ptr)
+		munmap(const_cast<char*>(ptr), length);
+	if(fd >= 0)
+		::close(fd);
+
+	fd = -1;
+#endif
+
+	ptr = nullptr;
+	length = 0;
+}
+
+uint64_t mapped_file::modification_time() const {
+
+#ifdef _WIN32
+	FILETIME write_time;
+	if(file_handle == INVALID_HANDLE_VALUE || !GetFileTime(file_handle, NULL, NULL, &write_time))
+		return 0u;
+
+	return ((uint64_t)write_time.dwHighDateTime << 32) | write_time.dwLowDateTime;
+#else
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0)
+		return 0u;
+
+#ifdef __APPLE__
+	return (uint64_t)st.st_mtimespec.tv_sec * 1000000000u + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+	return (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+#endif
+}
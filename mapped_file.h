@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+	Read-only memory mapping of a whole file. The mapped bytes stay valid until close() is called
+	or the object is destroyed. Used to parse large tractography files without copying them into
+	intermediate buffers.
+*/
+class mapped_file {
+private:
+	const char* ptr;
+	size_t length;
+
+#ifdef _WIN32
+	void* file_handle;
+	void* mapping_handle;
+#else
+	int fd;
+#endif
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+public:
+	mapped_file();
+	~mapped_file();
+
+	/// map the given file into memory and return whether this was successful
+	bool open(const std::string& file_name);
+	/// unmap the file if it is mapped
+	void close();
+
+	/// returns the time of the last modification of the mapped file in platform specific units or 0 if unknown
+	uint64_t modification_time() const;
+
+	bool is_open() const { return ptr != nullptr; }
+	const char* data() const { return ptr; }
+	size_t size() const { return length; }
+};
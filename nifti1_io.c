@@ -4867,13 +4867,131 @@ static znzFile nifti_image_load_prep( nifti_image *nim )
 }
 
 
+/*----------------------------------------------------------------------
+ * nifti_image_map_data  - use the data of a .nii file in place
+ *
+ * The data of uncompressed single file datasets that need no byte
+ * swapping is not read, but used from a private copy-on-write mapping
+ * of the file. Opening takes constant time, pages are only read when
+ * they are accessed, and the page cache is not duplicated in memory.
+ * Writing to the data is allowed and never changes the file. Unlike
+ * nifti_read_buffer, bad floats are left as they are in the file.
+ *
+ * return 0 on success, -1 if the data has to be read instead
+ *----------------------------------------------------------------------*/
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static int nifti_image_map_data( nifti_image *nim )
+{
+   size_t ntot, ioff, fsize, align;
+   void  *base;
+
+   if( nim == NULL || nim->data != NULL || nim->iname == NULL ) return -1;
+   if( nim->nifti_type != NIFTI_FTYPE_NIFTI1_1 ) return -1;
+   if( nim->iname_offset < 0 || nifti_is_gzfile(nim->iname) ) return -1;
+   if( nim->swapsize > 1 && nim->byteorder != nifti_short_order() ) return -1;
+
+   ntot = nifti_get_volsize(nim);
+   ioff = (size_t)nim->iname_offset;
+
+   /* the voxels must be aligned for their type when used in place */
+   align = nim->swapsize > 1 ? (size_t)nim->swapsize : 1;
+   if( ntot == 0 || ioff % align != 0 ) return -1;
+
+#ifdef _WIN32
+   {
+      HANDLE        file, mapping;
+      LARGE_INTEGER size;
+
+      file = CreateFileA(nim->iname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+      if( file == INVALID_HANDLE_VALUE ) return -1;
+
+      if( !GetFileSizeEx(file, &size) ||
+          (unsigned long long)size.QuadPart < (unsigned long long)(ioff + ntot) ){
+         CloseHandle(file);
+         return -1;
+      }
+      fsize = (size_t)size.QuadPart;
+
+      /* the view keeps the mapping alive, so both handles can be closed */
+      mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+      CloseHandle(file);
+      if( mapping == NULL ) return -1;
+
+      base = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+      CloseHandle(mapping);
+      if( base == NULL ) return -1;
+   }
+#else
+   {
+      struct stat st;
+      int         fd;
+
+      fd = open(nim->iname, O_RDONLY);
+      if( fd < 0 ) return -1;
+
+      if( fstat(fd, &st) != 0 || (size_t)st.st_size < ioff + ntot ){
+         close(fd);
+         return -1;
+      }
+      fsize = (size_t)st.st_size;
+
+      /* the mapping stays valid after closing the descriptor */
+      base = mmap(NULL, fsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if( base == MAP_FAILED ) return -1;
+   }
+#endif
+
+   nim->data          = (char *)base + ioff;
+   nim->data_map      = base;
+   nim->data_map_size = fsize;
+
+   if( g_opts.debug > 1 )
+      fprintf(stderr,"+d nifti_image_map_data: mapped %u bytes of '%s'\n",
+              (unsigned)ntot, nim->iname);
+
+   return 0;
+}
+
+/*----------------------------------------------------------------------
+ * nifti_image_free_data  - free or unmap the data of an image
+ *----------------------------------------------------------------------*/
+static void nifti_image_free_data( nifti_image *nim )
+{
+   if( nim->data_map != NULL ){
+#ifdef _WIN32
+      UnmapViewOfFile(nim->data_map);
+#else
+      munmap(nim->data_map, nim->data_map_size);
+#endif
+   } else if( nim->data != NULL )
+      free(nim->data);
+
+   nim->data          = NULL;
+   nim->data_map      = NULL;
+   nim->data_map_size = 0;
+}
+
+
 /*----------------------------------------------------------------------
  * nifti_image_load
  *----------------------------------------------------------------------*/
 /*! \fn int nifti_image_load( nifti_image *nim )
     \brief Load the image blob into a previously initialized nifti_image.
 
-        - If not yet set, the data buffer is allocated with calloc().
+        - If not yet set, the data of uncompressed .nii files that need
+          no byte swapping is mapped from the file instead of being read.
+        - Otherwise the data buffer is allocated with calloc().
         - The data buffer will be byteswapped if necessary.
         - The data buffer will not be scaled.
 
@@ -4891,6 +5009,10 @@ int nifti_image_load( nifti_image *nim )
    size_t ntot , ii ;
    znzFile fp ;
 
+   /**- use the data in place if the file allows it */
+   if( nim != NULL && nim->data == NULL && nifti_image_map_data( nim ) == 0 )
+      return 0;
+
    /**- open the file and position the FILE pointer */
    fp = nifti_image_load_prep( nim );
 
@@ -5031,10 +5153,8 @@ size_t nifti_read_buffer(znzFile fp, void* dataptr, size_t ntot,
 *//*------------------------------------------------------------------------*/
 void nifti_image_unload( nifti_image *nim )
 {
-   if( nim != NULL && nim->data != NULL ){
-     free(nim->data) ; nim->data = NULL ;
-   }
-   }
+   if( nim != NULL ) nifti_image_free_data( nim ) ;
+}
 
 /*--------------------------------------------------------------------------*/
 /*! free 'everything' about a nifti_image struct (including the passed struct)
@@ -5051,7 +5171,7 @@ void nifti_image_free( nifti_image *nim )
    if( nim == NULL ) return ;
    if( nim->fname != NULL ) free(nim->fname) ;
    if( nim->iname != NULL ) free(nim->iname) ;
-   if( nim->data  != NULL ) free(nim->data ) ;
+   nifti_image_free_data( nim ) ;
    (void)nifti_free_extensions( nim ) ;
    free(nim) ; }
 
@@ -5915,6 +6035,8 @@ nifti_image * nifti_copy_nim_info(const nifti_image * src)
   (void)nifti_copy_extensions(dest, src);
 
   dest->data = NULL;
+  dest->data_map = NULL;
+  dest->data_map_size = 0;
 
   return dest;
 }
@@ -167,6 +167,9 @@ typedef struct {                /*!< Image storage struct **/
   nifti1_extension * ext_list ; /*!< array of extension structs (with data) */
   analyze_75_orient_code analyze75_orient; /*!< for old analyze files, orient */
 
+  void  *data_map ;             /*!< file mapping that data points into, or NULL */
+  size_t data_map_size ;        /*!< size of the file mapping in bytes           */
+
 } nifti_image ;
 
 
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+	/// maximum number of threads used by the data parallel loops or 0 for all hardware threads, lets the
+	/// benchmarks measure how the loops scale
+	inline std::atomic<unsigned>& thread_limit() {
+
+		static std::atomic<unsigned> limit(0u);
+		return limit;
+	}
+
+	/// returns the number of worker threads to use for data parallel loops
+	inline unsigned thread_count() {
+
+		unsigned n = std::thread::hardware_concurrency();
+		n = n > 0 ? n : 1u;
+		unsigned limit = thread_limit();
+		return limit > 0u ? std::min(n, limit) : n;
+	}
+
+	/*
+		Splits the index range [0, count) into chunks of grain_size elements and calls func(begin, end)
+		for every chunk. Chunks are handed out dynamically to all available threads, so func must only
+		write to data owned by its own index range. The calling thread takes part in the work and the
+		function returns once all chunks have been processed.
+	*/
+	template<typename F>
+	void parallel_for(size_t count, size_t grain_size, F func) {
+
+		if(count == 0)
+			return;
+
+		grain_size = std::max(grain_size, size_t(1));
+		size_t chunk_count = (count + grain_size - 1) / grain_size;
+		unsigned n_threads = static_cast<unsigned>(std::min<size_t>(thread_count(), chunk_count));
+
+		if(n_threads <= 1) {
+			func(size_t(0), count);
+			return;
+		}
+
+		std::atomic<size_t> next_chunk(0);
+
+		auto worker = [&]() {
+			for(;;) {
+				size_t chunk = next_chunk.fetch_add(1);
+				if(chunk >= chunk_count)
+					break;
+
+				size_t begin = chunk * grain_size;
+				func(begin, std::min(begin + grain_size, count));
+			}
+		};
+
+		std::vector<std::thread> threads;
+		threads.reserve(n_threads - 1);
+		for(unsigned i = 1; i < n_threads; ++i)
+			threads.emplace_back(worker);
+
+		worker();
+
+		for(auto& thread : threads)
+			thread.join();
+	}
+
+	/// calls parallel_for with a grain size that gives every thread several chunks to balance uneven work
+	template<typename F>
+	void parallel_for(size_t count, F func) {
+
+		parallel_for(count, std::max(count / (16 * (size_t)thread_count()), size_t(1)), func);
+	}
+
+	/*
+		Work-stealing variant of parallel_for for iterations of very different cost, like tracts of a few or of
+		thousands of points. Every thread starts with an equal contiguous share of [0, count) and takes grain_size
+		iterations at a time from its front. A thread that runs out of work steals the back half of the largest
+		remaining share of another thread, so a few expensive iterations never leave the other threads idle.
+	*/
+	template<typename F>
+	void parallel_for_stealing(size_t count, size_t grain_size, F func) {
+
+		if(count == 0)
+			return;
+
+		grain_size = std::max(grain_size, size_t(1));
+		size_t chunk_count = (count + grain_size - 1) / grain_size;
+		unsigned n_threads = static_cast<unsigned>(std::min<size_t>(thread_count(), chunk_count));
+
+		if(n_threads <= 1) {
+			func(size_t(0), count);
+			return;
+		}
+
+		// Remaining iterations of every thread, on separate cache lines
+		struct alignas(64) work_range {
+			std::mutex mutex;
+			size_t begin = 0;
+			size_t end = 0;
+		};
+
+		std::vector<work_range> ranges(n_threads);
+		for(unsigned t = 0; t < n_threads; ++t) {
+			ranges[t].begin = count * t / n_threads;
+			ranges[t].end = count * (t + 1) / n_threads;
+		}
+
+		auto worker = [&](unsigned t) {
+			work_range& own = ranges[t];
+
+			for(;;) {
+				size_t begin = 0, end = 0;
+				{
+					std::lock_guard<std::mutex> lock(own.mutex);
+					if(own.begin < own.end) {
+						begin = own.begin;
+						end = std::min(begin + grain_size, own.end);
+						own.begin = end;
+					}
+				}
+
+				if(begin < end) {
+					func(begin, end);
+					continue;
+				}
+
+				// Find the thread with the most remaining work, locks are never held at the same time
+				unsigned victim = t;
+				size_t largest = 0;
+				for(unsigned v = 0; v < n_threads; ++v) {
+					if(v == t)
+						continue;
+
+					std::lock_guard<std::mutex> lock(ranges[v].mutex);
+					size_t remaining = ranges[v].end - ranges[v].begin;
+					if(remaining > largest) {
+						largest = remaining;
+						victim = v;
+					}
+				}
+
+				if(victim == t)
+					break;
+
+				{
+					std::lock_guard<std::mutex> lock(ranges[victim].mutex);
+					size_t remaining = ranges[victim].end - ranges[victim].begin;
+					if(remaining == 0)
+						continue;
+
+					// Take the back half, or everything if it is not more than one chunk
+					end = ranges[victim].end;
+					begin = remaining > grain_size ? end - remaining / 2 : ranges[victim].begin;
+					ranges[victim].end = begin;
+				}
+
+				std::lock_guard<std::mutex> lock(own.mutex);
+				own.begin = begin;
+				own.end = end;
+			}
+		};
+
+		std::vector<std::thread> threads;
+		threads.reserve(n_threads - 1);
+		for(unsigned t = 1; t < n_threads; ++t)
+			threads.emplace_back(worker, t);
+
+		worker(0u);
+
+		for(auto& thread : threads)
+			thread.join();
+	}
+}
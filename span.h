@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace util {
+
+	/*
+		Non-owning view of a contiguous array. Used to hand columns of the tractogram container to
+		processing functions without copying them.
+	*/
+	template<typename T>
+	class span {
+	private:
+		T* ptr;
+		size_t length;
+
+	public:
+		span() : ptr(nullptr), length(0) {}
+		span(T* data, size_t size) : ptr(data), length(size) {}
+
+		template<typename A>
+		span(std::vector<typename std::remove_const<T>::type, A>& v) : ptr(v.data()), length(v.size()) {}
+
+		template<typename A>
+		span(const std::vector<typename std::remove_const<T>::type, A>& v) : ptr(v.data()), length(v.size()) {}
+
+		T* data() const { return ptr; }
+		size_t size() const { return length; }
+		bool empty() const { return length == 0; }
+
+		T& operator[](size_t i) const { return ptr[i]; }
+
+		T* begin() const { return ptr; }
+		T* end() const { return ptr + length; }
+
+		/// returns the view of count elements starting at element first
+		span<T> subspan(size_t first, size_t count) const { return span<T>(ptr + first, count); }
+	};
+}
@@ -0,0 +1,134 @@
+#include "tractogram.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "parallel.h"
+
+void tractogram::resize_points(size_t n) {
+
+	x.resize(n);
+	y.resize(n);
+	z.resize(n);
+}
+
+void tractogram::add_tract(const std::vector<vec3>& points, const std::vector<float>& point_radii) {
+
+	size_t offset = point_count();
+
+	tracts.push_back(tract{ offset, points.size() });
+	resize_points(offset + points.size());
+
+	float* px = x.mutable_data() + offset;
+	float* py = y.mutable_data() + offset;
+	float* pz = z.mutable_data() + offset;
+
+	for(size_t i = 0; i < points.size(); ++i) {
+		px[i] = points[i][0];
+		py[i] = points[i][1];
+		pz[i] = points[i][2];
+	}
+
+	if(!point_radii.empty())
+		radii.append(point_radii.data(), point_radii.data() + point_radii.size());
+}
+
+void tractogram::clear() {
+
+	tracts.clear();
+	x.clear();
+	y.clear();
+	z.clear();
+	radii.clear();
+	scalar_names.clear();
+	scalars.clear();
+	property_names.clear();
+	properties.clear();
+}
+
+/*
+	Every coordinate array is reduced on its own in independent chunks, the inner loops only compare
+	contiguous floats and vectorize.
+*/
+tractogram::box3 tractogram::compute_bounding_box() const {
+
+	const size_t n = point_count();
+	const size_t block_size = 1u << 16;
+	const size_t block_count = (n + block_size - 1) / block_size;
+
+	std::vector<float> block_min(3 * block_count), block_max(3 * block_count);
+	const float* columns[3] = { x.data(), y.data(), z.data() };
+
+	util::parallel_for(block_count, 1, [&](size_t begin, size_t end) {
+		for(size_t b = begin; b < end; ++b) {
+			size_t first = b * block_size;
+			size_t last = std::min(first + block_size, n);
+
+			for(int c = 0; c < 3; ++c) {
+				const float* v = columns[c];
+				float lo = std::numeric_limits<float>::max();
+				float hi = -std::numeric_limits<float>::max();
+
+				for(size_t i = first; i < last; ++i) {
+					lo = std::min(lo, v[i]);
+					hi = std::max(hi, v[i]);
+				}
+
+				block_min[3 * b + c] = lo;
+				block_max[3 * b + c] = hi;
+			}
+		}
+	});
+
+	box3 bbox(vec3(1.0f), vec3(-1.0f));
+	for(size_t b = 0; b < block_count; ++b) {
+		bbox.add_point(vec3(block_min[3 * b], block_min[3 * b + 1], block_min[3 * b + 2]));
+		bbox.add_point(vec3(block_max[3 * b], block_max[3 * b + 1], block_max[3 * b + 2]));
+	}
+
+	return bbox;
+}
+
+void tractogram::translate(const vec3& offset) {
+
+	float* columns[3] = { x.mutable_data(), y.mutable_data(), z.mutable_data() };
+
+	util::parallel_for(point_count(), [&](size_t begin, size_t end) {
+		for(int c = 0; c < 3; ++c) {
+			float* v = columns[c];
+			const float o = offset[c];
+
+			for(size_t i = begin; i < end; ++i)
+				v[i] += o;
+		}
+	});
+}
+
+void tractogram::interleave_positions(size_t first, size_t count, float* out) const {
+
+	const float* px = x.data() + first;
+	const float* py = y.data() + first;
+	const float* pz = z.data() + first;
+
+	for(size_t i = 0; i < count; ++i) {
+		out[3 * i] = px[i];
+		out[3 * i + 1] = py[i];
+		out[3 * i + 2] = pz[i];
+	}
+}
+
+void tractogram::quantize_positions(size_t first, size_t count, const vec3& minimum, const vec3& extent, uint16_t* out) const {
+
+	const float* columns[3] = { x.data() + first, y.data() + first, z.data() + first };
+
+	for(int c = 0; c < 3; ++c) {
+		const float* v = columns[c];
+		const float o = minimum[c];
+		const float s = extent[c] > 0.0f ? 65535.0f / extent[c] : 0.0f;
+
+		for(size_t i = 0; i < count; ++i) {
+			float q = std::min(std::max((v[i] - o) * s, 0.0f), 65535.0f);
+			out[3 * i + c] = static_cast<uint16_t>(q + 0.5f);
+		}
+	}
+}
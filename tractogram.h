@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <cgv/render/render_types.h>
+
+#include "span.h"
+
+namespace util {
+
+	/// allocator returning memory aligned to the given number of bytes, used to keep columns aligned for SIMD loads
+	template<typename T, size_t alignment = 64>
+	struct aligned_allocator {
+		typedef T value_type;
+
+		template<typename U>
+		struct rebind { typedef aligned_allocator<U, alignment> other; };
+
+		aligned_allocator() {}
+		template<typename U>
+		aligned_allocator(const aligned_allocator<U, alignment>&) {}
+
+		T* allocate(size_t n) {
+
+			if(n == 0)
+				return nullptr;
+
+			size_t size = (n * sizeof(T) + alignment - 1) / alignment * alignment;
+#ifdef _WIN32
+			void* ptr = _aligned_malloc(size, alignment);
+#else
+			void* ptr = std::aligned_alloc(alignment, size);
+#endif
+			if(!ptr)
+				throw std::bad_alloc();
+			return static_cast<T*>(ptr);
+		}
+
+		void deallocate(T* ptr, size_t) {
+
+#ifdef _WIN32
+			_aligned_free(ptr);
+#else
+			std::free(ptr);
+#endif
+		}
+
+		template<typename U>
+		bool operator==(const aligned_allocator<U, alignment>&) const { return true; }
+		template<typename U>
+		bool operator!=(const aligned_allocator<U, alignment>&) const { return false; }
+	};
+
+	/// contiguous float array aligned to cache lines
+	typedef std::vector<float, aligned_allocator<float>> aligned_floats;
+
+	/*
+		Float array aligned to cache lines that either owns its values or references values owned elsewhere,
+		like a section of a mapped cache file. Element access is read-only. Writers call mutable_data once on a
+		single thread, which copies referenced values into owned storage, and then write through the returned
+		pointer, also from several threads. The referenced memory is never written.
+	*/
+	class float_column {
+	private:
+		aligned_floats values;
+		const float* external = nullptr;
+		size_t external_size = 0;
+
+		/// copy referenced values into owned storage
+		void own() {
+
+			if(external) {
+				values.assign(external, external + external_size);
+				external = nullptr;
+				external_size = 0;
+			}
+		}
+
+	public:
+		float_column() {}
+		explicit float_column(size_t n) : values(n) {}
+
+		/// reference size values at data, which need to stay valid until the column is cleared or written
+		void reference(const float* data, size_t size) {
+
+			aligned_floats().swap(values);
+			external = data;
+			external_size = size;
+		}
+
+		bool is_reference() const { return external != nullptr; }
+
+		size_t size() const { return external ? external_size : values.size(); }
+		bool empty() const { return size() == 0; }
+
+		const float* data() const { return external ? external : values.data(); }
+		/// returns the owned values for writing, copies referenced values first and is not thread-safe
+		float* mutable_data() { own(); return values.data(); }
+
+		const float& operator[](size_t i) const { return data()[i]; }
+
+		const float* begin() const { return data(); }
+		const float* end() const { return data() + size(); }
+
+		void resize(size_t n) { own(); values.resize(n); }
+		/// append the values in [first, last)
+		void append(const float* first, const float* last) { own(); values.insert(values.end(), first, last); }
+		void clear() { external = nullptr; external_size = 0; values.clear(); }
+	};
+}
+
+/*
+	Structure-of-arrays container for tractography data. The points of all tracts are stored consecutively
+	with the x, y and z coordinates in separate aligned arrays, so loops over the points vectorize. Every
+	tract references its range of points by a 64 bit offset and size. Per-point radii and scalars are
+	columns indexed like the points, per-tract properties are columns indexed like the tracts. The columns
+	can reference values in place, e.g. of a mapped cache file, as long as they are only read.
+*/
+class tractogram : public cgv::render::render_types {
+public:
+	struct tract {
+		uint64_t offset = 0u;
+		uint64_t size = 0u;
+	};
+
+	typedef util::float_column column;
+
+	std::vector<tract> tracts;
+	column x;
+	column y;
+	column z;
+	/// optional per-point radii, empty if the dataset has none
+	column radii;
+	std::vector<std::string> scalar_names;
+	std::vector<column> scalars;
+	std::vector<std::string> property_names;
+	std::vector<column> properties;
+
+	size_t point_count() const { return x.size(); }
+	size_t tract_count() const { return tracts.size(); }
+	bool has_radii() const { return radii.size() == x.size(); }
+
+	vec3 position(size_t i) const { return vec3(x[i], y[i], z[i]); }
+
+	util::span<const float> x_span() const { return util::span<const float>(x.data(), x.size()); }
+	util::span<const float> y_span() const { return util::span<const float>(y.data(), y.size()); }
+	util::span<const float> z_span() const { return util::span<const float>(z.data(), z.size()); }
+	util::span<const float> radius_span() const { return util::span<const float>(radii.data(), radii.size()); }
+	util::span<const float> scalar_span(size_t i) const { return util::span<const float>(scalars[i].data(), scalars[i].size()); }
+	util::span<const float> property_span(size_t i) const { return util::span<const float>(properties[i].data(), properties[i].size()); }
+
+	/// resize the coordinate arrays to hold n points
+	void resize_points(size_t n);
+	/// append a tract with the given points and optionally radii
+	void add_tract(const std::vector<vec3>& points, const std::vector<float>& point_radii = std::vector<float>());
+	/// release all data
+	void clear();
+
+	/// returns the bounding box of all points
+	box3 compute_bounding_box() const;
+	/// moves all points by the given offset
+	void translate(const vec3& offset);
+	/// writes the positions of count points starting at point first interleaved as xyz triplets to out
+	void interleave_positions(size_t first, size_t count, float* out) const;
+	/// writes the positions of count points starting at point first as interleaved 16 bit unsigned normalized
+	/// xyz triplets to out, where 0 maps to the given minimum and 65535 to minimum + extent
+	void quantize_positions(size_t first, size_t count, const vec3& minimum, const vec3& extent, uint16_t* out) const;
+};
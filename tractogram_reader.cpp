@@ -0,0 +1,564 @@
+#include "tractogram_reader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include "mapped_file.h"
+#include "parallel.h"
+#include "znzlib.h"
+
+typedef cgv::render::render_types::vec3 vec3;
+typedef cgv::render::render_types::vec4 vec4;
+typedef cgv::render::render_types::mat4 mat4;
+
+static bool ends_with(const std::string& str, const std::string& suffix) {
+
+	if(suffix.size() > str.size())
+		return false;
+
+	return std::equal(suffix.rbegin(), suffix.rend(), str.rbegin(), [](char a, char b) {
+		return std::tolower((unsigned char)a) == std::tolower((unsigned char)b);
+	});
+}
+
+static std::vector<tractogram_reader::factory>& reader_factories() {
+
+	static std::vector<tractogram_reader::factory> factories = {
+		[]() { return std::unique_ptr<tractogram_reader>(new trk_reader()); },
+		[]() { return std::unique_ptr<tractogram_reader>(new trk_gz_reader()); },
+		[]() { return std::unique_ptr<tractogram_reader>(new tck_reader()); }
+	};
+
+	return factories;
+}
+
+void tractogram_reader::register_reader(factory create_reader) {
+
+	reader_factories().push_back(create_reader);
+}
+
+std::unique_ptr<tractogram_reader> tractogram_reader::create(const std::string& file_name) {
+
+	const std::vector<factory>& factories = reader_factories();
+
+	for(auto it = factories.rbegin(); it != factories.rend(); ++it) {
+		std::unique_ptr<tractogram_reader> reader = (*it)();
+		if(reader->can_read(file_name))
+			return reader;
+	}
+
+	return std::unique_ptr<tractogram_reader>();
+}
+
+bool tractogram_reader::read_file(const std::string& file_name, const mat4& transform, tractogram& tg) {
+
+	std::unique_ptr<tractogram_reader> reader = create(file_name);
+	if(!reader) {
+		std::cout << "Error: unsupported tractography file format " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	if(!reader->read(file_name, transform, tg))
+		return false;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	seconds = std::max(seconds, 1e-6);
+
+	double input_gb = static_cast<double>(reader->get_input_size()) / (1024.0 * 1024.0 * 1024.0);
+	double decoded_gb = static_cast<double>(reader->get_decoded_size()) / (1024.0 * 1024.0 * 1024.0);
+
+	std::cout << "read " << reader->get_format_name() << " with " << tg.tracts.size() << " tracts (" << tg.point_count() << " points, " << tg.scalars.size() << " scalars, " << tg.properties.size() << " properties, " << input_gb << " GB) in " << seconds << "s (" << input_gb / seconds << " GB/s";
+	if(reader->get_decoded_size() != reader->get_input_size())
+		std::cout << ", " << decoded_gb / seconds << " GB/s decoded";
+	std::cout << ") ";
+
+	return true;
+}
+
+#ifdef FIBER_BENCHMARKS
+void tractogram_reader::benchmark(const std::string& file_name, unsigned repetitions) {
+
+	std::unique_ptr<tractogram_reader> reader = create(file_name);
+	if(!reader) {
+		std::cout << "Error: unsupported tractography file format " << file_name << "!" << std::endl;
+		return;
+	}
+
+	std::cout << "=====\nBenchmarking " << reader->get_format_name() << " reader on " << file_name << std::endl;
+
+	mat4 identity;
+	identity.identity();
+
+	double best_seconds = 0.0;
+	for(unsigned i = 0; i < repetitions; ++i) {
+		tractogram tg;
+
+		auto start = std::chrono::steady_clock::now();
+		if(!reader->read(file_name, identity, tg))
+			return;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		seconds = std::max(seconds, 1e-6);
+
+		double input_gb = static_cast<double>(reader->get_input_size()) / (1024.0 * 1024.0 * 1024.0);
+		double decoded_gb = static_cast<double>(reader->get_decoded_size()) / (1024.0 * 1024.0 * 1024.0);
+
+		std::cout << "run " << i << ": " << seconds << "s, " << input_gb / seconds << " GB/s input, " << decoded_gb / seconds << " GB/s decoded, " << static_cast<double>(tg.point_count()) / seconds * 1e-6 << " Mpoints/s" << std::endl;
+
+		if(i == 0 || seconds < best_seconds)
+			best_seconds = seconds;
+	}
+
+	double input_gb = static_cast<double>(reader->get_input_size()) / (1024.0 * 1024.0 * 1024.0);
+	std::cout << "best: " << best_seconds << "s, " << input_gb / best_seconds << " GB/s input\n=====" << std::endl;
+}
+#endif
+
+bool trk_reader::can_read(const std::string& file_name) const {
+
+	return ends_with(file_name, ".trk");
+}
+
+bool trk_reader::read(const std::string& file_name, const mat4& transform, tractogram& tg) {
+
+	mapped_file f;
+	if(!f.open(file_name)) {
+		std::cout << "Error: could not open " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	input_size = f.size();
+	return decode(f.data(), f.size(), file_name, transform, tg);
+}
+
+/*
+	The file is parsed in two phases: a sequential scan over the record headers builds an offset index
+	of all tracks, then the tracks are decoded and transformed on all cores into presized arrays.
+*/
+bool trk_reader::decode(const char* data, size_t size, const std::string& file_name, const mat4& transform, tractogram& tg) {
+
+	tg.clear();
+	decoded_size = 0;
+
+	// The header has a fixed size of 1000 bytes, hdr_size is stored in the last 4 of them
+	int32_t hdr_size = 0;
+	if(size >= 1000)
+		std::memcpy(&hdr_size, data + 996, sizeof(int32_t));
+
+	if(size < 1000 || std::strncmp(data, "TRACK", 6) != 0 || hdr_size != 1000) {
+		std::cout << "Error: could not read " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	short int n_scalars, n_properties;
+	std::memcpy(&n_scalars, data + 36, sizeof(short int));
+	std::memcpy(&n_properties, data + 238, sizeof(short int));
+
+	if(n_scalars < 0 || n_properties < 0) {
+		std::cout << "Error: could not read " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	// The header only has room for 10 names, additional columns get a generic name
+	tg.scalar_names.resize(n_scalars);
+	for(int i = 0; i < n_scalars; ++i) {
+		if(i < 10)
+			tg.scalar_names[i] = std::string(data + 38 + 20 * i, strnlen(data + 38 + 20 * i, 20));
+		if(tg.scalar_names[i].empty())
+			tg.scalar_names[i] = "scalar " + std::to_string(i);
+	}
+
+	tg.property_names.resize(n_properties);
+	for(int i = 0; i < n_properties; ++i) {
+		if(i < 10)
+			tg.property_names[i] = std::string(data + 240 + 20 * i, strnlen(data + 240 + 20 * i, 20));
+		if(tg.property_names[i].empty())
+			tg.property_names[i] = "property " + std::to_string(i);
+	}
+
+	mat4 vox_to_ras(1.0f);
+	std::memcpy(&vox_to_ras, data + 440, sizeof(mat4));
+	bool has_voxel_to_ras_transformation = vox_to_ras(3, 3) != 0.0f;
+
+	if(!has_voxel_to_ras_transformation)
+		vox_to_ras.identity();
+
+	vox_to_ras = transform * vox_to_ras;
+
+	int32_t n_count;
+	std::memcpy(&n_count, data + 988, sizeof(int32_t));
+
+	const size_t point_stride = (3 + (size_t)n_scalars) * sizeof(float);
+	const size_t property_bytes = (size_t)n_properties * sizeof(float);
+
+	// Phase 1: a sequential scan over the record headers that builds an index of the byte
+	// offset of every track record. The point offsets are stored in the tract list directly.
+	std::vector<size_t> record_offsets;
+	if(n_count > 0) {
+		record_offsets.reserve((size_t)n_count);
+		tg.tracts.reserve((size_t)n_count);
+	}
+
+	size_t point_count = 0;
+	size_t pos = 1000;
+	while(pos + sizeof(int32_t) <= size) {
+		int32_t track_count;
+		std::memcpy(&track_count, data + pos, sizeof(int32_t));
+
+		size_t record_size = sizeof(int32_t) + (size_t)track_count * point_stride + property_bytes;
+		if(track_count < 0 || pos + record_size > size) {
+			std::cout << "Warning: " << file_name << " is truncated, ignoring the last track" << std::endl;
+			break;
+		}
+
+		record_offsets.push_back(pos);
+		tg.tracts.push_back(tractogram::tract{ point_count, (uint64_t)track_count });
+		point_count += (size_t)track_count;
+		pos += record_size;
+	}
+
+	decoded_size = pos;
+	const size_t tract_count = tg.tracts.size();
+
+	if(n_count != 0 && (size_t)n_count != tract_count)
+		std::cout << "Warning: header of " << file_name << " states " << n_count << " tracks but " << tract_count << " were found" << std::endl;
+
+	// Phase 2: decode and transform disjoint ranges of tracks in parallel. Every track writes
+	// only to its own slice of the presized coordinate arrays, so no synchronization is needed.
+	// Scalars and properties are interleaved with the points in the file but stored as separate columns.
+	tg.resize_points(point_count);
+	tg.scalars.assign(n_scalars, tractogram::column(point_count));
+	tg.properties.assign(n_properties, tractogram::column(tract_count));
+
+	// The columns are fetched for writing once here, the threads only write through these pointers
+	float* const columns[3] = { tg.x.mutable_data(), tg.y.mutable_data(), tg.z.mutable_data() };
+	std::vector<float*> scalar_columns(n_scalars);
+	for(short int k = 0; k < n_scalars; ++k)
+		scalar_columns[k] = tg.scalars[k].mutable_data();
+	std::vector<float*> property_columns(n_properties);
+	for(short int k = 0; k < n_properties; ++k)
+		property_columns[k] = tg.properties[k].mutable_data();
+
+	util::parallel_for(tract_count, [&](size_t begin, size_t end) {
+		for(size_t i = begin; i < end; ++i) {
+			const char* record = data + record_offsets[i] + sizeof(int32_t);
+			const size_t o = tg.tracts[i].offset;
+			float* out_x = columns[0] + o;
+			float* out_y = columns[1] + o;
+			float* out_z = columns[2] + o;
+
+			for(size_t j = 0; j < tg.tracts[i].size; ++j) {
+				const char* point = record + j * point_stride;
+
+				vec3 p;
+				std::memcpy(&p, point, sizeof(vec3));
+
+				vec4 pos4 = vox_to_ras * vec4(p[0], p[1], p[2], 1.0f);
+				out_x[j] = pos4[0];
+				out_y[j] = pos4[1];
+				out_z[j] = pos4[2];
+
+				for(short int k = 0; k < n_scalars; ++k)
+					std::memcpy(scalar_columns[k] + o + j, point + sizeof(vec3) + k * sizeof(float), sizeof(float));
+			}
+
+			const char* properties = record + tg.tracts[i].size * point_stride;
+			for(short int k = 0; k < n_properties; ++k)
+				std::memcpy(property_columns[k] + i, properties + k * sizeof(float), sizeof(float));
+		}
+	});
+
+	return true;
+}
+
+bool trk_gz_reader::can_read(const std::string& file_name) const {
+
+	return ends_with(file_name, ".trk.gz");
+}
+
+/*
+	BGZF files (written by bgzip) consist of independent blocks, so the whole file is inflated by a single
+	read into a buffer of the uncompressed size, which inflates the blocks on all cores. A plain gzip stream
+	can only be inflated sequentially, it is read in chunks into a buffer presized from the uncompressed size
+	stored in the gzip trailer. In both cases the inflated records are decoded in parallel.
+*/
+bool trk_gz_reader::read(const std::string& file_name, const mat4& transform, tractogram& tg) {
+
+	// The last 4 bytes of a gzip stream hold the uncompressed size modulo 2^32, use it as a size hint
+	size_t size_hint = 0;
+	{
+		mapped_file f;
+		if(!f.open(file_name)) {
+			std::cout << "Error: could not open " << file_name << "!" << std::endl;
+			return false;
+		}
+
+		input_size = f.size();
+
+		if(f.size() < 18 || (unsigned char)f.data()[0] != 0x1f || (unsigned char)f.data()[1] != 0x8b) {
+			std::cout << "Error: " << file_name << " is not a gzip file!" << std::endl;
+			return false;
+		}
+
+		uint32_t isize;
+		std::memcpy(&isize, f.data() + f.size() - 4, sizeof(uint32_t));
+		size_hint = std::max((size_t)isize, f.size());
+	}
+
+	znzFile zf = znzopen(file_name.c_str(), "rb", 1);
+	if(znz_isnull(zf)) {
+		std::cout << "Error: could not open " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	std::vector<char> buffer;
+	size_t size = 0;
+	bool corrupt = false;
+
+	const long long bgzf_size = znz_bgzf_size(zf);
+	if(bgzf_size >= 0) {
+		buffer.resize((size_t)bgzf_size);
+		size = znzread(buffer.data(), 1, buffer.size(), zf);
+		corrupt = size != buffer.size();
+	} else {
+		buffer.resize(size_hint);
+		const size_t chunk_size = 64u * 1024u * 1024u;
+
+		for(;;) {
+			if(buffer.size() - size < chunk_size)
+				buffer.resize(buffer.size() + chunk_size);
+
+			size_t n = znzread(buffer.data() + size, 1, chunk_size, zf);
+			if(n == (size_t)-1) {
+				corrupt = true;
+				break;
+			}
+			size += n;
+
+			if(n < chunk_size)
+				break;
+		}
+	}
+
+	znzclose(zf);
+
+	if(corrupt) {
+		std::cout << "Error: " << file_name << " is corrupt!" << std::endl;
+		return false;
+	}
+
+	// Without zlib support znzlib passes the compressed bytes through unchanged
+	if(size >= 2 && (unsigned char)buffer[0] == 0x1f && (unsigned char)buffer[1] == 0x8b) {
+		std::cout << "Error: cannot inflate " << file_name << ", znzlib was built without HAVE_LIBZ!" << std::endl;
+		return false;
+	}
+
+	return decode(buffer.data(), size, file_name, transform, tg);
+}
+
+bool tck_reader::can_read(const std::string& file_name) const {
+
+	return ends_with(file_name, ".tck");
+}
+
+/// reads one coordinate of the given type and byte order
+template<typename T>
+static float read_coordinate(const char* p, bool swap) {
+
+	char bytes[sizeof(T)];
+	std::memcpy(bytes, p, sizeof(T));
+	if(swap)
+		std::reverse(bytes, bytes + sizeof(T));
+
+	T value;
+	std::memcpy(&value, bytes, sizeof(T));
+	return static_cast<float>(value);
+}
+
+/*
+	The data section is scanned for delimiter triplets in independent blocks on all cores. The delimiters
+	of all blocks are then merged in order into the tract list and finally the points of every tract are
+	converted and transformed in parallel into the presized position array.
+*/
+bool tck_reader::read(const std::string& file_name, const mat4& transform, tractogram& tg) {
+
+	tg.clear();
+	input_size = 0;
+	decoded_size = 0;
+
+	mapped_file f;
+	if(!f.open(file_name)) {
+		std::cout << "Error: could not open " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	const char* data = f.data();
+	const size_t file_size = f.size();
+	input_size = file_size;
+
+	const char magic[] = "mrtrix tracks";
+	if(file_size < sizeof(magic) || std::strncmp(data, magic, sizeof(magic) - 1) != 0) {
+		std::cout << "Error: could not read " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	// Parse the header lines up to END
+	size_t data_offset = 0;
+	std::string datatype;
+	long long count = -1;
+	bool found_end = false;
+
+	size_t pos = 0;
+	while(pos < file_size && !found_end) {
+		const char* line_end = static_cast<const char*>(std::memchr(data + pos, '\n', file_size - pos));
+		size_t next = line_end ? line_end - data + 1 : file_size;
+
+		std::string line(data + pos, next - pos);
+		while(!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+			line.pop_back();
+
+		pos = next;
+
+		if(line == "END") {
+			found_end = true;
+			break;
+		}
+
+		size_t colon = line.find(':');
+		if(colon == std::string::npos)
+			continue;
+
+		std::string key = line.substr(0, colon);
+		std::istringstream value(line.substr(colon + 1));
+
+		if(key == "file") {
+			std::string dot;
+			value >> dot >> data_offset;
+		} else if(key == "datatype") {
+			value >> datatype;
+		} else if(key == "count") {
+			value >> count;
+		}
+	}
+
+	bool is_double = datatype == "Float64LE" || datatype == "Float64BE";
+	bool is_big_endian = datatype == "Float32BE" || datatype == "Float64BE";
+	bool is_valid_type = is_double || datatype == "Float32LE" || datatype == "Float32BE";
+
+	if(!found_end || !is_valid_type || data_offset < pos || data_offset > file_size) {
+		std::cout << "Error: could not read " << file_name << "!" << std::endl;
+		return false;
+	}
+
+	uint16_t byte_order_test = 1;
+	bool is_little_endian_host = *reinterpret_cast<const char*>(&byte_order_test) == 1;
+	bool swap = is_big_endian == is_little_endian_host;
+
+	const size_t component_size = is_double ? sizeof(double) : sizeof(float);
+	const size_t triplet_size = 3 * component_size;
+	const char* triplets = data + data_offset;
+	const size_t triplet_count = (file_size - data_offset) / triplet_size;
+
+	auto read_triplet = [&](size_t i, float* xyz) {
+		const char* p = triplets + i * triplet_size;
+		for(int c = 0; c < 3; ++c)
+			xyz[c] = is_double ? read_coordinate<double>(p + c * component_size, swap) : read_coordinate<float>(p + c * component_size, swap);
+	};
+
+	// Scan blocks of triplets for track (NaN) and file (Inf) delimiters in parallel
+	const size_t block_size = 1u << 20;
+	const size_t block_count = (triplet_count + block_size - 1) / block_size;
+
+	std::vector<std::vector<size_t>> block_delimiters(block_count);
+	std::vector<size_t> block_file_end(block_count, triplet_count);
+
+	util::parallel_for(block_count, 1, [&](size_t begin, size_t end) {
+		for(size_t b = begin; b < end; ++b) {
+			size_t first = b * block_size;
+			size_t last = std::min(first + block_size, triplet_count);
+
+			for(size_t i = first; i < last; ++i) {
+				float xyz[3];
+				read_triplet(i, xyz);
+
+				if(std::isnan(xyz[0])) {
+					block_delimiters[b].push_back(i);
+				} else if(std::isinf(xyz[0])) {
+					block_file_end[b] = i;
+					break;
+				}
+			}
+		}
+	});
+
+	// Merge the delimiters of all blocks up to the end of file marker
+	std::vector<size_t> track_starts;
+	if(count > 0)
+		track_starts.reserve((size_t)count);
+
+	size_t file_end = triplet_count;
+	size_t track_start = 0;
+
+	for(size_t b = 0; b < block_count; ++b) {
+		for(size_t d : block_delimiters[b]) {
+			if(d >= block_file_end[b])
+				break;
+
+			track_starts.push_back(track_start);
+			tg.tracts.push_back(tractogram::tract{ track_start - track_starts.size() + 1, d - track_start });
+			track_start = d + 1;
+		}
+
+		if(block_file_end[b] < triplet_count) {
+			file_end = block_file_end[b];
+			break;
+		}
+	}
+
+	// Points after the last track delimiter belong to an unterminated track
+	if(track_start < file_end) {
+		std::cout << "Warning: " << file_name << " is truncated, keeping the unterminated last track" << std::endl;
+		track_starts.push_back(track_start);
+		tg.tracts.push_back(tractogram::tract{ track_start - track_starts.size() + 1, file_end - track_start });
+	}
+
+	const size_t tract_count = tg.tracts.size();
+	decoded_size = file_end * triplet_size;
+
+	if(count >= 0 && (size_t)count != tract_count)
+		std::cout << "Warning: header of " << file_name << " states " << count << " tracks but " << tract_count << " were found" << std::endl;
+
+	size_t point_count = tract_count > 0 ? (size_t)(tg.tracts.back().offset + tg.tracts.back().size) : 0;
+	tg.resize_points(point_count);
+
+	// Convert and transform the points of disjoint ranges of tracks in parallel
+	float* const columns[3] = { tg.x.mutable_data(), tg.y.mutable_data(), tg.z.mutable_data() };
+
+	util::parallel_for(tract_count, [&](size_t begin, size_t end) {
+		for(size_t i = begin; i < end; ++i) {
+			const size_t o = tg.tracts[i].offset;
+			float* out_x = columns[0] + o;
+			float* out_y = columns[1] + o;
+			float* out_z = columns[2] + o;
+
+			for(size_t j = 0; j < tg.tracts[i].size; ++j) {
+				float xyz[3];
+				read_triplet(track_starts[i] + j, xyz);
+
+				vec4 pos4 = transform * vec4(xyz[0], xyz[1], xyz[2], 1.0f);
+				out_x[j] = pos4[0];
+				out_y[j] = pos4[1];
+				out_z[j] = pos4[2];
+			}
+		}
+	});
+
+	return true;
+}
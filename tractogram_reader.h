@@ -0,0 +1,87 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cgv/render/render_types.h>
+
+#include "tractogram.h"
+
+/*
+	Interface for tractography file readers. Every backend decodes its format into a tractogram and
+	applies the given transformation to all positions while decoding, so the caller never needs an
+	additional pass over the points. Backends are selected by file name in create, additional backends
+	can be added with register_reader.
+*/
+class tractogram_reader : public cgv::render::render_types {
+protected:
+	/// number of bytes read from the file by the last call to read
+	size_t input_size;
+	/// number of bytes of tract data decoded by the last call to read, larger than input_size for compressed files
+	size_t decoded_size;
+
+public:
+	typedef std::unique_ptr<tractogram_reader>(*factory)();
+
+	tractogram_reader() : input_size(0), decoded_size(0) {}
+	virtual ~tractogram_reader() {}
+
+	/// name of the file format used in messages
+	virtual const char* get_format_name() const = 0;
+	/// return whether this reader handles files with the given name
+	virtual bool can_read(const std::string& file_name) const = 0;
+	/// read the given file into tg and transform all positions by transform, return whether this was successful
+	virtual bool read(const std::string& file_name, const mat4& transform, tractogram& tg) = 0;
+
+	size_t get_input_size() const { return input_size; }
+	size_t get_decoded_size() const { return decoded_size; }
+
+	/// add a backend, backends registered later take precedence over earlier ones
+	static void register_reader(factory create_reader);
+	/// return a reader for the given file or an empty pointer if no backend handles it
+	static std::unique_ptr<tractogram_reader> create(const std::string& file_name);
+	/// read the given file with the matching backend and print the achieved throughput
+	static bool read_file(const std::string& file_name, const mat4& transform, tractogram& tg);
+#ifdef FIBER_BENCHMARKS
+	/// read the given file repeatedly and print the throughput of every run and the best run
+	static void benchmark(const std::string& file_name, unsigned repetitions = 5u);
+#endif
+};
+
+/*
+	Reader for TrackVis .trk files as specified at http://www.trackvis.org/docs/?subsect=fileformat.
+*/
+class trk_reader : public tractogram_reader {
+protected:
+	/// decode a complete .trk file held in memory
+	bool decode(const char* data, size_t size, const std::string& file_name, const mat4& transform, tractogram& tg);
+
+public:
+	const char* get_format_name() const { return "trk"; }
+	bool can_read(const std::string& file_name) const;
+	bool read(const std::string& file_name, const mat4& transform, tractogram& tg);
+};
+
+/*
+	Reader for gzip compressed TrackVis files (.trk.gz). The file is inflated through znzlib, which
+	needs to be built with HAVE_LIBZ, and then decoded like an uncompressed .trk file. Files compressed
+	with bgzip are inflated on all cores, plain gzip files on one.
+*/
+class trk_gz_reader : public trk_reader {
+public:
+	const char* get_format_name() const { return "trk.gz"; }
+	bool can_read(const std::string& file_name) const;
+	bool read(const std::string& file_name, const mat4& transform, tractogram& tg);
+};
+
+/*
+	Reader for MRtrix .tck files. The header is a list of key: value lines terminated by END, the data
+	is a sequence of xyz triplets where a NaN triplet ends a track and an Inf triplet ends the file.
+*/
+class tck_reader : public tractogram_reader {
+public:
+	const char* get_format_name() const { return "tck"; }
+	bool can_read(const std::string& file_name) const;
+	bool read(const std::string& file_name, const mat4& transform, tractogram& tg);
+};
@@ -30,6 +30,11 @@ tube_render_style::tube_render_style() : material("default") {
 	sample_dirs[0] = vec3(0.0f, 1.0f, 0.0f);
 	sample_dirs[1] = vec3(0.0f, 1.0f, 0.0f);
 	sample_dirs[2] = vec3(0.0f, 1.0f, 0.0f);
+
+	sparse_density = false;
+	density_level_count = 0;
+	brick_pool_slots = ivec3(0);
+	brick_pool_texel_size = vec3(1.0f);
 }
 
 tube_render_style* tube_renderer::create_render_style() const {
@@ -42,6 +47,11 @@ tube_renderer::tube_renderer() {
 	has_positions = false;
 	has_colors = false;
 	has_radii = false;
+	has_scalars = false;
+	colormap = nullptr;
+
+	position_offset = vec3(0.0f);
+	position_scale = vec3(1.0f);
 
 	trs = nullptr;
 	default_render_style = nullptr;
@@ -58,6 +68,8 @@ void tube_renderer::destruct(const context& ctx) {
 	has_positions = false;
 	has_colors = false;
 	has_radii = false;
+	has_scalars = false;
+	colormap = nullptr;
 
 	rasterize_prog.destruct(ctx);
 	shading_prog.destruct(ctx);
@@ -92,6 +104,8 @@ std::string tube_renderer::build_define_string() {
 
 	std::string defines = "ENABLE_AMBIENT_OCCLUSION=";
 	defines += std::to_string((int)trs->enable_ambient_occlusion);
+	defines += ";ENABLE_SPARSE_DENSITY=";
+	defines += std::to_string((int)trs->sparse_density);
 	
 	return defines;
 }
@@ -165,7 +179,7 @@ bool tube_renderer::disable(context& ctx) {
 	return res;
 }
 
-void tube_renderer::rasterize(context& ctx, GLsizei count) {
+void tube_renderer::rasterize(context& ctx, GLsizei count, GLuint index_buffer) {
 
 	rasterize_prog.enable(ctx);
 	if(!has_radii)
@@ -173,8 +187,23 @@ void tube_renderer::rasterize(context& ctx, GLsizei count) {
 	rasterize_prog.set_uniform(ctx, "radius_scale", trs->radius_scale);
 	rasterize_prog.set_uniform(ctx, "eye_pos", eye_position);
 	rasterize_prog.set_uniform(ctx, "view_dir", view_direction);
-	
-	glDrawArrays(GL_LINES, (GLint)0, count);
+	rasterize_prog.set_uniform(ctx, "position_offset", position_offset);
+	rasterize_prog.set_uniform(ctx, "position_scale", position_scale);
+	rasterize_prog.set_uniform(ctx, "use_colormap", colormap != nullptr && has_scalars);
+
+	if(colormap)
+		colormap->enable(ctx, 5);
+
+	if(index_buffer) {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+		glDrawElements(GL_LINES, count, GL_UNSIGNED_INT, (void*)0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	} else {
+		glDrawArrays(GL_LINES, (GLint)0, count);
+	}
+
+	if(colormap)
+		colormap->disable(ctx);
 
 	rasterize_prog.disable(ctx);
 }
@@ -199,6 +228,14 @@ void tube_renderer::shade(context& ctx) {
 		shading_prog.set_uniform(ctx, "texel_size", trs->texel_size);
 		shading_prog.set_uniform(ctx, "cone_angle_factor", trs->cone_angle_factor);
 		shading_prog.set_uniform_array(ctx, "sample_dirs", trs->sample_dirs);
+
+		if(trs->sparse_density) {
+			shading_prog.set_uniform(ctx, "density_level_count", trs->density_level_count);
+			shading_prog.set_uniform_array(ctx, "density_level_resolution", trs->density_level_resolution);
+			shading_prog.set_uniform_array(ctx, "density_level_bricks", trs->density_level_bricks);
+			shading_prog.set_uniform(ctx, "brick_pool_slots", trs->brick_pool_slots);
+			shading_prog.set_uniform(ctx, "brick_pool_texel_size", trs->brick_pool_texel_size);
+		}
 	}
 
 	mat4 MV(ctx.get_modelview_matrix());
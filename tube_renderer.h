@@ -2,6 +2,7 @@
 
 #include <cgv/render/context.h>
 #include <cgv/render/shader_program.h>
+#include <cgv/render/texture.h>
 #include <cgv/render/vertex_buffer.h>
 #include <cgv/render/attribute_array_binding.h>
 #include <cgv_gl/gl/gl_context.h>
@@ -39,6 +40,15 @@ struct tube_render_style : public render_types {
 	float texel_size;
 	float cone_angle_factor;
 	std::vector<vec3> sample_dirs;
+
+	/// whether the density texture holds the brick pool of a sparse density volume (see density_bricks.h), the brick table
+	/// is then bound as shader storage buffer 4
+	bool sparse_density;
+	int density_level_count;
+	std::vector<ivec3> density_level_resolution;
+	std::vector<ivec4> density_level_bricks;
+	ivec3 brick_pool_slots;
+	vec3 brick_pool_texel_size;
 	/// construct with default values
 	tube_render_style();
 };
@@ -62,6 +72,10 @@ protected:
 	bool has_colors;
 	/// whether the radius is set individually for each position
 	bool has_radii;
+	/// whether the scalar attribute is defined
+	bool has_scalars;
+	/// 1D color map texture the scalar attribute is mapped through instead of using the color attribute, nullptr to use the colors
+	texture* colormap;
 	/// whether the shader should be rebuilt after a define update
 	std::string shader_defines;
 	/// default render style
@@ -74,6 +88,9 @@ protected:
 	vec3 eye_position;
 	///
 	vec3 view_direction;
+	/// transformation applied to the position attribute in the vertex shader
+	vec3 position_offset;
+	vec3 position_scale;
 	///
 	template <typename T>
 	bool set_attribute_array(const context& ctx, int loc, const T& array) {
@@ -95,6 +112,22 @@ protected:
 			res = aab.set_attribute_array(ctx, loc, array_descriptor_traits<T>::get_type_descriptor(array), *vbo_ptr, 0, array_descriptor_traits<T>::get_nr_elements(array));
 		return res;
 	}
+	/// allocate a vertex buffer for count elements of the given type and size without data, bind it to the given location and return its OpenGL handle or 0 on failure
+	GLuint create_attribute_buffer(const context& ctx, int loc, const type_descriptor& td, size_t element_size, size_t count) {
+
+		vertex_buffer*& vbo_ptr = vbos[loc];
+		if(vbo_ptr)
+			vbo_ptr->destruct(ctx);
+		else
+			vbo_ptr = new vertex_buffer();
+
+		// Keep the size a multiple of 4 bytes, so the buffer can be copied into shader storage buffers
+		if(!vbo_ptr->create(ctx, (count * element_size + 3) / 4 * 4))
+			return 0;
+		if(!aab.set_attribute_array(ctx, loc, td, *vbo_ptr, 0, count, (unsigned)element_size))
+			return 0;
+		return (const GLuint&)vbo_ptr->handle - 1;
+	}
 	///
 	std::string build_define_string();
 	///
@@ -128,6 +161,22 @@ public:
 		has_positions = true;
 		set_attribute_array(ctx, rasterize_prog.get_attribute_location(ctx, "position"), positions);
 	}
+	/// allocate the position attribute for count points without data and return the OpenGL handle of its buffer, which the caller fills through a mapping.
+	/// Quantized positions are three 16 bit unsigned normalized values per point, see set_position_quantization.
+	GLuint create_position_buffer(const context& ctx, size_t count, bool quantized = false) {
+
+		has_positions = true;
+		int loc = rasterize_prog.get_attribute_location(ctx, "position");
+		if(quantized)
+			return create_attribute_buffer(ctx, loc, type_descriptor(cgv::type::info::TI_UINT16, 3, true), 3 * sizeof(uint16_t), count);
+		return create_attribute_buffer(ctx, loc, element_descriptor_traits<vec3>::get_type_descriptor(vec3()), sizeof(vec3), count);
+	}
+	/// set the transformation of positions from the range [0,1] of quantized positions to world space, use an offset of 0 and a scale of 1 for float positions
+	void set_position_quantization(const vec3& offset, const vec3& scale) {
+
+		position_offset = offset;
+		position_scale = scale;
+	}
 	/// method to set the color attribute from a vector of colors of type rgba
 	void set_color_array(const context& ctx, const std::vector<rgba>& colors) {
 
@@ -140,14 +189,60 @@ public:
 		has_radii = true;
 		set_attribute_array(ctx, rasterize_prog.get_attribute_location(ctx, "radius"), radii);
 	}
+	/// method to set the color attribute from a vector of colors packed into 8 bit per component
+	void set_color_array(const context& ctx, const std::vector<rgba8>& colors) {
+
+		has_colors = true;
+		set_attribute_array(ctx, rasterize_prog.get_attribute_location(ctx, "color"), colors);
+	}
+	/// method to set the scalar attribute from a contiguous array of count 16 bit unsigned normalized scalars
+	void set_scalar_array(const context& ctx, const uint16_t* scalars, size_t count) {
+
+		has_scalars = true;
+		int loc = rasterize_prog.get_attribute_location(ctx, "scalar");
+		if(create_attribute_buffer(ctx, loc, type_descriptor(cgv::type::info::TI_UINT16, 1, true), sizeof(uint16_t), count))
+			vbos[loc]->replace(ctx, 0, scalars, count);
+	}
+	/// map the scalar attribute through the given 1D texture to obtain the colors, nullptr to use the color attribute again
+	void set_colormap(texture* _colormap) {
+
+		colormap = _colormap;
+	}
+	/// method to set the radius attribute from a contiguous array of count radii
+	void set_radius_array(const context& ctx, const float* radii, size_t count) {
+
+		has_radii = true;
+		int loc = rasterize_prog.get_attribute_location(ctx, "radius");
+		if(create_attribute_buffer(ctx, loc, element_descriptor_traits<float>::get_type_descriptor(0.0f), sizeof(float), count))
+			vbos[loc]->replace(ctx, 0, radii, count);
+	}
+	/// replace count elements starting at element first of an attribute that was set before with an array of the same size
+	template <typename T>
+	bool replace_attribute_range(const context& ctx, const std::string& attr_name, const std::vector<T>& array, size_t first, size_t count) {
+
+		if(first + count > array.size())
+			return false;
+
+		return replace_attribute_range(ctx, attr_name, array.data() + first, first, count);
+	}
+	/// replace count elements starting at element first of an attribute that was set before with the count elements given by data
+	template <typename T>
+	bool replace_attribute_range(const context& ctx, const std::string& attr_name, const T* data, size_t first, size_t count) {
+
+		auto it = vbos.find(rasterize_prog.get_attribute_location(ctx, attr_name));
+		if(it == vbos.end() || !it->second)
+			return false;
+
+		return it->second->replace(ctx, first * sizeof(T), data, count);
+	}
 	/// returns the OpenGL handle to the specified buffer of -1 if the buffer does not exist
 	int get_vbo(const context& ctx, const std::string attr_name);
 	///
 	bool enable(context& ctx);
 	///
 	bool disable(context& ctx);
-	///
-	void rasterize(context& ctx, GLsizei count);
+	/// rasterize count line vertices, taken from the given element buffer if index_buffer is not 0
+	void rasterize(context& ctx, GLsizei count, GLuint index_buffer = 0);
 	///
 	void shade(context& ctx);
 };
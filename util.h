@@ -55,6 +55,7 @@ namespace util {
 	template<typename T>
 	struct texture_container {
 		std::vector<T> data;
+		uvec3 resolution = uvec3(0u);
 		cgv::data::const_data_view view;
 		cgv::data::data_format* format = nullptr;
 		cgv::render::texture texture;
@@ -261,30 +262,4 @@ namespace util {
 		coord[0] = b % size[0];
 		return coord;
 	}
-
-	struct linear_interpolator {
-		std::vector<rgba> values;
-
-		rgba interpolate(float alpha) {
-
-			unsigned count = values.size();
-
-			if(count == 0)
-				return rgba(0.0f);
-			else if(count == 1)
-				return values[0];
-
-			alpha = cgv::math::clamp(alpha, 0.0f, 1.0f);
-			
-
-			float fidx = alpha * (float)(count - 1u);
-			unsigned idx = (unsigned)fidx;
-			float a = cgv::math::clamp(fidx - idx, 0.0f, 1.0f);
-
-			if(idx == count - 1)
-				return values[idx];
-			
-			return (1.0f - a) * values[idx] + a * values[idx + 1];
-		}
-	};
 }
@@ -0,0 +1,186 @@
+#include "volume_sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "parallel.h"
+
+namespace {
+
+	/// converts count voxels of type T to float and applies the NIfTI value scaling, non-finite values become 0
+	template<typename T>
+	void convert_voxels(const void* src, size_t count, float slope, float inter, float* dst) {
+
+		const T* values = static_cast<const T*>(src);
+		for(size_t i = 0; i < count; ++i) {
+			float v = slope * static_cast<float>(values[i]) + inter;
+			dst[i] = std::isfinite(v) ? v : 0.0f;
+		}
+	}
+}
+
+volume_sampler::volume_sampler() {
+
+	clear();
+}
+
+void volume_sampler::clear() {
+
+	resolution = uvec3(0u);
+	data.clear();
+	world_to_voxel.identity();
+	position_to_world.identity();
+	update_affine();
+}
+
+/*
+	Combines the position and voxel transformations into the three rows needed to compute voxel coordinates.
+*/
+void volume_sampler::update_affine() {
+
+	for(int r = 0; r < 3; ++r) {
+		for(int c = 0; c < 4; ++c) {
+			float sum = 0.0f;
+			for(int k = 0; k < 4; ++k)
+				sum += world_to_voxel(r, k) * position_to_world(k, c);
+			affine[r][c] = sum;
+		}
+	}
+}
+
+bool volume_sampler::set_nifti(const nifti_image* image) {
+
+	resolution = uvec3(0u);
+	data.clear();
+
+	if(!image || !image->data || image->nx <= 0 || image->ny <= 0 || image->nz <= 0)
+		return false;
+
+	const size_t count = (size_t)image->nx * image->ny * image->nz;
+	// A slope of 0 means the values are not scaled
+	const float slope = image->scl_slope != 0.0f ? image->scl_slope : 1.0f;
+	const float inter = image->scl_slope != 0.0f ? image->scl_inter : 0.0f;
+
+	std::vector<float> voxels(count);
+	switch(image->datatype) {
+	case DT_FLOAT32: convert_voxels<float>(image->data, count, slope, inter, voxels.data()); break;
+	case DT_FLOAT64: convert_voxels<double>(image->data, count, slope, inter, voxels.data()); break;
+	case DT_INT8: convert_voxels<int8_t>(image->data, count, slope, inter, voxels.data()); break;
+	case DT_UINT8: convert_voxels<uint8_t>(image->data, count, slope, inter, voxels.data()); break;
+	case DT_INT16: convert_voxels<int16_t>(image->data, count, slope, inter, voxels.data()); break;
+	case DT_UINT16: convert_voxels<uint16_t>(image->data, count, slope, inter, voxels.data()); break;
+	case DT_INT32: convert_voxels<int32_t>(image->data, count, slope, inter, voxels.data()); break;
+	case DT_UINT32: convert_voxels<uint32_t>(image->data, count, slope, inter, voxels.data()); break;
+	default:
+		return false;
+	}
+
+	// Prefer the sform, fall back to the qform and to the plain voxel spacing without either
+	mat4 m;
+	m.identity();
+	if(image->sform_code > 0 || image->qform_code > 0) {
+		const mat44& ijk = image->sform_code > 0 ? image->sto_ijk : image->qto_ijk;
+		for(int r = 0; r < 4; ++r)
+			for(int c = 0; c < 4; ++c)
+				m(r, c) = ijk.m[r][c];
+	} else {
+		m(0, 0) = image->dx > 0.0f ? 1.0f / image->dx : 1.0f;
+		m(1, 1) = image->dy > 0.0f ? 1.0f / image->dy : 1.0f;
+		m(2, 2) = image->dz > 0.0f ? 1.0f / image->dz : 1.0f;
+	}
+
+	set_volume(uvec3(image->nx, image->ny, image->nz), std::move(voxels), m);
+	return true;
+}
+
+void volume_sampler::set_volume(const uvec3& _resolution, std::vector<float>&& _data, const mat4& _world_to_voxel) {
+
+	resolution = _resolution;
+	data = std::move(_data);
+	world_to_voxel = _world_to_voxel;
+	update_affine();
+
+	if(data.size() != (size_t)resolution[0] * resolution[1] * resolution[2]) {
+		resolution = uvec3(0u);
+		data.clear();
+	}
+}
+
+void volume_sampler::set_position_transform(const mat4& _position_to_world) {
+
+	position_to_world = _position_to_world;
+	update_affine();
+}
+
+/*
+	Returns the voxel at the given coordinates or 0 outside of the volume.
+*/
+float volume_sampler::voxel(int x, int y, int z) const {
+
+	if(x < 0 || y < 0 || z < 0 || x >= (int)resolution[0] || y >= (int)resolution[1] || z >= (int)resolution[2])
+		return 0.0f;
+
+	return data[((size_t)z * resolution[1] + y) * resolution[0] + x];
+}
+
+float volume_sampler::sample(float x, float y, float z) const {
+
+	if(data.empty())
+		return 0.0f;
+
+	float v[3];
+	for(int r = 0; r < 3; ++r)
+		v[r] = affine[r][0] * x + affine[r][1] * y + affine[r][2] * z + affine[r][3];
+
+	// Positions more than one voxel outside have no contributing voxels, this also rejects NaN
+	const int nx = (int)resolution[0], ny = (int)resolution[1], nz = (int)resolution[2];
+	if(!(v[0] > -1.0f && v[1] > -1.0f && v[2] > -1.0f && v[0] < (float)nx && v[1] < (float)ny && v[2] < (float)nz))
+		return 0.0f;
+
+	float fx = std::floor(v[0]), fy = std::floor(v[1]), fz = std::floor(v[2]);
+	int x0 = (int)fx, y0 = (int)fy, z0 = (int)fz;
+	float ax = v[0] - fx, ay = v[1] - fy, az = v[2] - fz;
+
+	float c000, c100, c010, c110, c001, c101, c011, c111;
+
+	if(x0 >= 0 && y0 >= 0 && z0 >= 0 && x0 + 1 < nx && y0 + 1 < ny && z0 + 1 < nz) {
+		// All eight voxels are inside, read them without bounds checks
+		const size_t sy = (size_t)nx;
+		const size_t sz = (size_t)nx * ny;
+		const float* p = data.data() + (size_t)z0 * sz + (size_t)y0 * sy + x0;
+		c000 = p[0]; c100 = p[1];
+		c010 = p[sy]; c110 = p[sy + 1];
+		c001 = p[sz]; c101 = p[sz + 1];
+		c011 = p[sz + sy]; c111 = p[sz + sy + 1];
+	} else {
+		c000 = voxel(x0, y0, z0); c100 = voxel(x0 + 1, y0, z0);
+		c010 = voxel(x0, y0 + 1, z0); c110 = voxel(x0 + 1, y0 + 1, z0);
+		c001 = voxel(x0, y0, z0 + 1); c101 = voxel(x0 + 1, y0, z0 + 1);
+		c011 = voxel(x0, y0 + 1, z0 + 1); c111 = voxel(x0 + 1, y0 + 1, z0 + 1);
+	}
+
+	float c00 = c000 + ax * (c100 - c000);
+	float c10 = c010 + ax * (c110 - c010);
+	float c01 = c001 + ax * (c101 - c001);
+	float c11 = c011 + ax * (c111 - c011);
+	float c0 = c00 + ay * (c10 - c00);
+	float c1 = c01 + ay * (c11 - c01);
+
+	return c0 + az * (c1 - c0);
+}
+
+void volume_sampler::sample(util::span<const float> x, util::span<const float> y, util::span<const float> z, util::span<float> values, bool parallel) const {
+
+	const size_t n = std::min(std::min(x.size(), y.size()), std::min(z.size(), values.size()));
+
+	auto sample_range = [&](size_t begin, size_t end) {
+		for(size_t i = begin; i < end; ++i)
+			values[i] = sample(x[i], y[i], z[i]);
+	};
+
+	if(parallel)
+		util::parallel_for(n, sample_range);
+	else
+		sample_range(0, n);
+}
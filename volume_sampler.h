@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+
+#include <cgv/render/render_types.h>
+
+#include "span.h"
+#include "nifti1_io.h"
+
+/*
+	Trilinear sampler for scalar volumes like FA and MD. Positions are first mapped into the scanner space of
+	the volume by the position transform and then into continuous voxel coordinates by the NIfTI sform, or the
+	qform if the image has no sform, where integer coordinates are voxel centers. Samples outside the volume
+	fade to 0 over the border voxels, so no position can read out of bounds.
+*/
+class volume_sampler : public cgv::render::render_types {
+protected:
+	uvec3 resolution;
+	std::vector<float> data;
+	mat4 world_to_voxel;
+	mat4 position_to_world;
+	/// rows of the combined position to voxel transformation
+	float affine[3][4];
+
+	void update_affine();
+	float voxel(int x, int y, int z) const;
+
+public:
+	volume_sampler();
+
+	void clear();
+	bool empty() const { return data.empty(); }
+
+	/// copy the first volume of the image converted to float and take the voxel mapping from its sform or qform,
+	/// the position transform is kept
+	bool set_nifti(const nifti_image* image);
+	/// set the voxels in x-fastest order and the mapping from scanner space to voxel coordinates
+	void set_volume(const uvec3& resolution, std::vector<float>&& data, const mat4& world_to_voxel);
+	/// set the transformation from the positions that are sampled to the scanner space of the volume
+	void set_position_transform(const mat4& position_to_world);
+
+	const uvec3& get_resolution() const { return resolution; }
+	const std::vector<float>& get_data() const { return data; }
+	const mat4& get_world_to_voxel() const { return world_to_voxel; }
+	const mat4& get_position_transform() const { return position_to_world; }
+
+	/// returns the trilinearly interpolated value at the given position
+	float sample(float x, float y, float z) const;
+	/// samples the values at all positions given by their coordinates, optionally distributed over all threads
+	void sample(util::span<const float> x, util::span<const float> y, util::span<const float> z, util::span<float> values, bool parallel = false) const;
+};
@@ -0,0 +1,432 @@
+#include "volume_statistics.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <mutex>
+
+#include "parallel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define STATISTICS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define STATISTICS_SSE
+#endif
+
+namespace {
+
+	/// values are converted and filtered into blocks of this size, which stay in the L1 cache for all kernels
+	const size_t block_size = 2048;
+
+	/// returns the index of the bin of width 2^exponent that contains the value, bin 0 starts at 0
+	int64_t bin_index(float value, int exponent) {
+
+		return static_cast<int64_t>(std::floor(std::ldexp(static_cast<double>(value), -exponent)));
+	}
+
+	/*
+		Returns the smallest exponent of the bin width for values in [lo, hi]. Bins are at least two float ulps of
+		the largest magnitude wide, so the bin edges and the offsets of the values from the first edge stay exact
+		in float, and never narrower than the smallest normal float.
+	*/
+	int min_bin_exponent(float lo, float hi) {
+
+		const float m = std::max(std::fabs(lo), std::fabs(hi));
+		return m > 0.0f ? std::max(std::ilogb(m) - 22, -126) : -126;
+	}
+
+	/*
+		Adds the bins of src, which have a width of 2^src_exponent and start at bin src_first, to the bins of dst
+		with a width of 2^exponent starting at bin first. The width of dst is a power of two multiple of the width
+		of src, so every bin of src lies in exactly one bin of dst.
+	*/
+	void rebin(const std::vector<uint64_t>& src, int src_exponent, int64_t src_first, std::vector<uint64_t>& dst, int exponent, int64_t first) {
+
+		const int64_t last = static_cast<int64_t>(dst.size()) - 1;
+		for(size_t i = 0; i < src.size(); ++i) {
+			if(src[i] == 0u)
+				continue;
+
+			const double edge = std::ldexp(static_cast<double>(src_first + static_cast<int64_t>(i)), src_exponent - exponent);
+			const int64_t k = static_cast<int64_t>(std::floor(edge)) - first;
+			dst[static_cast<size_t>(std::min(std::max(k, int64_t(0)), last))] += src[i];
+		}
+	}
+
+	/*
+		Statistics of a part of the values, the mean and squared deviations are merged pairwise. With a fixed
+		range the histograms of all parts share their bins. Without one the histogram of every part has bins
+		of width 2^exponent starting at bin first, whose edges are multiples of the width. A part fits its bins
+		to its values and doubles the width when they no longer fit, so two parts are merged exactly by adding
+		the bins of the narrower one to the wider one.
+	*/
+	struct partial_statistics {
+		size_t count = 0;
+		float min = 0.0f;
+		float max = 0.0f;
+		double mean = 0.0;
+		double m2 = 0.0;
+		std::vector<uint64_t> histogram;
+
+		bool adaptive = false;
+		int exponent = INT_MIN;
+		int64_t first = 0;
+
+		/// moves the bins to the given width and first bin, which cover all values counted so far
+		void realign(int new_exponent, int64_t new_first) {
+
+			std::vector<uint64_t> bins(histogram.size(), 0u);
+			rebin(histogram, exponent, first, bins, new_exponent, new_first);
+			histogram.swap(bins);
+			exponent = new_exponent;
+			first = new_first;
+		}
+
+		/// makes the bins cover the values counted so far and [lo, hi] with a width of at least 2^min_exponent
+		void fit(float lo, float hi, int min_exponent) {
+
+			if(count > 0) {
+				lo = std::min(lo, min);
+				hi = std::max(hi, max);
+			}
+
+			int e = std::max(std::max(min_exponent, exponent), min_bin_exponent(lo, hi));
+			while(bin_index(hi, e) - bin_index(lo, e) >= static_cast<int64_t>(histogram.size()))
+				++e;
+
+			const int64_t f = bin_index(lo, e);
+			if(count == 0) {
+				exponent = e;
+				first = f;
+			} else if(e != exponent || f != first) {
+				realign(e, f);
+			}
+		}
+
+		void merge(size_t n, float block_min, float block_max, double block_mean, double block_m2) {
+
+			if(n == 0)
+				return;
+
+			if(count == 0) {
+				min = block_min;
+				max = block_max;
+			} else {
+				min = std::min(min, block_min);
+				max = std::max(max, block_max);
+			}
+
+			double total = static_cast<double>(count + n);
+			double delta = block_mean - mean;
+			mean += delta * static_cast<double>(n) / total;
+			m2 += block_m2 + delta * delta * static_cast<double>(count) * static_cast<double>(n) / total;
+			count += n;
+		}
+
+		void merge(const partial_statistics& other) {
+
+			if(adaptive) {
+				if(other.count > 0) {
+					fit(other.min, other.max, other.exponent);
+					rebin(other.histogram, other.exponent, other.first, histogram, exponent, first);
+				}
+			} else {
+				for(size_t i = 0; i < histogram.size() && i < other.histogram.size(); ++i)
+					histogram[i] += other.histogram[i];
+			}
+
+			merge(other.count, other.min, other.max, other.mean, other.m2);
+		}
+	};
+
+	/*
+		Converts the values to float with the value scaling and keeps the finite and, if requested, non-zero
+		ones. Returns the number of values written to dst.
+	*/
+	template<typename T>
+	size_t gather_block(const T* src, size_t n, float slope, float inter, bool ignore_zeros, float* dst) {
+
+		size_t k = 0;
+		for(size_t i = 0; i < n; ++i) {
+			float v = slope * static_cast<float>(src[i]) + inter;
+			dst[k] = v;
+			k += std::isfinite(v) && !(ignore_zeros && v == 0.0f) ? 1 : 0;
+		}
+		return k;
+	}
+
+	/*
+		Minimum, maximum and the sums of the deviations from the first value and of their squares. The shift
+		avoids the cancellation of summing squares of large values, the sums are accumulated in double.
+	*/
+	void block_moments(const float* v, size_t n, float& min, float& max, double& s1, double& s2) {
+
+		const float shift = v[0];
+		min = max = v[0];
+		s1 = s2 = 0.0;
+
+		size_t i = 0;
+
+#if defined(STATISTICS_AVX2)
+		__m256 vmin = _mm256_set1_ps(shift);
+		__m256 vmax = vmin;
+		const __m256d vshift = _mm256_set1_pd(shift);
+		__m256d vs1 = _mm256_setzero_pd();
+		__m256d vs2 = _mm256_setzero_pd();
+
+		for(; i + 8 <= n; i += 8) {
+			__m256 x = _mm256_loadu_ps(v + i);
+			vmin = _mm256_min_ps(vmin, x);
+			vmax = _mm256_max_ps(vmax, x);
+
+			__m256d lo = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), vshift);
+			__m256d hi = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), vshift);
+			vs1 = _mm256_add_pd(vs1, _mm256_add_pd(lo, hi));
+			vs2 = _mm256_add_pd(vs2, _mm256_add_pd(_mm256_mul_pd(lo, lo), _mm256_mul_pd(hi, hi)));
+		}
+
+		alignas(32) float fmin[8], fmax[8];
+		alignas(32) double d1[4], d2[4];
+		_mm256_store_ps(fmin, vmin);
+		_mm256_store_ps(fmax, vmax);
+		_mm256_store_pd(d1, vs1);
+		_mm256_store_pd(d2, vs2);
+		for(int k = 0; k < 8; ++k) {
+			min = std::min(min, fmin[k]);
+			max = std::max(max, fmax[k]);
+		}
+		for(int k = 0; k < 4; ++k) {
+			s1 += d1[k];
+			s2 += d2[k];
+		}
+#elif defined(STATISTICS_SSE)
+		__m128 vmin = _mm_set1_ps(shift);
+		__m128 vmax = vmin;
+		const __m128d vshift = _mm_set1_pd(shift);
+		__m128d vs1 = _mm_setzero_pd();
+		__m128d vs2 = _mm_setzero_pd();
+
+		for(; i + 4 <= n; i += 4) {
+			__m128 x = _mm_loadu_ps(v + i);
+			vmin = _mm_min_ps(vmin, x);
+			vmax = _mm_max_ps(vmax, x);
+
+			__m128d lo = _mm_sub_pd(_mm_cvtps_pd(x), vshift);
+			__m128d hi = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), vshift);
+			vs1 = _mm_add_pd(vs1, _mm_add_pd(lo, hi));
+			vs2 = _mm_add_pd(vs2, _mm_add_pd(_mm_mul_pd(lo, lo), _mm_mul_pd(hi, hi)));
+		}
+
+		alignas(16) float fmin[4], fmax[4];
+		alignas(16) double d1[2], d2[2];
+		_mm_store_ps(fmin, vmin);
+		_mm_store_ps(fmax, vmax);
+		_mm_store_pd(d1, vs1);
+		_mm_store_pd(d2, vs2);
+		for(int k = 0; k < 4; ++k) {
+			min = std::min(min, fmin[k]);
+			max = std::max(max, fmax[k]);
+		}
+		for(int k = 0; k < 2; ++k) {
+			s1 += d1[k];
+			s2 += d2[k];
+		}
+#endif
+
+		// Scalar fallback and remainder
+		for(; i < n; ++i) {
+			min = std::min(min, v[i]);
+			max = std::max(max, v[i]);
+			double d = static_cast<double>(v[i]) - shift;
+			s1 += d;
+			s2 += d * d;
+		}
+	}
+
+	/*
+		Adds the values to the histogram. The bin indices are computed and clamped for a whole register of
+		values at once.
+	*/
+	void block_histogram(const float* v, size_t n, float offset, float scale, unsigned bins, uint64_t* histogram) {
+
+		const float last = static_cast<float>(bins - 1u);
+
+		size_t i = 0;
+
+#if defined(STATISTICS_AVX2)
+		const __m256 voffset = _mm256_set1_ps(offset);
+		const __m256 vscale = _mm256_set1_ps(scale);
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 vlast = _mm256_set1_ps(last);
+		alignas(32) int idx[8];
+
+		for(; i + 8 <= n; i += 8) {
+			__m256 x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(v + i), voffset), vscale);
+			x = _mm256_min_ps(_mm256_max_ps(x, zero), vlast);
+			_mm256_store_si256((__m256i*)idx, _mm256_cvttps_epi32(x));
+
+			for(int k = 0; k < 8; ++k)
+				++histogram[idx[k]];
+		}
+#elif defined(STATISTICS_SSE)
+		const __m128 voffset = _mm_set1_ps(offset);
+		const __m128 vscale = _mm_set1_ps(scale);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 vlast = _mm_set1_ps(last);
+		alignas(16) int idx[4];
+
+		for(; i + 4 <= n; i += 4) {
+			__m128 x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(v + i), voffset), vscale);
+			x = _mm_min_ps(_mm_max_ps(x, zero), vlast);
+			_mm_store_si128((__m128i*)idx, _mm_cvttps_epi32(x));
+
+			for(int k = 0; k < 4; ++k)
+				++histogram[idx[k]];
+		}
+#endif
+
+		// Scalar fallback and remainder
+		for(; i < n; ++i) {
+			float x = (v[i] - offset) * scale;
+			x = std::min(std::max(x, 0.0f), last);
+			++histogram[static_cast<size_t>(x)];
+		}
+	}
+
+	/*
+		Reduces the values in blocks on all threads. Without a given range every block first fits the histogram
+		of its thread to the minimum and maximum of the block, so all values are binned in this single pass.
+	*/
+	template<typename T>
+	partial_statistics reduce(const T* data, size_t count, float slope, float inter, bool ignore_zeros, unsigned bins, float range_min, float range_max) {
+
+		const bool adaptive = !(range_max > range_min);
+		const float scale = adaptive ? 0.0f : static_cast<float>(bins) / (range_max - range_min);
+
+		partial_statistics result;
+		result.histogram.assign(bins, 0u);
+		result.adaptive = adaptive;
+		std::mutex mutex;
+
+		const size_t block_count = (count + block_size - 1) / block_size;
+
+		util::parallel_for(block_count, [&](size_t begin, size_t end) {
+			partial_statistics local;
+			local.histogram.assign(bins, 0u);
+			local.adaptive = adaptive;
+
+			float values[block_size];
+
+			for(size_t b = begin; b < end; ++b) {
+				const size_t first = b * block_size;
+				const size_t n = gather_block(data + first, std::min(block_size, count - first), slope, inter, ignore_zeros, values);
+				if(n == 0)
+					continue;
+
+				float min, max;
+				double s1, s2;
+				block_moments(values, n, min, max, s1, s2);
+
+				if(adaptive) {
+					local.fit(min, max, INT_MIN);
+					const float offset = static_cast<float>(std::ldexp(static_cast<double>(local.first), local.exponent));
+					block_histogram(values, n, offset, std::ldexp(1.0f, -local.exponent), bins, local.histogram.data());
+				} else {
+					block_histogram(values, n, range_min, scale, bins, local.histogram.data());
+				}
+
+				local.merge(n, min, max, values[0] + s1 / n, std::max(s2 - s1 * s1 / n, 0.0));
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			result.merge(local);
+		});
+
+		return result;
+	}
+
+	template<typename T>
+	util::volume_statistics compute(const T* data, size_t count, float slope, float inter, unsigned bins, bool ignore_zeros, float range_min, float range_max) {
+
+		util::volume_statistics stats;
+		if(!data || count == 0 || bins == 0u)
+			return stats;
+
+		partial_statistics result = reduce(data, count, slope, inter, ignore_zeros, bins, range_min, range_max);
+
+		// Without a given range the histogram covers the bins the values were fitted to
+		if(result.adaptive && result.count > 0) {
+			range_min = static_cast<float>(std::ldexp(static_cast<double>(result.first), result.exponent));
+			range_max = static_cast<float>(std::ldexp(static_cast<double>(result.first + bins), result.exponent));
+		}
+
+		stats.count = result.count;
+		stats.min = result.min;
+		stats.max = result.max;
+		stats.mean = result.mean;
+		stats.variance = result.count > 0 ? result.m2 / static_cast<double>(result.count) : 0.0;
+		stats.histogram_min = range_min;
+		stats.histogram_max = range_max;
+		stats.histogram = std::move(result.histogram);
+
+		return stats;
+	}
+}
+
+namespace util {
+
+	float volume_statistics::percentile(float fraction) const {
+
+		if(count == 0 || histogram.empty())
+			return 0.0f;
+
+		fraction = std::min(std::max(fraction, 0.0f), 1.0f);
+
+		const double target = fraction * static_cast<double>(count);
+		const float bin_width = (histogram_max - histogram_min) / static_cast<float>(histogram.size());
+
+		double sum = 0.0;
+		for(size_t i = 0; i < histogram.size(); ++i) {
+			double next = sum + static_cast<double>(histogram[i]);
+			if(next >= target && histogram[i] > 0) {
+				float a = static_cast<float>((target - sum) / static_cast<double>(histogram[i]));
+				float value = histogram_min + (static_cast<float>(i) + a) * bin_width;
+				return std::min(std::max(value, min), max);
+			}
+			sum = next;
+		}
+
+		return max;
+	}
+
+	volume_statistics compute_statistics(const float* data, size_t count, unsigned bins, bool ignore_zeros, float range_min, float range_max) {
+
+		return compute(data, count, 1.0f, 0.0f, bins, ignore_zeros, range_min, range_max);
+	}
+
+	volume_statistics compute_statistics(const nifti_image* image, unsigned bins, bool ignore_zeros, float range_min, float range_max) {
+
+		if(!image || !image->data || image->nx <= 0 || image->ny <= 0 || image->nz <= 0)
+			return volume_statistics();
+
+		const size_t count = (size_t)image->nx * image->ny * image->nz;
+		// A slope of 0 means the values are not scaled
+		const float slope = image->scl_slope != 0.0f ? image->scl_slope : 1.0f;
+		const float inter = image->scl_slope != 0.0f ? image->scl_inter : 0.0f;
+
+		switch(image->datatype) {
+		case DT_FLOAT32: return compute(static_cast<const float*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		case DT_FLOAT64: return compute(static_cast<const double*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		case DT_INT8: return compute(static_cast<const int8_t*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		case DT_UINT8: return compute(static_cast<const uint8_t*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		case DT_INT16: return compute(static_cast<const int16_t*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		case DT_UINT16: return compute(static_cast<const uint16_t*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		case DT_INT32: return compute(static_cast<const int32_t*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		case DT_UINT32: return compute(static_cast<const uint32_t*>(image->data), count, slope, inter, bins, ignore_zeros, range_min, range_max);
+		default:
+			return volume_statistics();
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nifti1_io.h"
+
+namespace util {
+
+	/*
+		Statistics of the finite values of a volume. The histogram has a fixed number of equally wide bins over
+		[histogram_min, histogram_max], values outside of this range are counted in the first or last bin.
+	*/
+	struct volume_statistics {
+		size_t count = 0;
+		float min = 0.0f;
+		float max = 0.0f;
+		double mean = 0.0;
+		double variance = 0.0;
+
+		float histogram_min = 0.0f;
+		float histogram_max = 0.0f;
+		std::vector<uint64_t> histogram;
+
+		/// returns the value below which the given fraction of the values lies, interpolated within the bins
+		float percentile(float fraction) const;
+	};
+
+	/// compute the statistics of count values in a single pass distributed over all threads, zeros are skipped if
+	/// ignore_zeros is set. The histogram covers [range_min, range_max] if it is not empty. Otherwise its bins have
+	/// a power of two width and cover [min, max], which uses about half of them or more unless the values span only a
+	/// few float ulps.
+	volume_statistics compute_statistics(const float* data, size_t count, unsigned bins = 256u, bool ignore_zeros = false, float range_min = 0.0f, float range_max = 0.0f);
+
+	/// compute the statistics of the first volume of the image after applying its value scaling, returns
+	/// statistics with a count of 0 for unsupported data types
+	volume_statistics compute_statistics(const nifti_image* image, unsigned bins = 256u, bool ignore_zeros = false, float range_min = 0.0f, float range_max = 0.0f);
+}
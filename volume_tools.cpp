@@ -0,0 +1,278 @@
+#include "volume_tools.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+
+#include "parallel.h"
+
+namespace util {
+
+	voxel_extent::voxel_extent(const uvec3& resolution) {
+
+		empty = resolution[0] == 0u || resolution[1] == 0u || resolution[2] == 0u;
+		if(!empty)
+			max = uvec3(resolution[0] - 1u, resolution[1] - 1u, resolution[2] - 1u);
+	}
+
+	axis_permutation::axis_permutation(unsigned a0, unsigned a1, unsigned a2, bool f0, bool f1, bool f2) {
+
+		axes[0] = a0;
+		axes[1] = a1;
+		axes[2] = a2;
+		flip[0] = f0;
+		flip[1] = f1;
+		flip[2] = f2;
+	}
+
+	bool axis_permutation::is_valid() const {
+
+		return axes[0] < 3u && axes[1] < 3u && axes[2] < 3u &&
+			axes[0] != axes[1] && axes[0] != axes[2] && axes[1] != axes[2];
+	}
+
+	uvec3 axis_permutation::apply(const uvec3& resolution) const {
+
+		return uvec3(resolution[axes[0]], resolution[axes[1]], resolution[axes[2]]);
+	}
+
+	/*
+		Every thread reduces whole z slabs into a local extent and merges it once per chunk. The slabs are scanned
+		row by row in memory order. A row is searched from the front for its first non-zero voxel and from the
+		back for its last one, so the voxels in between are never touched.
+	*/
+	voxel_extent find_nonzero_extent(const float* data, const uvec3& resolution) {
+
+		voxel_extent extent;
+
+		const size_t nx = resolution[0], ny = resolution[1], nz = resolution[2];
+		if(!data || nx == 0 || ny == 0 || nz == 0)
+			return extent;
+
+		std::mutex mutex;
+
+		parallel_for(nz, 1, [&](size_t begin, size_t end) {
+			voxel_extent local;
+
+			for(size_t z = begin; z < end; ++z) {
+				for(size_t y = 0; y < ny; ++y) {
+					const float* row = data + (z * ny + y) * nx;
+
+					size_t first = 0;
+					while(first < nx && row[first] == 0.0f)
+						++first;
+
+					if(first == nx)
+						continue;
+
+					size_t last = nx - 1;
+					while(row[last] == 0.0f)
+						--last;
+
+					if(local.empty) {
+						local.min = uvec3((unsigned)first, (unsigned)y, (unsigned)z);
+						local.max = uvec3((unsigned)last, (unsigned)y, (unsigned)z);
+						local.empty = false;
+					} else {
+						local.min[0] = std::min(local.min[0], (unsigned)first);
+						local.max[0] = std::max(local.max[0], (unsigned)last);
+						local.min[1] = std::min(local.min[1], (unsigned)y);
+						local.max[1] = std::max(local.max[1], (unsigned)y);
+						// Slabs are visited in increasing z, so only the maximum changes
+						local.max[2] = (unsigned)z;
+					}
+				}
+			}
+
+			if(local.empty)
+				return;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if(extent.empty) {
+				extent = local;
+			} else {
+				for(int i = 0; i < 3; ++i) {
+					extent.min[i] = std::min(extent.min[i], local.min[i]);
+					extent.max[i] = std::max(extent.max[i], local.max[i]);
+				}
+			}
+		});
+
+		return extent;
+	}
+
+	/*
+		The destination is written in memory order while the source is read with the stride of the source axis
+		mapped to each destination axis, negative for flipped axes. If the x axis stays the fastest axis, whole
+		rows are copied (or reversed) at once and the threads process the destination slabs. Otherwise the
+		reads of a row are scattered, so the volume is processed in tiles of 16x16x16 voxels, whose 256 source
+		cache lines stay in the L1 cache until all of their voxels have been used. The threads then process
+		blocks of 16 rows of 16 slabs each.
+	*/
+	void permute_axes(const float* data, const uvec3& resolution, const voxel_extent& extent, const axis_permutation& permutation, std::vector<float>& dst) {
+
+		if(!permutation.is_valid()) {
+			dst.clear();
+			return;
+		}
+
+		const uvec3 src_size = extent.get_size();
+		const uvec3 size = permutation.apply(src_size);
+		const size_t n0 = size[0], n1 = size[1], n2 = size[2];
+
+		dst.resize(n0 * n1 * n2);
+		if(dst.empty())
+			return;
+
+		const ptrdiff_t src_strides[3] = { 1, (ptrdiff_t)resolution[0], (ptrdiff_t)resolution[0] * resolution[1] };
+
+		// Source offset of the first destination voxel and source strides along the destination axes
+		ptrdiff_t base = 0;
+		for(int a = 0; a < 3; ++a)
+			base += (ptrdiff_t)extent.min[a] * src_strides[a];
+
+		ptrdiff_t stride[3];
+		for(int i = 0; i < 3; ++i) {
+			unsigned a = permutation.axes[i];
+			stride[i] = src_strides[a];
+			if(permutation.flip[i]) {
+				base += (ptrdiff_t)(src_size[a] - 1u) * stride[i];
+				stride[i] = -stride[i];
+			}
+		}
+
+		const float* src = data + base;
+		float* out = dst.data();
+
+		if(stride[0] == 1 || stride[0] == -1) {
+			parallel_for(n2, 1, [&](size_t begin, size_t end) {
+				for(size_t d2 = begin; d2 < end; ++d2) {
+					for(size_t d1 = 0; d1 < n1; ++d1) {
+						const float* row = src + (ptrdiff_t)d2 * stride[2] + (ptrdiff_t)d1 * stride[1];
+						float* dst_row = out + (d2 * n1 + d1) * n0;
+
+						if(stride[0] == 1) {
+							std::memcpy(dst_row, row, n0 * sizeof(float));
+						} else {
+							for(size_t d0 = 0; d0 < n0; ++d0)
+								dst_row[d0] = row[-(ptrdiff_t)d0];
+						}
+					}
+				}
+			});
+			return;
+		}
+
+		const size_t tile = 16;
+		const size_t blocks1 = (n1 + tile - 1) / tile;
+		const size_t blocks2 = (n2 + tile - 1) / tile;
+
+		parallel_for(blocks1 * blocks2, 1, [&](size_t begin, size_t end) {
+			for(size_t b = begin; b < end; ++b) {
+				const size_t b1 = (b % blocks1) * tile, e1 = std::min(b1 + tile, n1);
+				const size_t b2 = (b / blocks1) * tile, e2 = std::min(b2 + tile, n2);
+
+				for(size_t b0 = 0; b0 < n0; b0 += tile) {
+					const size_t e0 = std::min(b0 + tile, n0);
+
+					for(size_t d2 = b2; d2 < e2; ++d2) {
+						for(size_t d1 = b1; d1 < e1; ++d1) {
+							const float* row = src + (ptrdiff_t)d2 * stride[2] + (ptrdiff_t)d1 * stride[1];
+							float* dst_row = out + (d2 * n1 + d1) * n0;
+
+							for(size_t d0 = b0; d0 < e0; ++d0)
+								dst_row[d0] = row[(ptrdiff_t)d0 * stride[0]];
+						}
+					}
+				}
+			}
+		});
+	}
+
+#ifdef FIBER_BENCHMARKS
+	void benchmark_axis_permutation(const uvec3& resolution, unsigned repetitions) {
+
+		const size_t nx = resolution[0], ny = resolution[1], nz = resolution[2];
+		const size_t count = nx * ny * nz;
+		if(count == 0)
+			return;
+
+		std::vector<float> volume(count);
+		std::mt19937 rng(42u);
+		std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+		for(float& v : volume)
+			v = distribution(rng);
+
+		std::vector<float> reference(count);
+		std::vector<float> result;
+
+		const voxel_extent extent(resolution);
+
+		std::cout << "=====\nBenchmarking axis permutation of a " << nx << "x" << ny << "x" << nz << " volume" << std::endl;
+
+		double best_loop = 0.0;
+		double best_swap = 0.0;
+		for(unsigned i = 0; i < repetitions; ++i) {
+			// The per-voxel loop that filled the FA texture, with a division and a modulo per index conversion
+			auto start = std::chrono::steady_clock::now();
+			for(size_t j = 0; j < count; ++j) {
+				unsigned idx = (unsigned)j;
+				unsigned slab = (unsigned)(nx * nz);
+				unsigned c2 = idx / slab;
+				unsigned rest = idx - slab * c2;
+				unsigned c1 = rest / (unsigned)nx;
+				unsigned c0 = rest % (unsigned)nx;
+				std::swap(c1, c2);
+				reference[j] = volume[c2 * nx * ny + c1 * nx + c0];
+			}
+			double loop = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			start = std::chrono::steady_clock::now();
+			permute_axes(volume.data(), resolution, extent, axis_permutation::swap_yz(), result);
+			double swap = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+			double loop_rate = static_cast<double>(count) / loop * 1e-6;
+			double swap_rate = static_cast<double>(count) / swap * 1e-6;
+
+			std::cout << "run " << i << ": per-voxel loop " << loop_rate << " Mvoxels/s, permute_axes " << swap_rate << " Mvoxels/s" << std::endl;
+
+			best_loop = std::max(best_loop, loop_rate);
+			best_swap = std::max(best_swap, swap_rate);
+		}
+
+		std::cout << "best: per-voxel loop " << best_loop << " Mvoxels/s, permute_axes " << best_swap << " Mvoxels/s" << std::endl;
+		std::cout << "y/z swap matches the per-voxel loop: " << (result == reference ? "yes" : "NO") << std::endl;
+
+		// All permutations without and with flips of every axis, checked against a direct index computation
+		const unsigned permutations[6][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+		for(int flipped = 0; flipped < 2; ++flipped) {
+			for(const auto& axes : permutations) {
+				axis_permutation permutation(axes[0], axes[1], axes[2], flipped != 0, flipped != 0, flipped != 0);
+
+				auto start = std::chrono::steady_clock::now();
+				permute_axes(volume.data(), resolution, extent, permutation, result);
+				double time = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+				const uvec3 size = permutation.apply(resolution);
+				bool matches = result.size() == count;
+				for(size_t j = 0; matches && j < count; ++j) {
+					size_t d[3] = { j % size[0], (j / size[0]) % size[1], j / ((size_t)size[0] * size[1]) };
+					size_t s[3];
+					for(int k = 0; k < 3; ++k)
+						s[axes[k]] = permutation.flip[k] ? size[k] - 1 - d[k] : d[k];
+					matches = result[j] == volume[(s[2] * ny + s[1]) * nx + s[0]];
+				}
+
+				std::cout << "axes " << axes[0] << axes[1] << axes[2] << (flipped ? " flipped" : "        ") << ": "
+					<< static_cast<double>(count) / time * 1e-6 << " Mvoxels/s, " << (matches ? "correct" : "WRONG") << std::endl;
+			}
+		}
+
+		std::cout << "=====" << std::endl;
+	}
+#endif
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+
+#include <cgv/render/render_types.h>
+
+namespace util {
+
+	typedef cgv::render::render_types::uvec3 uvec3;
+
+	/*
+		Smallest box of voxels that contains all non-zero voxels of a volume in x-fastest order. The bounds are
+		inclusive, a volume without any non-zero voxel has an empty extent.
+	*/
+	struct voxel_extent {
+		uvec3 min = uvec3(0u);
+		uvec3 max = uvec3(0u);
+		bool empty = true;
+
+		voxel_extent() {}
+		/// extent covering a whole volume of the given resolution
+		voxel_extent(const uvec3& resolution);
+
+		uvec3 get_size() const { return empty ? uvec3(0u) : uvec3(max[0] - min[0] + 1u, max[1] - min[1] + 1u, max[2] - min[2] + 1u); }
+	};
+
+	/*
+		Reordering of the three axes of a volume. Axis i of the result is axis axes[i] of the source and runs in
+		the opposite direction if flip[i] is set, so all six permutations with any combination of flips can be
+		expressed.
+	*/
+	struct axis_permutation {
+		unsigned axes[3];
+		bool flip[3];
+
+		axis_permutation(unsigned a0 = 0u, unsigned a1 = 1u, unsigned a2 = 2u, bool f0 = false, bool f1 = false, bool f2 = false);
+
+		bool is_valid() const;
+		/// returns the resolution of a volume of the given resolution after the permutation
+		uvec3 apply(const uvec3& resolution) const;
+
+		/// swaps y and z, which turns the z-up volumes of NIfTI files into y-up volumes for OpenGL
+		static axis_permutation swap_yz() { return axis_permutation(0u, 2u, 1u); }
+	};
+
+	/// find the extent of the non-zero voxels, the z slabs are reduced in parallel
+	voxel_extent find_nonzero_extent(const float* data, const uvec3& resolution);
+
+	/// copy the voxels inside the extent of the volume to dst in the order given by the permutation, dst is
+	/// resized to the permuted size of the extent
+	void permute_axes(const float* data, const uvec3& resolution, const voxel_extent& extent, const axis_permutation& permutation, std::vector<float>& dst);
+
+#ifdef FIBER_BENCHMARKS
+	/// swap y and z of a volume of the given resolution with the per-voxel index computation used before
+	/// permute_axes and with permute_axes and all other permutations, print the voxels per second and check
+	/// that the results match
+	void benchmark_axis_permutation(const uvec3& resolution = uvec3(256u), unsigned repetitions = 5u);
+#endif
+}
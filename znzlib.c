@@ -41,6 +41,520 @@ NB: seeks for writable files with compression are quite restricted
  */
 
 
+
+#ifdef HAVE_LIBZ
+/*=================*/
+/* BGZF read path
+
+   A BGZF file is a series of gzip members of at most 64 KB each, whose
+   header carries the compressed member size in the extra subfield "BC".
+   The members can be located without inflating anything and inflated
+   independently, which gives constant time seeks and parallel reads.
+   The file is mapped and the block index is built lazily as far as it is
+   needed, so reading only the header of a large file stays cheap.
+   Files of any other layout, including single stream gzip files, are read
+   sequentially through zlib.
+*/
+/*=================*/
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <time.h>
+
+#define ZNZ_BGZF_MAX_BLOCK 65536
+#define ZNZ_BGZF_NO_BLOCK ((size_t)-1)
+/* reads of fewer blocks are inflated on the calling thread */
+#define ZNZ_BGZF_MIN_PARALLEL_BLOCKS 16
+
+static int znz_parallel_inflate = 1;
+
+struct znz_bgzf {
+	const unsigned char* data;   /* mapping of the compressed file */
+	size_t               size;
+	size_t               next;   /* offset of the first member not yet indexed */
+	int                  complete;
+
+	size_t   nblocks;
+	size_t   capacity;
+	size_t*  coffset;            /* offset of the deflate data of every block */
+	unsigned* csize;             /* size of the deflate data of every block */
+	unsigned* crc;               /* crc32 of every uncompressed block */
+	size_t*  uoffset;            /* uncompressed offset of every block and the total size */
+
+	size_t        pos;           /* uncompressed read position */
+	size_t        cached;        /* block held in cache or ZNZ_BGZF_NO_BLOCK */
+	z_stream      stream;
+	unsigned char cache[ZNZ_BGZF_MAX_BLOCK];
+};
+
+void znz_set_parallel_inflate(int enable) {
+	znz_parallel_inflate = enable;
+}
+
+static unsigned znz_le16(const unsigned char* p) {
+	return (unsigned)p[0] | ((unsigned)p[1] << 8);
+}
+
+static unsigned znz_le32(const unsigned char* p) {
+	return (unsigned)p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+/* returns the size of the BGZF member starting at p or 0 if there is none,
+   and the length of its header in hlen */
+static size_t znz_bgzf_member(const unsigned char* p, size_t avail, size_t* hlen) {
+	size_t xlen, i;
+
+	if(avail < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) return 0;
+
+	xlen = znz_le16(p + 10);
+	if(12 + xlen > avail) return 0;
+
+	/* search the extra field for the BC subfield holding the member size - 1 */
+	for(i = 12; i + 4 <= 12 + xlen; ) {
+		size_t slen = znz_le16(p + i + 2);
+		if(p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= 12 + xlen) {
+			size_t bsize = (size_t)znz_le16(p + i + 4) + 1;
+			size_t h = 12 + xlen;
+
+			/* skip the optional name, comment and header crc */
+			if(p[3] & 8) { while(h < avail && p[h]) ++h; ++h; }
+			if(p[3] & 16) { while(h < avail && p[h]) ++h; ++h; }
+			if(p[3] & 2) h += 2;
+
+			if(bsize > avail || h + 8 > bsize) return 0;
+			*hlen = h;
+			return bsize;
+		}
+		i += 4 + slen;
+	}
+	return 0;
+}
+
+/* index further blocks until the block containing upos is known or the
+   file ends, returns -1 if the file is not a valid BGZF file */
+static int znz_bgzf_index_to(struct znz_bgzf* bgzf, size_t upos) {
+	while(!bgzf->complete && bgzf->uoffset[bgzf->nblocks] <= upos) {
+		size_t hlen = 0, bsize;
+		unsigned isize;
+
+		if(bgzf->next == bgzf->size) {
+			bgzf->complete = 1;
+			break;
+		}
+
+		bsize = znz_bgzf_member(bgzf->data + bgzf->next, bgzf->size - bgzf->next, &hlen);
+		if(bsize == 0) return -1;
+
+		isize = znz_le32(bgzf->data + bgzf->next + bsize - 4);
+		if(isize > ZNZ_BGZF_MAX_BLOCK) return -1;
+
+		/* empty blocks, like the end of file marker, are not indexed */
+		if(isize > 0) {
+			if(bgzf->nblocks + 1 >= bgzf->capacity) {
+				size_t cap = bgzf->capacity * 2;
+				size_t* co = (size_t*)realloc(bgzf->coffset, cap * sizeof(size_t));
+				unsigned* cs = co ? (unsigned*)realloc(bgzf->csize, cap * sizeof(unsigned)) : NULL;
+				unsigned* cr = cs ? (unsigned*)realloc(bgzf->crc, cap * sizeof(unsigned)) : NULL;
+				size_t* uo = cr ? (size_t*)realloc(bgzf->uoffset, cap * sizeof(size_t)) : NULL;
+				if(co) bgzf->coffset = co;
+				if(cs) bgzf->csize = cs;
+				if(cr) bgzf->crc = cr;
+				if(!uo) return -1;
+				bgzf->uoffset = uo;
+				bgzf->capacity = cap;
+			}
+
+			bgzf->coffset[bgzf->nblocks] = bgzf->next + hlen;
+			bgzf->csize[bgzf->nblocks] = (unsigned)(bsize - hlen - 8);
+			bgzf->crc[bgzf->nblocks] = znz_le32(bgzf->data + bgzf->next + bsize - 8);
+			bgzf->uoffset[bgzf->nblocks + 1] = bgzf->uoffset[bgzf->nblocks] + isize;
+			++bgzf->nblocks;
+		}
+
+		bgzf->next += bsize;
+	}
+	return 0;
+}
+
+/* inflate block b to dst, which must hold the whole block */
+static int znz_bgzf_inflate(const struct znz_bgzf* bgzf, z_stream* stream, size_t b, unsigned char* dst) {
+	unsigned usize = (unsigned)(bgzf->uoffset[b + 1] - bgzf->uoffset[b]);
+
+	if(inflateReset(stream) != Z_OK) return -1;
+
+	stream->next_in = (Bytef*)(bgzf->data + bgzf->coffset[b]);
+	stream->avail_in = bgzf->csize[b];
+	stream->next_out = dst;
+	stream->avail_out = usize;
+
+	if(inflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out != usize) return -1;
+	if(crc32(0L, dst, usize) != bgzf->crc[b]) return -1;
+	return 0;
+}
+
+static void znz_bgzf_close(struct znz_bgzf* bgzf) {
+	if(bgzf == NULL) return;
+	inflateEnd(&bgzf->stream);
+#ifdef _WIN32
+	UnmapViewOfFile(bgzf->data);
+#else
+	munmap((void*)bgzf->data, bgzf->size);
+#endif
+	free(bgzf->coffset);
+	free(bgzf->csize);
+	free(bgzf->crc);
+	free(bgzf->uoffset);
+	free(bgzf);
+}
+
+/* map the file and return its reader if it is a BGZF file, NULL otherwise */
+static struct znz_bgzf* znz_bgzf_open(const char* path) {
+	struct znz_bgzf* bgzf;
+	const unsigned char* data;
+	size_t size, hlen;
+
+#ifdef _WIN32
+	{
+		HANDLE file, mapping;
+		LARGE_INTEGER fsize;
+
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(file == INVALID_HANDLE_VALUE) return NULL;
+		if(!GetFileSizeEx(file, &fsize) || fsize.QuadPart < 18) { CloseHandle(file); return NULL; }
+		size = (size_t)fsize.QuadPart;
+
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		CloseHandle(file);
+		if(mapping == NULL) return NULL;
+		data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if(data == NULL) return NULL;
+	}
+#else
+	{
+		struct stat st;
+		void* p;
+		int fd = open(path, O_RDONLY);
+		if(fd < 0) return NULL;
+		if(fstat(fd, &st) != 0 || st.st_size < 18) { close(fd); return NULL; }
+		size = (size_t)st.st_size;
+
+		p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(p == MAP_FAILED) return NULL;
+		data = (const unsigned char*)p;
+	}
+#endif
+
+	bgzf = (struct znz_bgzf*)calloc(1, sizeof(struct znz_bgzf));
+	if(bgzf == NULL || znz_bgzf_member(data, size, &hlen) == 0) {
+		free(bgzf);
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, size);
+#endif
+		return NULL;
+	}
+
+	bgzf->data = data;
+	bgzf->size = size;
+	bgzf->capacity = 64;
+	bgzf->coffset = (size_t*)malloc(bgzf->capacity * sizeof(size_t));
+	bgzf->csize = (unsigned*)malloc(bgzf->capacity * sizeof(unsigned));
+	bgzf->crc = (unsigned*)malloc(bgzf->capacity * sizeof(unsigned));
+	bgzf->uoffset = (size_t*)malloc(bgzf->capacity * sizeof(size_t));
+
+	/* raw inflate, the gzip framing is parsed by the index */
+	if(!bgzf->coffset || !bgzf->csize || !bgzf->crc || !bgzf->uoffset || inflateInit2(&bgzf->stream, -15) != Z_OK) {
+		free(bgzf->coffset);
+		free(bgzf->csize);
+		free(bgzf->crc);
+		free(bgzf->uoffset);
+		free(bgzf);
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, size);
+#endif
+		return NULL;
+	}
+
+	bgzf->uoffset[0] = 0;
+	bgzf->cached = ZNZ_BGZF_NO_BLOCK;
+	return bgzf;
+}
+
+static unsigned znz_thread_count(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (unsigned)info.dwNumberOfProcessors : 1u;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned)n : 1u;
+#endif
+}
+
+/* blocks first, first + step, ... before last are inflated by one thread */
+struct znz_bgzf_job {
+	const struct znz_bgzf* bgzf;
+	size_t first, last, step;
+	unsigned char* dst;          /* destination of block first - (first % step) */
+	size_t dst_offset;           /* uncompressed offset of dst */
+	int error;
+};
+
+#ifdef _WIN32
+static DWORD WINAPI znz_bgzf_worker(LPVOID arg)
+#else
+static void* znz_bgzf_worker(void* arg)
+#endif
+{
+	struct znz_bgzf_job* job = (struct znz_bgzf_job*)arg;
+	z_stream stream;
+	size_t b;
+
+	memset(&stream, 0, sizeof(stream));
+	if(inflateInit2(&stream, -15) != Z_OK) {
+		job->error = 1;
+		return 0;
+	}
+
+	for(b = job->first; b < job->last && !job->error; b += job->step)
+		if(znz_bgzf_inflate(job->bgzf, &stream, b, job->dst + (job->bgzf->uoffset[b] - job->dst_offset)) != 0)
+			job->error = 1;
+
+	inflateEnd(&stream);
+	return 0;
+}
+
+/* inflate the whole blocks first to last - 1 to dst, on all cores if there are enough of them */
+static int znz_bgzf_inflate_range(struct znz_bgzf* bgzf, size_t first, size_t last, unsigned char* dst) {
+	struct znz_bgzf_job jobs[64];
+	unsigned n, t;
+	int error = 0;
+
+	n = znz_thread_count();
+	if(n > 64) n = 64;
+	if(last - first < (size_t)n * 4) n = (unsigned)((last - first) / 4);
+	if(!znz_parallel_inflate || last - first < ZNZ_BGZF_MIN_PARALLEL_BLOCKS || n < 2) {
+		size_t b;
+		for(b = first; b < last; ++b)
+			if(znz_bgzf_inflate(bgzf, &bgzf->stream, b, dst + (bgzf->uoffset[b] - bgzf->uoffset[first])) != 0)
+				return -1;
+		return 0;
+	}
+
+	/* the blocks are interleaved over the threads, BGZF blocks have nearly equal sizes */
+	for(t = 0; t < n; ++t) {
+		jobs[t].bgzf = bgzf;
+		jobs[t].first = first + t;
+		jobs[t].last = last;
+		jobs[t].step = n;
+		jobs[t].dst = dst;
+		jobs[t].dst_offset = bgzf->uoffset[first];
+		jobs[t].error = 0;
+	}
+
+	{
+#ifdef _WIN32
+		HANDLE threads[64];
+		for(t = 1; t < n; ++t)
+			threads[t] = CreateThread(NULL, 0, znz_bgzf_worker, &jobs[t], 0, NULL);
+		znz_bgzf_worker(&jobs[0]);
+		for(t = 1; t < n; ++t) {
+			if(threads[t] == NULL) {
+				znz_bgzf_worker(&jobs[t]);
+			} else {
+				WaitForSingleObject(threads[t], INFINITE);
+				CloseHandle(threads[t]);
+			}
+		}
+#else
+		pthread_t threads[64];
+		int started[64];
+		for(t = 1; t < n; ++t)
+			started[t] = pthread_create(&threads[t], NULL, znz_bgzf_worker, &jobs[t]) == 0;
+		znz_bgzf_worker(&jobs[0]);
+		for(t = 1; t < n; ++t) {
+			if(started[t])
+				pthread_join(threads[t], NULL);
+			else
+				znz_bgzf_worker(&jobs[t]);
+		}
+#endif
+	}
+
+	for(t = 0; t < n; ++t)
+		error |= jobs[t].error;
+	return error ? -1 : 0;
+}
+
+/* returns the block containing upos, the index must cover upos */
+static size_t znz_bgzf_find(const struct znz_bgzf* bgzf, size_t upos) {
+	size_t lo = 0, hi = bgzf->nblocks;
+	while(hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if(bgzf->uoffset[mid] <= upos) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* read n bytes from the current position, returns the number of bytes read or -1 on error */
+static long long znz_bgzf_read(struct znz_bgzf* bgzf, unsigned char* dst, size_t n) {
+	size_t done = 0;
+
+	if(znz_bgzf_index_to(bgzf, bgzf->pos + n - (n > 0 ? 1 : 0)) != 0) return -1;
+
+	while(done < n && bgzf->pos < bgzf->uoffset[bgzf->nblocks]) {
+		size_t b = znz_bgzf_find(bgzf, bgzf->pos);
+		size_t end = bgzf->pos + (n - done);
+
+		if(bgzf->pos == bgzf->uoffset[b] && end >= bgzf->uoffset[b + 1]) {
+			/* whole blocks go straight to the destination */
+			size_t last = b + 1;
+			while(last < bgzf->nblocks && bgzf->uoffset[last + 1] <= end) ++last;
+
+			if(znz_bgzf_inflate_range(bgzf, b, last, dst + done) != 0) return -1;
+
+			done += bgzf->uoffset[last] - bgzf->pos;
+			bgzf->pos = bgzf->uoffset[last];
+		} else {
+			/* partial blocks at the ends of the range go through the cache */
+			size_t count;
+
+			if(bgzf->cached != b) {
+				bgzf->cached = ZNZ_BGZF_NO_BLOCK;
+				if(znz_bgzf_inflate(bgzf, &bgzf->stream, b, bgzf->cache) != 0) return -1;
+				bgzf->cached = b;
+			}
+
+			count = bgzf->uoffset[b + 1] - bgzf->pos;
+			if(count > n - done) count = n - done;
+
+			memcpy(dst + done, bgzf->cache + (bgzf->pos - bgzf->uoffset[b]), count);
+			done += count;
+			bgzf->pos += count;
+		}
+	}
+
+	return (long long)done;
+}
+
+static long znz_bgzf_seek(struct znz_bgzf* bgzf, long offset, int whence) {
+	long long target;
+
+	if(whence == SEEK_SET) target = offset;
+	else if(whence == SEEK_CUR) target = (long long)bgzf->pos + offset;
+	else {
+		if(znz_bgzf_index_to(bgzf, (size_t)-1) != 0) return -1;
+		target = (long long)bgzf->uoffset[bgzf->nblocks] + offset;
+	}
+
+	if(target < 0) return -1;
+	bgzf->pos = (size_t)target;
+	return (long)target;
+}
+
+long long znz_bgzf_size(znzFile file) {
+	if(file == NULL || file->bgzf == NULL) return -1;
+	if(znz_bgzf_index_to(file->bgzf, (size_t)-1) != 0) return -1;
+	return (long long)file->bgzf->uoffset[file->bgzf->nblocks];
+}
+
+#ifdef FIBER_BENCHMARKS
+/* wall clock time in seconds */
+static double znz_time(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+int znz_benchmark_read(const char* path, int repetitions) {
+	const size_t chunk = (size_t)1 << 26;
+	unsigned char* buf;
+	double best[2] = { 0.0, 0.0 };
+	size_t total[2] = { 0, 0 };
+	int previous = znz_parallel_inflate;
+	int r, mode;
+
+	buf = (unsigned char*)malloc(chunk);
+	if(buf == NULL) return -1;
+
+	printf("=====\nBenchmarking reading %s\n", path);
+
+	for(r = 0; r < repetitions; ++r) {
+		for(mode = 0; mode < 2; ++mode) {
+			znzFile file;
+			size_t n, sum = 0;
+			double start, seconds;
+
+			/* mode 0 uses the BGZF path if the file allows it, mode 1 plain zlib */
+			znz_set_parallel_inflate(mode == 0);
+
+			start = znz_time();
+			file = znzopen(path, "rb", 1);
+			if(znz_isnull(file)) {
+				znz_set_parallel_inflate(previous);
+				free(buf);
+				printf("could not open %s\n=====\n", path);
+				return -1;
+			}
+			if(mode == 0 && file->bgzf == NULL) printf("not a BGZF file, both runs use zlib\n");
+
+			while((n = znzread(buf, 1, chunk, file)) > 0) {
+				sum += n;
+				if(n < chunk) break;
+			}
+			znzclose(file);
+			seconds = znz_time() - start;
+			if(seconds < 1e-9) seconds = 1e-9;
+
+			total[mode] = sum;
+			if(sum / seconds > best[mode]) best[mode] = sum / seconds;
+			printf("run %d: %s %.1f MB/s (%lu bytes)\n", r, mode == 0 ? "parallel BGZF" : "zlib", sum / seconds * 1e-6, (unsigned long)sum);
+		}
+	}
+
+	printf("best: parallel BGZF %.1f MB/s, zlib %.1f MB/s, sizes %s\n=====\n", best[0] * 1e-6, best[1] * 1e-6, total[0] == total[1] ? "match" : "DIFFER");
+
+	znz_set_parallel_inflate(previous);
+	free(buf);
+	return total[0] == total[1] ? 0 : -1;
+}
+#endif
+#else
+
+void znz_set_parallel_inflate(int enable) {
+	(void)enable;
+}
+
+long long znz_bgzf_size(znzFile file) {
+	(void)file;
+	return -1;
+}
+
+#ifdef FIBER_BENCHMARKS
+int znz_benchmark_read(const char* path, int repetitions) {
+	(void)repetitions;
+	printf("cannot benchmark reading %s, znzlib was built without HAVE_LIBZ\n", path);
+	return -1;
+}
+#endif
+#endif
+
+
  /* Note extra argument (use_compression) where
 	use_compression==0 is no compression
 	use_compression!=0 uses zlib (gzip) compression
@@ -61,6 +575,10 @@ znzFile znzopen(const char *path, const char *mode, int use_compression) {
 
 	if(use_compression) {
 		file->withz = 1;
+		/* BGZF files opened for reading only get random access and parallel reads */
+		if(znz_parallel_inflate && strchr(mode, 'r') && !strchr(mode, '+') &&
+		   (file->bgzf = znz_bgzf_open(path)) != NULL)
+			return file;
 		if((file->zfptr = gzopen(path, mode)) == NULL) {
 			free(file);
 			file = NULL;
@@ -113,6 +631,7 @@ int Xznzclose(znzFile * file) {
 	if(*file != NULL) {
 #ifdef HAVE_LIBZ
 		if((*file)->zfptr != NULL) { retval = gzclose((*file)->zfptr); }
+		if((*file)->bgzf != NULL) { znz_bgzf_close((*file)->bgzf); }
 #endif
 		if((*file)->nzfptr != NULL) { retval = fclose((*file)->nzfptr); }
 
@@ -136,6 +655,14 @@ size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file) {
 #endif
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) {
+		long long nbytes = znz_bgzf_read(file->bgzf, (unsigned char *)buf, size * nmemb);
+		if(nbytes < 0) {
+			fprintf(stderr,"** znzread: corrupt BGZF block\n");
+			return (size_t)-1;
+		}
+		return size > 0 ? (size_t)nbytes / size : 0;
+	}
 	if(file->zfptr != NULL) {
 		/* gzread/write take unsigned int length, so maybe read in int pieces
 		   (noted by M Hanke, example given by M Adler)   6 July 2010 [rickr] */
@@ -170,6 +697,7 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file) {
 #endif
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) { return 0; }
 	if(file->zfptr != NULL) {
 		while(remain > 0) {
 			n2write = (remain < ZNZ_MAX_BLOCK_SIZE) ? remain : ZNZ_MAX_BLOCK_SIZE;
@@ -198,6 +726,7 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file) {
 long znzseek(znzFile file, long offset, int whence) {
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) return znz_bgzf_seek(file->bgzf, offset, whence);
 	if(file->zfptr != NULL) return (long)gzseek(file->zfptr, offset, whence);
 #endif
 	return fseek(file->nzfptr, offset, whence);
@@ -212,6 +741,7 @@ int znzrewind(znzFile stream) {
 	   if (stream->zfptr!=NULL) return gzrewind(stream->zfptr);
 	*/
 
+	if(stream->bgzf != NULL) return (int)znz_bgzf_seek(stream->bgzf, 0L, SEEK_SET);
 	if(stream->zfptr != NULL) return (int)gzseek(stream->zfptr, 0L, SEEK_SET);
 #endif
 	rewind(stream->nzfptr);
@@ -221,6 +751,7 @@ int znzrewind(znzFile stream) {
 long znztell(znzFile file) {
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) return (long)file->bgzf->pos;
 	if(file->zfptr != NULL) return (long)gztell(file->zfptr);
 #endif
 	return ftell(file->nzfptr);
@@ -229,6 +760,7 @@ long znztell(znzFile file) {
 int znzputs(const char * str, znzFile file) {
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) return -1;
 	if(file->zfptr != NULL) return gzputs(file->zfptr, str);
 #endif
 	return fputs(str, file->nzfptr);
@@ -238,6 +770,18 @@ int znzputs(const char * str, znzFile file) {
 char * znzgets(char* str, int size, znzFile file) {
 	if(file == NULL) { return NULL; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) {
+		int i = 0;
+		if(size <= 0) return NULL;
+		while(i < size - 1) {
+			unsigned char c;
+			if(znz_bgzf_read(file->bgzf, &c, 1) != 1) break;
+			str[i++] = (char)c;
+			if(c == '\n') break;
+		}
+		str[i] = '\0';
+		return i > 0 ? str : NULL;
+	}
 	if(file->zfptr != NULL) return gzgets(file->zfptr, str, size);
 #endif
 	return fgets(str, size, file->nzfptr);
@@ -247,6 +791,7 @@ char * znzgets(char* str, int size, znzFile file) {
 int znzflush(znzFile file) {
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) return 0;
 	if(file->zfptr != NULL) return gzflush(file->zfptr, Z_SYNC_FLUSH);
 #endif
 	return fflush(file->nzfptr);
@@ -256,6 +801,10 @@ int znzflush(znzFile file) {
 int znzeof(znzFile file) {
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) {
+		if(znz_bgzf_index_to(file->bgzf, file->bgzf->pos) != 0) return 1;
+		return file->bgzf->pos >= file->bgzf->uoffset[file->bgzf->nblocks];
+	}
 	if(file->zfptr != NULL) return gzeof(file->zfptr);
 #endif
 	return feof(file->nzfptr);
@@ -265,6 +814,7 @@ int znzeof(znzFile file) {
 int znzputc(int c, znzFile file) {
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) return -1;
 	if(file->zfptr != NULL) return gzputc(file->zfptr, c);
 #endif
 	return fputc(c, file->nzfptr);
@@ -274,6 +824,10 @@ int znzputc(int c, znzFile file) {
 int znzgetc(znzFile file) {
 	if(file == NULL) { return 0; }
 #ifdef HAVE_LIBZ
+	if(file->bgzf != NULL) {
+		unsigned char c;
+		return znz_bgzf_read(file->bgzf, &c, 1) == 1 ? (int)c : -1;
+	}
 	if(file->zfptr != NULL) return gzgetc(file->zfptr);
 #endif
 	return fgetc(file->nzfptr);
@@ -287,6 +841,10 @@ int znzprintf(znzFile stream, const char *format, ...) {
 	if(stream == NULL) { return 0; }
 	va_start(va, format);
 #ifdef HAVE_LIBZ
+	if(stream->bgzf != NULL) {
+		va_end(va);
+		return -1;
+	}
 	if(stream->zfptr != NULL) {
 		int size;  /* local to HAVE_LIBZ block */
 		size = strlen(format) + 1000000;  /* overkill I hope */
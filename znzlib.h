@@ -33,6 +33,10 @@ are required:
 
 NB: seeks for writable files with compression are quite restricted
 
+Compressed files that consist of BGZF blocks (as written by bgzip or
+htslib) are read with random access: seeks take constant time and large
+reads inflate the blocks on all cores.
+
 */
 /* changes by Oliver Granert:
 - change HAVE_ZLIB to HAVE_LIBZ to fit autoconf tests
@@ -70,11 +74,17 @@ extern "C" {
 #endif
 
 
+#ifdef HAVE_LIBZ
+	/* block index and state of a BGZF file opened for reading */
+	struct znz_bgzf;
+#endif
+
 	struct znzptr {
 		int withz;
 		FILE* nzfptr;
 #ifdef HAVE_LIBZ
 		gzFile zfptr;
+		struct znz_bgzf* bgzf;
 #endif
 	};
 
@@ -120,6 +130,20 @@ extern "C" {
 	int znzprintf(znzFile stream, const char *format, ...);
 #endif
 
+	/* enable (default) or disable the parallel BGZF read path, files opened
+	   while it is disabled are read sequentially through zlib */
+	void znz_set_parallel_inflate(int enable);
+
+	/* returns the uncompressed size of a BGZF file opened for reading, which
+	   indexes all of its blocks, or -1 for any other file */
+	long long znz_bgzf_size(znzFile file);
+
+#ifdef FIBER_BENCHMARKS
+	/* read the whole compressed file through the parallel BGZF path and
+	   through zlib, print the throughput of both and return 0 on success */
+	int znz_benchmark_read(const char* path, int repetitions);
+#endif
+
 	/*=================*/
 #ifdef  __cplusplus
 }